@@ -0,0 +1,101 @@
+#pragma once
+#include "include.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Silica {
+
+// A bump allocator for AST nodes. Nodes are carved out of large blocks and the whole
+// arena is released at once; only nodes that own other memory (vectors, maps) have
+// their destructors run, everything else is freed with the blocks.
+// Pointers returned by make() are valid until the Arena is destroyed.
+class Arena {
+public:
+	static constexpr size_t blockSize = 64 * 1024;
+
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	// 'other' is left empty, as adopt() leaves it
+	Arena(Arena&& other) noexcept:
+		blocks(std::move(other.blocks)), cursor(std::exchange(other.cursor, nullptr)), limit(std::exchange(other.limit, nullptr)),
+		cleanups(std::move(other.cleanups)), bytesUsed(std::exchange(other.bytesUsed, 0)) {}
+	Arena& operator=(Arena&&) = delete;
+
+	~Arena() {
+		clear();
+	}
+
+	// Destroys every node and releases the blocks, the arena can be used again afterwards
+	void clear() {
+		for (auto it = cleanups.rbegin(); it != cleanups.rend(); it++) {
+			it->destroy(it->object);
+		}
+		cleanups.clear();
+		blocks.clear();
+		cursor = nullptr;
+		limit = nullptr;
+		bytesUsed = 0;
+	}
+
+	template<typename T, typename... Args>
+	T* make(Args&&... args) {
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if constexpr (!std::is_trivially_destructible_v<T>) {
+			cleanups.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+		}
+		return object;
+	}
+
+	void* allocate(size_t size, size_t align) {
+		uintptr_t aligned = (uintptr_t(cursor) + align - 1) & ~uintptr_t(align - 1);
+		if (cursor == nullptr || aligned + size > uintptr_t(limit)) {
+			// Oversized requests get a block of their own
+			size_t newBlockSize = std::max(blockSize, size + align);
+			blocks.emplace_back(new std::byte[newBlockSize]);
+			cursor = blocks.back().get();
+			limit = cursor + newBlockSize;
+			aligned = (uintptr_t(cursor) + align - 1) & ~uintptr_t(align - 1);
+		}
+		cursor = reinterpret_cast<std::byte*>(aligned + size);
+		bytesUsed += size;
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	size_t bytesAllocated() const {
+		return bytesUsed;
+	}
+
+	// Takes over the nodes of 'other', for arenas filled on other threads. They live as long as this one,
+	// 'other' is left empty
+	void adopt(Arena&& other) {
+		blocks.insert(blocks.end(), std::make_move_iterator(other.blocks.begin()), std::make_move_iterator(other.blocks.end()));
+		cleanups.insert(cleanups.end(), other.cleanups.begin(), other.cleanups.end());
+		bytesUsed += other.bytesUsed;
+		other.blocks.clear();
+		other.cleanups.clear();
+		other.cursor = nullptr;
+		other.limit = nullptr;
+		other.bytesUsed = 0;
+	}
+
+private:
+	struct Cleanup {
+		void* object;
+		void (*destroy)(void*);
+	};
+	std::vector<std::unique_ptr<std::byte[]>> blocks;
+	std::byte* cursor = nullptr;
+	std::byte* limit = nullptr;
+	std::vector<Cleanup> cleanups;
+	size_t bytesUsed = 0;
+};
+
+}
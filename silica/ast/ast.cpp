@@ -8,14 +8,14 @@ namespace Silica {
 
 void Ast::print(std::ostream& out) {
 	out << "Functions:\n";
-	for (auto& i : functions) {
-		out << i.name << ":\n";
-		i.print(out, 1);
+	for (Function* i : functions) {
+		out << symbolName(i->name) << ":\n";
+		i->print(out, 1);
 	}
 
 	out << "Externs:\n";
 	for (auto& i : externs) {
-		out << i.first << ":\n";
+		out << symbolName(i.first) << ":\n";
 		i.second.print(out, 1);
 	}
 	out << '\n';
@@ -24,7 +24,7 @@ void Ast::print(std::ostream& out) {
 void Function::print(std::ostream& out, int tabs) {
 	out << Tabs(tabs) << "Arguments:\n";
 	for (auto& i : args) {
-		out << Tabs(tabs + 1) << i.first << " : " << i.second->name << '\n';
+		out << Tabs(tabs + 1) << symbolName(i.first) << " : " << i.second->name << '\n';
 	}
 	out << Tabs(tabs) << "Result:\n";
 	if (result == nullptr) {
@@ -37,7 +37,7 @@ void Function::print(std::ostream& out, int tabs) {
 void Extern::print(std::ostream& out, int tabs) {
 	out << Tabs(tabs) << "Arguments:\n";
 	for (auto& i : args) {
-		out << Tabs(tabs + 1) << i.first << " : " << i.second->name << '\n';
+		out << Tabs(tabs + 1) << symbolName(i.first) << " : " << i.second->name << '\n';
 	}
 }
 
@@ -45,6 +45,9 @@ void Block::print(std::ostream& stream, int tabs) {
 	stream
 		<< Tabs(tabs)
 		<< "Block:\n";
+	for (auto& [name, value] : consts) {
+		stream << Tabs(tabs + 1) << "Const " << symbolName(name) << " = " << value << '\n';
+	}
 	for (auto& expression : expressions) {
 		expression->print(stream, tabs + 1);
 	}
@@ -96,7 +99,7 @@ void DeclareVar::print(std::ostream& stream, int tabs) {
 		<< Tabs(tabs)
 		<< "DeclareVar:\n"
 		<< Tabs(tabs + 1)
-		<< "name:" << name << '\n'
+		<< "name:" << symbolName(name) << '\n'
 		<< Tabs(tabs + 1);
 }
 
@@ -105,7 +108,7 @@ void SetVarExpr::print(std::ostream& stream, int tabs) {
 		<< Tabs(tabs)
 		<< "SetVarExpr:\n"
 		<< Tabs(tabs + 1)
-		<< "name:" << name << '\n'
+		<< "name:" << symbolName(name) << '\n'
 		<< Tabs(tabs + 1)
 		<< "value:\n";
 	value->print(stream, tabs + 2);
@@ -116,7 +119,21 @@ void CallFuncExpr::print(std::ostream& stream, int tabs) {
 		<< Tabs(tabs)
 		<< "CallFuncExpr: \n"
 		<< Tabs(tabs + 1)
-		<< "name: " << func.name << '\n';
+		<< "name: " << symbolName(func.name) << '\n';
+	for (size_t i = 0; i < args.size(); i++) {
+		stream
+			<< Tabs(tabs + 1)
+			<< "args[" << i << "]: \n";
+		args[i]->print(stream, tabs + 2);
+	}
+}
+
+void CallExternExpr::print(std::ostream& stream, int tabs) {
+	stream
+		<< Tabs(tabs)
+		<< "CallExternExpr: \n"
+		<< Tabs(tabs + 1)
+		<< "name: " << symbolName(name) << '\n';
 	for (size_t i = 0; i < args.size(); i++) {
 		stream
 			<< Tabs(tabs + 1)
@@ -131,7 +148,11 @@ void Return::print(std::ostream& stream, int tabs) {
 		<< "Return:\n"
 		<< Tabs(tabs)
 		<< "value:\n";
-	value->print(stream, tabs + 1);
+	if (value == nullptr) {
+		stream << Tabs(tabs + 1) << "nil\n";
+	} else {
+		value->print(stream, tabs + 1);
+	}
 }
 
 void Let::print(std::ostream& stream, int tabs) {
@@ -139,12 +160,31 @@ void Let::print(std::ostream& stream, int tabs) {
 		<< Tabs(tabs)
 		<< "Let:\n"
 		<< Tabs(tabs + 1)
-		<< "name:" << name << '\n'
+		<< "name:" << symbolName(name) << '\n'
 		<< Tabs(tabs + 1)
 		<< "value:\n";
 	value->print(stream, tabs + 2);
 }
 
+void IfExpr::print(std::ostream& stream, int tabs) {
+	stream
+		<< Tabs(tabs)
+		<< "IfExpr:\n"
+		<< Tabs(tabs + 1)
+		<< "condition:\n";
+	condition->print(stream, tabs + 2);
+	stream
+		<< Tabs(tabs + 1)
+		<< "ifTrue:\n";
+	ifTrue->print(stream, tabs + 2);
+	if (ifFalse != nullptr) {
+		stream
+			<< Tabs(tabs + 1)
+			<< "ifFalse:\n";
+		ifFalse->print(stream, tabs + 2);
+	}
+}
+
 void GetVarExpr::print(std::ostream& stream, int tabs) {
 	stream
 		<< Tabs(tabs)
@@ -2,6 +2,8 @@
 #include "include.h"
 #include "types.h"
 #include "parsing/tokens.h"
+#include "parsing/symbols.h"
+#include "ast/arena.h"
 #include "compiling/compiler.h"
 extern "C" {
 	#include "xed/xed-interface.h"
@@ -34,10 +36,14 @@ struct Node;
 		struct NumLitExpr;
 		struct BinOpExpr;
 
+// Nodes live in their Ast's arena and are never deleted one by one, so the destructor
+// is left trivial: nodes that don't own memory cost nothing to free.
+// Pointers between nodes are plain pointers into the same arena.
 struct Node {
 	//Position position;
-	virtual ~Node() {}
 	virtual void print(std::ostream& stream, int tabs);
+protected:
+	~Node() = default;
 };
 
 enum class ValueType {
@@ -46,121 +52,123 @@ enum class ValueType {
 	temp     // anything else; result of function call, literals and products thereof
 };
 
-struct ValExpr;
-struct MutExpr;
-
-struct ExprBase: public Node {
-	const Type* type;
-	bool useful;
-	friend ValExpr;
-	friend MutExpr;
-private:
-	ExprBase() {};
-};
-
-// A value-expression references:
-//  - An immediate operand
-//  - The value at an address (with displacement, scale etc.)
-//  - A general purpose (64b) register
-// ...and can't be changed
-struct ValExpr : public ExprBase {
-	virtual xed_operand_t eval(Ast& ast) = 0;
-};
-
-// A mutable-expression references:
-//  - The value at an address (with displacement, scale etc.)
-//  - A general purpose (64b) register
-// ...and can be changed---- 
-struct MutExpr : public ExprBase {
-	virtual xed_operand_t eval(Ast& ast) = 0;
+// Which node an Expression is, so code that handles each one can switch on it instead of trying casts
+enum class ExprKind: uint8_t {
+	numLit,
+	binOp,
+	unaryOp,
+	getVar,
+	setVar,
+	callFunc,
+	callExtern,
+	ret,
+	let,
+	ifExpr,
+	block
 };
 
 struct Expression: public Node {
+	ExprKind kind;
 	ValueType valueType;
 	const Type* type = nullptr;
 	bool useful = true;
-	Expression() {};
-	Expression(ValueType valueType, const Type* type, bool useful):
-		valueType(valueType), type(type), useful(useful) {};
+	Expression(ExprKind kind): kind(kind) {};
+	Expression(ExprKind kind, ValueType valueType, const Type* type, bool useful):
+		kind(kind), valueType(valueType), type(type), useful(useful) {};
 };
 
 struct DeclareVar: public Node {
-	std::string name;
+	Symbol name;
 	const Type* type;
 	bool canBeChanged;
 	bool initialized = false; // TODO
-	xed_operand_t location;
+	// The block a let was declared in, nullptr for arguments
+	Block* block = nullptr;
 
-	DeclareVar(std::string name, const Type* type, bool canBeChanged) :
+	DeclareVar(Symbol name, const Type* type, bool canBeChanged) :
 		name(name), type(type), canBeChanged(canBeChanged) {};
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct Function: public Node {
-	std::vector<std::pair<std::string, const Type*>> args;
+	std::vector<std::pair<Symbol, const Type*>> args;
+	// One per argument, in the same order
+	std::vector<DeclareVar*> params;
 	const Type* returnType;
-	std::unique_ptr<Expression> result;
-	std::string name;
+	Expression* result;
+	Symbol name;
+	Function(Symbol name, std::vector<std::pair<Symbol, const Type*>> args, std::vector<DeclareVar*> params,
+	         const Type* returnType, Expression* result):
+		args(std::move(args)), params(std::move(params)), returnType(returnType), result(result), name(name) {};
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct Extern: public Node {
-	std::vector<std::pair<std::string, const Type*>> args;
+	std::vector<std::pair<Symbol, const Type*>> args;
 	const Type* returnType;
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct Block: public Expression {
 	Block* parent = nullptr;
-	std::unordered_map<std::string, double> consts;
-	std::vector<DeclareVar> variables;
-	std::vector<std::unique_ptr<Expression>> expressions;
+	// Lets in this block with a value known while parsing, they get no code of their own
+	std::unordered_map<Symbol, double> consts;
+	std::vector<DeclareVar*> variables;
+	std::vector<Expression*> expressions;
+	Block(): Expression(ExprKind::block) {};
 	void print(std::ostream& stream, int tabs);
 };
 
 struct Ast {
+	// Declared first so that it is destroyed after everything pointing into it
+	Arena arena;
+	// Counts the times the arena was cleared. A node made afterwards can be at the address of one from before,
+	// so whatever keeps node pointers across parses has to check it hasn't changed
+	uint64_t generation = 0;
 	int errorCount = 0;
 	std::string errors;
-	std::unordered_map<std::string, Extern> externs;
-	std::vector<Function> functions;
+	std::unordered_map<Symbol, Extern> externs;
+	// In declaration order
+	std::vector<Function*> functions;
+	std::unordered_map<Symbol, Function*> functionsByName;
 	Block* currentBlock = nullptr;
 	int currentStackDepth = 0;
-	xed_reg_enum_t currentReg = (xed_reg_enum_t) (int(XED_REG_RAX) - 1);
-	xed_reg_enum_t getReg() {
-		currentReg = (xed_reg_enum_t) (int(currentReg) + 1);
-		myAssert(currentReg <= XED_REG_R15, "Out of registers :(");
-		return currentReg;
-	}
-	xed_reg_enum_t returnReg() {
-		currentReg = (xed_reg_enum_t)(int(currentReg) - 1);
-		myAssert(currentReg >= (xed_reg_enum_t) (int(XED_REG_RAX) - 1));
-		return currentReg;
-	}
 
 	Ast() {};
+	// Allocates a node that lives as long as the Ast
+	template<typename T, typename... Args>
+	T* make(Args&&... args) {
+		return arena.make<T>(std::forward<Args>(args)...);
+	}
 	void print(std::ostream& out);
 };
 
 struct NumLitExpr : public Expression {
 	double value;
 	void print(std::ostream& stream, int tabs) override;
-	NumLitExpr(double value): Expression(ValueType::temp,  &Types::Float64, false), value(value) {}
+	NumLitExpr(double value): Expression(ExprKind::numLit, ValueType::temp,  &Types::Float64, false), value(value) {}
 };
 
 enum class BinOpType {
 	plus = (int)Token::plus,
 	minus = (int)Token::minus,
 	divide = (int)Token::divide,
-	multiply = (int)Token::multiply
+	multiply = (int)Token::multiply,
+	power = (int)Token::power,
+	// These give 1 when true and 0 when false
+	greater = (int)Token::greater,
+	smaller = (int)Token::smaller,
+	greaterEquals = (int)Token::greaterEquals,
+	smallerEquals = (int)Token::smallerEquals
 };
 
 struct BinOpExpr : public Expression {
-	std::unique_ptr<Expression> left;
-	std::unique_ptr<Expression> right;
+	Expression* left;
+	Expression* right;
 	BinOpType operation;
 
-	BinOpExpr(std::unique_ptr<Expression> newLeft, std::unique_ptr<Expression> newRight, BinOpType operation):
-		Expression(ValueType::temp, newLeft->type, false), left(std::move(newLeft)),right(std::move(newRight)), operation(operation) {
+	BinOpExpr(Expression* left, Expression* right, BinOpType operation):
+		Expression(ExprKind::binOp, ValueType::temp, left->type, false), left(left), right(right), operation(operation) {
 		myAssert(left->type == right->type);
 	};
 
@@ -172,35 +180,36 @@ enum class UnaryOpType {
 };
 
 struct UnaryOpExpr : public Expression {
-	std::unique_ptr<Expression> expr;
+	Expression* expr;
 	UnaryOpType operation;
 
-	UnaryOpExpr(std::unique_ptr<Expression> expr, UnaryOpType operation):
-		Expression(ValueType::temp, expr->type, false), expr(std::move(expr)), operation(operation) {};
+	UnaryOpExpr(Expression* expr, UnaryOpType operation):
+		Expression(ExprKind::unaryOp, ValueType::temp, expr->type, false), expr(expr), operation(operation) {};
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct ExternNode {
 	bool returnsDouble;
-	std::vector<std::string> args;
-	std::string name;
-	ExternNode(bool returnsDouble, std::vector<std::string> args, std::string name ):
+	std::vector<Symbol> args;
+	Symbol name;
+	ExternNode(bool returnsDouble, std::vector<Symbol> args, Symbol name):
 		returnsDouble(returnsDouble),args(args),name(name) {};
 };
 
 struct GetVarExpr: public Expression {
 	DeclareVar& decl;
 	GetVarExpr(DeclareVar& decl):
-		decl(decl), Expression(ValueType::mutRef, decl.type, false) {
+		decl(decl), Expression(ExprKind::getVar, ValueType::mutRef, decl.type, false) {
 	}
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct SetVarExpr : public Expression {
-	std::string& name;
-	std::unique_ptr<Expression> value;
-	SetVarExpr(DeclareVar& decl, std::unique_ptr<Expression> value_):
-		Expression(ValueType::temp, &Types::Void, true), name(decl.name), value(std::move(value_)) {
+	DeclareVar& decl;
+	Symbol name;
+	Expression* value;
+	SetVarExpr(DeclareVar& decl, Expression* value):
+		Expression(ExprKind::setVar, ValueType::temp, &Types::Void, true), decl(decl), name(decl.name), value(value) {
 		myAssert(value->type == decl.type);
 	};
 	void print(std::ostream& stream, int tabs) override;
@@ -208,49 +217,49 @@ struct SetVarExpr : public Expression {
 
 struct CallFuncExpr : public Expression {
 	Function& func;
-	std::vector<std::unique_ptr<Expression>> args;
-	CallFuncExpr(Function& func, std::vector<std::unique_ptr<Expression>> args) : func(func), args(std::move(args)) {};
+	std::vector<Expression*> args;
+	CallFuncExpr(Function& func, std::vector<Expression*> args):
+		Expression(ExprKind::callFunc, ValueType::temp, func.returnType, true), func(func), args(std::move(args)) {};
+	void print(std::ostream& stream, int tabs) override;
+};
+
+// A call to a C function declared with 'use'
+struct CallExternExpr : public Expression {
+	Symbol name;
+	std::vector<Expression*> args;
+	CallExternExpr(Symbol name, const Type* returnType, std::vector<Expression*> args):
+		Expression(ExprKind::callExtern, ValueType::temp, returnType, true), name(name), args(std::move(args)) {};
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct Return: public Expression {
-	std::unique_ptr<Expression> value;
-	Return(std::unique_ptr<Expression> value):
-		Expression(ValueType::temp, &Types::Void, true), value(std::move(value)) {}
+	Expression* value;
+	Return(Expression* value):
+		Expression(ExprKind::ret, ValueType::temp, &Types::Void, true), value(value) {}
 
 	void print(std::ostream& stream, int tabs) override;
 };
 
 struct Let: public Expression {
-	std::string name;
-	std::unique_ptr<Expression> value;
-	Let(std::string name, std::unique_ptr<Expression> value):
-		Expression(ValueType::temp, &Types::Void, true), name(name), value(std::move(value)) {};
+	Symbol name;
+	Expression* value;
+	Let(Symbol name, Expression* value):
+		Expression(ExprKind::let, ValueType::temp, &Types::Void, true), name(name), value(value) {};
 	void print(std::ostream& stream, int tabs) override;
 };
 
-template<size_t size>
-struct Operation: public ValExpr {
-	std::array<ExprBase, size> operands;
-	Token token;
-	xed_operand_t eval(Ast& ast) override {
-
-	}
-};
-
 struct IfExpr : Expression {
-	std::unique_ptr<Expression> condition;
-	std::unique_ptr<Expression> ifTrue;
-	std::unique_ptr<Expression> ifFalse;
-	IfExpr(std::unique_ptr<Expression> condition, 
-		std::unique_ptr<Expression> ifTrue_, std::unique_ptr<Expression> ifFalse_):
-
-		ifTrue(std::move(ifTrue_)), ifFalse(std::move(ifFalse_)), condition(std::move(condition)),
-		Expression(ValueType::temp, ifTrue->type, true)
+	Expression* condition;
+	Expression* ifTrue;
+	Expression* ifFalse;
+	IfExpr(Expression* condition, Expression* ifTrue, Expression* ifFalse):
+		Expression(ExprKind::ifExpr, ValueType::temp, ifTrue->type, true),
+		condition(condition), ifTrue(ifTrue), ifFalse(ifFalse)
 	{
 		myAssert(ifTrue != nullptr);
 		myAssert(ifFalse == nullptr || (ifFalse->valueType == ifTrue->valueType && ifFalse->type == ifTrue->type));
 	};
+	void print(std::ostream& stream, int tabs) override;
 };
 
 } // End namespace Silica
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "ast/flat.h"
+#include <unordered_map>
+
+using namespace Silica;
+
+namespace {
+
+struct Converter {
+	FlatAst& flat;
+	std::unordered_map<const DeclareVar*, uint32_t> variables;
+	std::unordered_map<const Function*, uint32_t> functions;
+
+	explicit Converter(FlatAst& flat): flat(flat) {}
+
+	uint32_t variable(const DeclareVar& decl) {
+		auto [it, inserted] = variables.try_emplace(&decl, uint32_t(flat.variableNames.size()));
+		if (inserted) {
+			flat.variableNames.push_back(decl.name);
+			flat.variableTypes.push_back(decl.type);
+		}
+		return it->second;
+	}
+
+	NodeIndex convert(const Expression* expr);
+
+	std::vector<NodeIndex> convertAll(std::initializer_list<const Expression*> exprs) {
+		std::vector<NodeIndex> result;
+		for (const Expression* expr : exprs) {
+			if (expr != nullptr) {
+				result.push_back(convert(expr));
+			}
+		}
+		return result;
+	}
+};
+
+}
+
+NodeIndex Converter::convert(const Expression* expr) {
+	myAssert(expr != nullptr);
+	// Children are converted first, so they get smaller indices than their parent
+	if (auto* lit = dynamic_cast<const NumLitExpr*>(expr)) {
+		flat.numbers.push_back(lit->value);
+		return flat.push(FlatKind::numLit, lit->type, uint32_t(flat.numbers.size() - 1), {});
+	}
+	if (auto* binOp = dynamic_cast<const BinOpExpr*>(expr)) {
+		return flat.push(FlatKind::binOp, binOp->type, uint32_t(binOp->operation), convertAll({ binOp->left, binOp->right }));
+	}
+	if (auto* unaryOp = dynamic_cast<const UnaryOpExpr*>(expr)) {
+		return flat.push(FlatKind::unaryOp, unaryOp->type, uint32_t(unaryOp->operation), convertAll({ unaryOp->expr }));
+	}
+	if (auto* getVar = dynamic_cast<const GetVarExpr*>(expr)) {
+		return flat.push(FlatKind::getVar, getVar->type, variable(getVar->decl), {});
+	}
+	if (auto* setVar = dynamic_cast<const SetVarExpr*>(expr)) {
+		return flat.push(FlatKind::setVar, setVar->type, variable(setVar->decl), convertAll({ setVar->value }));
+	}
+	if (auto* call = dynamic_cast<const CallFuncExpr*>(expr)) {
+		std::vector<NodeIndex> args;
+		for (const Expression* arg : call->args) {
+			args.push_back(convert(arg));
+		}
+		return flat.push(FlatKind::callFunc, call->type, functions.at(&call->func), args);
+	}
+	if (auto* call = dynamic_cast<const CallExternExpr*>(expr)) {
+		std::vector<NodeIndex> args;
+		for (const Expression* arg : call->args) {
+			args.push_back(convert(arg));
+		}
+		return flat.push(FlatKind::callExtern, call->type, uint32_t(call->name), args);
+	}
+	if (auto* ret = dynamic_cast<const Return*>(expr)) {
+		return flat.push(FlatKind::ret, ret->type, 0, convertAll({ ret->value }));
+	}
+	if (auto* let = dynamic_cast<const Let*>(expr)) {
+		return flat.push(FlatKind::let, let->type, uint32_t(let->name), convertAll({ let->value }));
+	}
+	if (auto* ifExpr = dynamic_cast<const IfExpr*>(expr)) {
+		return flat.push(FlatKind::ifExpr, ifExpr->type, 0, convertAll({ ifExpr->condition, ifExpr->ifTrue, ifExpr->ifFalse }));
+	}
+	if (auto* block = dynamic_cast<const Block*>(expr)) {
+		std::vector<NodeIndex> expressions;
+		expressions.reserve(block->expressions.size());
+		for (const Expression* expression : block->expressions) {
+			expressions.push_back(convert(expression));
+		}
+		return flat.push(FlatKind::block, block->type, 0, expressions);
+	}
+	unreachable();
+	return noNode;
+}
+
+NodeIndex FlatAst::push(FlatKind kind, const Type* type, uint32_t nodeData, const std::vector<NodeIndex>& nodeChildren) {
+	NodeIndex index = NodeIndex(kinds.size());
+	kinds.push_back(kind);
+	types.push_back(type);
+	data.push_back(nodeData);
+	firstChild.push_back(uint32_t(children.size()));
+	childCount.push_back(uint32_t(nodeChildren.size()));
+	children.insert(children.end(), nodeChildren.begin(), nodeChildren.end());
+	return index;
+}
+
+FlatAst FlatAst::from(const Ast& ast) {
+	FlatAst flat;
+	Converter converter(flat);
+	// Numbered up front, functions can call ones that come after them
+	for (const Silica::Function* function : ast.functions) {
+		converter.functions.emplace(function, uint32_t(converter.functions.size()));
+	}
+	for (const Silica::Function* function : ast.functions) {
+		uint32_t firstParam = uint32_t(flat.variableNames.size());
+		for (const DeclareVar* param : function->params) {
+			converter.variable(*param);
+		}
+		NodeIndex body = function->result != nullptr ? converter.convert(function->result) : noNode;
+		flat.functions.push_back({ function->name, function->returnType, body, firstParam, uint32_t(function->params.size()) });
+	}
+	return flat;
+}
+
+std::string_view Silica::describeFlatKind(FlatKind kind) {
+	switch (kind) {
+	case FlatKind::numLit: return "numLit";
+	case FlatKind::binOp: return "binOp";
+	case FlatKind::unaryOp: return "unaryOp";
+	case FlatKind::getVar: return "getVar";
+	case FlatKind::setVar: return "setVar";
+	case FlatKind::callFunc: return "callFunc";
+	case FlatKind::callExtern: return "callExtern";
+	case FlatKind::ret: return "ret";
+	case FlatKind::let: return "let";
+	case FlatKind::ifExpr: return "ifExpr";
+	case FlatKind::block: return "block";
+	default: unreachable();
+	}
+	return "";
+}
+
+void FlatAst::print(std::ostream& out) const {
+	out << "Nodes:\n";
+	for (NodeIndex i = 0; i < size(); i++) {
+		out << "  %" << i << " = " << describeFlatKind(kinds[i]);
+		switch (kinds[i]) {
+		case FlatKind::numLit:
+			out << ' ' << numbers[data[i]];
+			break;
+		case FlatKind::binOp:
+		case FlatKind::unaryOp:
+			out << ' ' << descibeToken(Token(data[i]));
+			break;
+		case FlatKind::getVar:
+		case FlatKind::setVar:
+			out << ' ' << symbolName(variableNames[data[i]]);
+			break;
+		case FlatKind::callFunc:
+			out << ' ' << symbolName(functions[data[i]].name);
+			break;
+		case FlatKind::callExtern:
+		case FlatKind::let:
+			out << ' ' << symbolName(Symbol(data[i]));
+			break;
+		default:
+			break;
+		}
+		for (const NodeIndex* child = childrenBegin(i); child != childrenEnd(i); child++) {
+			out << " %" << *child;
+		}
+		out << '\n';
+	}
+	out << "Functions:\n";
+	for (const Function& function : functions) {
+		out << "  " << symbolName(function.name) << '(';
+		for (uint32_t i = 0; i < function.paramCount; i++) {
+			out << (i == 0 ? "" : ", ") << symbolName(variableNames[function.firstParam + i]);
+		}
+		out << ") = %" << function.body << '\n';
+	}
+}
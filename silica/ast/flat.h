@@ -0,0 +1,83 @@
+#pragma once
+#include "include.h"
+#include "ast/ast.h"
+#include "parsing/symbols.h"
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// An index into the arrays of a FlatAst
+using NodeIndex = uint32_t;
+constexpr NodeIndex noNode = std::numeric_limits<NodeIndex>::max();
+
+enum class FlatKind: uint8_t {
+	numLit,   // data: index into numbers
+	binOp,    // data: BinOpType, children: lhs, rhs
+	unaryOp,  // data: UnaryOpType, children: value
+	getVar,   // data: variable index
+	setVar,   // data: variable index, children: value
+	callFunc, // data: function index, children: args
+	callExtern, // data: Symbol, children: args
+	ret,      // children: value, if there is one
+	let,      // data: Symbol, children: value
+	ifExpr,   // children: condition, ifTrue and ifFalse if there is one
+	block     // children: expressions
+};
+
+// The same tree as an Ast, stored as parallel arrays instead of linked nodes.
+// Nodes are numbered in post-order: children always come before their parent, so a pass
+// that needs the results of the children is one forward sweep over the arrays.
+// The children of a node are stored next to each other in 'children'.
+struct FlatAst {
+	struct Function {
+		Symbol name;
+		const Type* returnType;
+		// The function's Block
+		NodeIndex body;
+		// Variables [firstParam, firstParam + paramCount) are the arguments
+		uint32_t firstParam;
+		uint32_t paramCount;
+	};
+
+	// One entry per node
+	std::vector<FlatKind> kinds;
+	std::vector<const Type*> types;
+	std::vector<uint32_t> data;
+	// The node's children are children[firstChild, firstChild + childCount)
+	std::vector<uint32_t> firstChild;
+	std::vector<uint32_t> childCount;
+
+	std::vector<NodeIndex> children;
+	std::vector<double> numbers;
+	// One entry per variable (arguments and locals)
+	std::vector<Symbol> variableNames;
+	std::vector<const Type*> variableTypes;
+	// In the same order as Ast::functions
+	std::vector<Function> functions;
+
+	// Converts a parsed Ast, the Ast can be dropped afterwards
+	static FlatAst from(const Ast& ast);
+
+	size_t size() const {
+		return kinds.size();
+	}
+	const NodeIndex* childrenBegin(NodeIndex node) const {
+		return children.data() + firstChild[node];
+	}
+	const NodeIndex* childrenEnd(NodeIndex node) const {
+		return childrenBegin(node) + childCount[node];
+	}
+
+	void print(std::ostream& out) const;
+
+	// Appends a node, its children must already be in the arrays
+	NodeIndex push(FlatKind kind, const Type* type, uint32_t data, const std::vector<NodeIndex>& nodeChildren);
+};
+
+std::string_view describeFlatKind(FlatKind kind);
+
+}
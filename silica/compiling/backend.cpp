@@ -1 +1,503 @@
-#include "ast/ast.h"
+#include "compiling/backend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace Silica;
+
+namespace {
+	constexpr xed_reg_enum_t xmm(int n) {
+		return xed_reg_enum_t(int(XED_REG_XMM0) + n);
+	}
+	// Space left at the bottom of every frame for the callee, Windows x64 wants 32 bytes of it
+	constexpr int32_t shadowSpace = 32;
+	constexpr size_t maxArgs = 8;
+	// Where C functions take their first two integer arguments
+#if HOST == HOST_WIN
+	constexpr xed_reg_enum_t intArgs[] = { XED_REG_RCX, XED_REG_RDX };
+#else
+	constexpr xed_reg_enum_t intArgs[] = { XED_REG_RDI, XED_REG_RSI };
+#endif
+
+	// '**' is a call to this
+	double power(double base, double exponent) {
+		return std::pow(base, exponent);
+	}
+
+	MachineOperand virt(uint32_t vreg) {
+		return MachineOperand::virt(vreg);
+	}
+	MachineOperand fixed(xed_reg_enum_t reg) {
+		return MachineOperand::fixed(reg);
+	}
+	MachineOperand label(uint32_t label) {
+		return MachineOperand::target(MachineOperand::Kind::label, label);
+	}
+
+	X64Operand reg(xed_reg_enum_t reg) {
+		return X64Operand::fromReg(reg);
+	}
+	X64Operand memory(const Location& location, uint32_t widthBits = 64) {
+		return X64Operand::fromLocation(location, widthBits);
+	}
+
+	// Whether a move from 'source' to 'destination' would leave everything as it was
+	bool isSelfMove(const MachineOperand& destination, const MachineOperand& source, const RegisterAllocation& allocation) {
+		auto place = [&](const MachineOperand& op) {
+			if (op.kind == MachineOperand::Kind::reg) {
+				return op.reg;
+			}
+			return op.kind == MachineOperand::Kind::vreg ? allocation.regs[op.index] : XED_REG_INVALID;
+		};
+		if (destination.kind == MachineOperand::Kind::vreg && source.kind == MachineOperand::Kind::vreg
+		    && destination.index == source.index) {
+			return true;
+		}
+		return place(destination) != XED_REG_INVALID && place(destination) == place(source);
+	}
+}
+
+Backend::Backend(Compiler& compiler, const IrModule& module): compiler(compiler), module(module), links(&compiler.links) {
+	codeSection = compiler.sections.size();
+	compiler.sections.emplace_back(Rights::code);
+	addExterns(compiler);
+	powerExtern = compiler.addExtern("pow");
+	for (Symbol name : module.externs) {
+		moduleExterns.push_back(compiler.addExtern(symbolName(name)));
+	}
+}
+
+void Backend::addExterns(Compiler& compiler) {
+	// Named after the C function it calls, so objects written by writeElfObject link against libm
+	compiler.addExtern("pow", reinterpret_cast<const void*>(&power));
+}
+
+Backend::Backend(Compiler& compiler, const IrModule& module, size_t codeSection, std::vector<Link>& links):
+	codeSection(codeSection), compiler(compiler), module(module), links(&links) {}
+
+void Backend::compile() {
+	for (uint32_t i = 0; i < module.functions.size(); i++) {
+		compile(i);
+	}
+	// Every function has an entry point now
+	for (CallFixup& fixup : callFixups) {
+		patchRel32(fixup.dispOffset, entryPoints[fixup.callee]);
+	}
+	callFixups.clear();
+}
+
+void Backend::compile(ThreadPool& pool) {
+	size_t functionCount = module.functions.size();
+	codeSections.resize(functionCount);
+	entryPoints.resize(functionCount);
+	// The sections are made up front, the threads only ever touch their own.
+	// The first function goes into codeSection
+	for (size_t i = 0; i < functionCount; i++) {
+		codeSections[i] = i == 0 ? codeSection : compiler.sections.size();
+		if (i != 0) {
+			compiler.sections.emplace_back(Rights::code);
+		}
+	}
+
+	// A Backend per function, they keep the links and calls they make until every thread is done
+	std::vector<std::vector<Link>> functionLinks(functionCount);
+	std::vector<std::vector<CallFixup>> functionCalls(functionCount);
+	pool.forEach(functionCount, [&](size_t i) {
+		Backend worker(compiler, module, codeSections[i], functionLinks[i]);
+		worker.callTable = callTable;
+		worker.callCounters = callCounters;
+		worker.linkedCalls = true;
+		worker.powerExtern = powerExtern;
+		worker.moduleExterns = moduleExterns;
+		worker.compile(uint32_t(i));
+		entryPoints[i] = worker.entryPoints[i];
+		functionCalls[i] = std::move(worker.linkedCallFixups);
+	});
+
+	for (size_t i = 0; i < functionCount; i++) {
+		links->insert(links->end(), functionLinks[i].begin(), functionLinks[i].end());
+		for (CallFixup& call : functionCalls[i]) {
+			links->push_back({ codeSections[i], call.dispOffset, codeSections[call.callee], entryPoints[call.callee], Link::Kind::rel32 });
+		}
+	}
+}
+
+void Backend::compile(uint32_t function) {
+	codeSections.resize(module.functions.size(), codeSection);
+	entryPoints.resize(module.functions.size());
+	lowerFunction(module.functions[function]);
+	RegisterAllocation allocation = allocateRegisters(machineCode, vregCount, module.functions[function].paramCount, 0);
+	encodeFunction(function, allocation);
+}
+
+uint32_t Backend::newVreg() {
+	return vregCount++;
+}
+
+uint32_t Backend::newLabel() {
+	labels.push_back(0);
+	return uint32_t(labels.size() - 1);
+}
+
+void Backend::placeLabel(uint32_t label) {
+	labels[label] = uint32_t(machineCode.size());
+}
+
+uint32_t Backend::ownedCopy(ValueId value) {
+	if (useCounts[value] == 1) {
+		return vregs[value];
+	}
+	uint32_t copy = newVreg();
+	emit(0, XED_ICLASS_MOVAPD, virt(copy), virt(vregs[value]));
+	return copy;
+}
+
+void Backend::loadConstant(uint32_t vreg, double value) {
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	if (bits == 0) {
+		emit(0, XED_ICLASS_XORPD, virt(vreg), virt(vreg));
+		return;
+	}
+	emit(64, XED_ICLASS_MOV, fixed(XED_REG_RAX), MachineOperand::imm(bits, 64));
+	emit(64, XED_ICLASS_MOVQ, virt(vreg), fixed(XED_REG_RAX));
+}
+
+void Backend::lowerFunction(const IrFunction& function) {
+	std::string name(symbolName(function.name));
+	if (function.paramCount > maxArgs) {
+		throw Error("Function " + name + " has more than " + std::to_string(maxArgs) + " arguments");
+	}
+
+	machineCode.clear();
+	labels.clear();
+	vregCount = 0;
+	vregs.assign(function.values.size(), noValue);
+	useCounts.assign(function.values.size(), 0);
+	blockLabels.clear();
+	epilogueLabel = newLabel();
+	for (const IrBlock& block : function.blocks) {
+		blockLabels.push_back(newLabel());
+		for (ValueId value : block.instrs) {
+			const IrInstr& instr = function.values[value];
+			if (instr.type != &Types::Float64) {
+				throw Error("A value in " + name + " is a " + std::string(instr.type->name) + ", only Float64 is supported");
+			}
+			for (ValueId operand : instr.operands) {
+				useCounts[operand]++;
+			}
+			// Phis are written by the blocks before theirs, so they need their register up front
+			if (instr.op == IrOp::phi) {
+				vregs[value] = newVreg();
+			}
+		}
+		if (block.terminator.value != noValueId) {
+			useCounts[block.terminator.value]++;
+		}
+	}
+
+	for (BlockId b = 0; b < function.blocks.size(); b++) {
+		placeLabel(blockLabels[b]);
+		for (ValueId value : function.blocks[b].instrs) {
+			const IrInstr& instr = function.values[value];
+			if (instr.op != IrOp::phi) {
+				vregs[value] = lowerInstr(instr);
+			}
+		}
+		lowerTerminator(function, b);
+	}
+	placeLabel(epilogueLabel);
+}
+
+uint32_t Backend::lowerInstr(const IrInstr& instr) {
+	switch (instr.op) {
+	case IrOp::param: {
+		uint32_t vreg = newVreg();
+		emit(0, XED_ICLASS_MOVAPD, virt(vreg), fixed(xmm(int(instr.index))));
+		return vreg;
+	}
+	case IrOp::constant: {
+		uint32_t vreg = newVreg();
+		loadConstant(vreg, instr.number);
+		return vreg;
+	}
+	case IrOp::neg: {
+		// Negating flips the sign bit
+		uint32_t vreg = ownedCopy(instr.operands[0]);
+		uint32_t mask = newVreg();
+		loadConstant(mask, -0.0);
+		emit(0, XED_ICLASS_XORPD, virt(vreg), virt(mask));
+		return vreg;
+	}
+	case IrOp::pow:
+		return lowerCall(MachineOperand::target(MachineOperand::Kind::external, uint32_t(powerExtern)), instr.operands);
+	case IrOp::call:
+		return lowerCall(MachineOperand::target(MachineOperand::Kind::function, instr.index), instr.operands);
+	case IrOp::callExtern:
+		return lowerCall(MachineOperand::target(MachineOperand::Kind::external, uint32_t(moduleExterns[instr.index])), instr.operands);
+	case IrOp::phi:
+		unreachable();
+	default:
+		break;
+	}
+
+	// The result is computed in place of the left operand. 'a > b' is worked out as 'b < a' and 'a >= b' as 'b <= a',
+	// since the CMPSD predicates for less and less or equal are false when either operand is NaN
+	bool swapped = instr.op == IrOp::greater || instr.op == IrOp::greaterEquals;
+	uint32_t left = ownedCopy(instr.operands[swapped ? 1 : 0]);
+	uint32_t right = vregs[instr.operands[swapped ? 0 : 1]];
+	// CMPSD predicates
+	uint64_t predicate = 0;
+	switch (instr.op) {
+	case IrOp::add:
+		emit(0, XED_ICLASS_ADDSD, virt(left), virt(right));
+		break;
+	case IrOp::sub:
+		emit(0, XED_ICLASS_SUBSD, virt(left), virt(right));
+		break;
+	case IrOp::mul:
+		emit(0, XED_ICLASS_MULSD, virt(left), virt(right));
+		break;
+	case IrOp::div:
+		emit(0, XED_ICLASS_DIVSD, virt(left), virt(right));
+		break;
+	case IrOp::less:
+		predicate = 1;
+		break;
+	case IrOp::lessEquals:
+		predicate = 2;
+		break;
+	case IrOp::greaterEquals:
+		predicate = 2;
+		break;
+	case IrOp::greater:
+		predicate = 1;
+		break;
+	default:
+		unreachable();
+	}
+	if (predicate != 0) {
+		// The all ones mask from the comparison becomes 1.0
+		emit(0, XED_ICLASS_CMPSD_XMM, virt(left), virt(right), MachineOperand::imm(predicate, 8));
+		uint32_t one = newVreg();
+		loadConstant(one, 1);
+		emit(0, XED_ICLASS_ANDPD, virt(left), virt(one));
+	}
+	return left;
+}
+
+void Backend::lowerEdge(const IrFunction& function, BlockId from, BlockId to, bool mayFallThrough) {
+	const IrBlock& target = function.blocks[to];
+	size_t predIndex = std::find(target.preds.begin(), target.preds.end(), from) - target.preds.begin();
+	for (ValueId value : target.instrs) {
+		const IrInstr& instr = function.values[value];
+		if (instr.op != IrOp::phi) {
+			break;
+		}
+		emit(0, XED_ICLASS_MOVAPD, virt(vregs[value]), virt(vregs[instr.operands[predIndex]]));
+	}
+	if (!mayFallThrough || to != from + 1) {
+		emit(64, XED_ICLASS_JMP, label(blockLabels[to]));
+	}
+}
+
+void Backend::lowerTerminator(const IrFunction& function, BlockId block) {
+	const IrTerminator& terminator = function.blocks[block].terminator;
+	switch (terminator.kind) {
+	case IrTerminator::Kind::jump:
+		lowerEdge(function, block, terminator.targets[0], true);
+		return;
+	case IrTerminator::Kind::branch: {
+		uint32_t zero = newVreg();
+		loadConstant(zero, 0);
+		emit(0, XED_ICLASS_UCOMISD, virt(vregs[terminator.value]), virt(zero));
+		// 0 and NaN are false. When the false block has phis, the jump goes to the moves into them first
+		const IrBlock& ifFalse = function.blocks[terminator.targets[1]];
+		bool hasPhis = !ifFalse.instrs.empty() && function.values[ifFalse.instrs[0]].op == IrOp::phi;
+		if (!hasPhis) {
+			emit(64, XED_ICLASS_JZ, label(blockLabels[terminator.targets[1]]));
+			lowerEdge(function, block, terminator.targets[0], true);
+			return;
+		}
+		uint32_t falseEdge = newLabel();
+		emit(64, XED_ICLASS_JZ, label(falseEdge));
+		lowerEdge(function, block, terminator.targets[0], false);
+		placeLabel(falseEdge);
+		lowerEdge(function, block, terminator.targets[1], true);
+		return;
+	}
+	case IrTerminator::Kind::ret:
+		emit(0, XED_ICLASS_MOVAPD, fixed(XED_REG_XMM0), virt(vregs[terminator.value]));
+		if (block + 1 != function.blocks.size()) {
+			emit(64, XED_ICLASS_JMP, label(epilogueLabel));
+		}
+		return;
+	case IrTerminator::Kind::none:
+		break;
+	}
+	unreachable();
+}
+
+uint32_t Backend::lowerCall(MachineOperand target, const std::vector<ValueId>& args) {
+	if (args.size() > maxArgs) {
+		throw Error("Calls with more than " + std::to_string(maxArgs) + " arguments are not supported");
+	}
+	for (size_t i = 0; i < args.size(); i++) {
+		emit(0, XED_ICLASS_MOVAPD, fixed(xmm(int(i))), virt(vregs[args[i]]));
+	}
+
+	emit(64, XED_ICLASS_CALL_NEAR, target);
+	machineCode.back().argCount = uint8_t(args.size());
+
+	uint32_t result = newVreg();
+	emit(0, XED_ICLASS_MOVAPD, virt(result), fixed(XED_REG_XMM0));
+	return result;
+}
+
+void Backend::patchRel32(size_t dispOffset, size_t target) {
+	// Relative to the end of the instruction, which the rel32 is always at
+	int32_t disp = int32_t(int64_t(target) - int64_t(dispOffset + 4));
+	std::memcpy(&code().data[dispOffset], &disp, sizeof(disp));
+}
+
+void Backend::encodeTableAccess(xed_iclass_enum_t iclass, size_t offset, std::optional<X64Operand> imm) {
+	X64Operand entry = memory(Location(int32_t(0)));
+	size_t end = imm.has_value() ? compiler.addInstruction(code(), 64, iclass, { entry, *imm })
+	                             : compiler.addInstruction(code(), 64, iclass, { entry });
+	uint8_t trailing = imm.has_value() ? uint8_t(imm->width / 8) : 0;
+	links->push_back({ codeSection, end - 4 - trailing, callTable->section, offset, Link::Kind::ripDisp32, trailing });
+}
+
+void Backend::encodeFunction(uint32_t function, const RegisterAllocation& allocation) {
+	Section& section = code();
+	entryPoints[function] = section.data.size();
+	// Most instructions are 4 or 5 bytes, this saves growing the section again and again
+	section.data.reserve(section.data.size() + machineCode.size() * 6 + 64);
+
+	// Below the spill slots are the callee saved registers this function uses, whole
+	std::vector<std::pair<xed_reg_enum_t, Location>> saved;
+	int32_t frameBytes = allocation.spillBytes;
+	for (int i = 0; i < 16; i++) {
+		uint32_t used = allocation.usedXmms | (1u << (scratchXmm0 - XED_REG_XMM0)) | (1u << (scratchXmm1 - XED_REG_XMM0));
+		if ((calleeSavedXmms & used & (1u << i)) != 0) {
+			frameBytes += 16;
+			saved.emplace_back(xmm(i), Location(Gpr { Gpr::Reg::c_bp, Gpr::Type::gp64 }, -frameBytes));
+		}
+	}
+	// rsp is 16 byte aligned after 'push rbp', keep it that way for calls
+	frameBytes = (frameBytes + shadowSpace + 15) & ~15;
+
+	compiler.addInstruction(section, 64, XED_ICLASS_PUSH, { reg(XED_REG_RBP) });
+	compiler.addInstruction(section, 64, XED_ICLASS_MOV, { reg(XED_REG_RBP), reg(XED_REG_RSP) });
+	compiler.addInstruction(section, 64, XED_ICLASS_SUB, { reg(XED_REG_RSP), X64Operand::fromImm(frameBytes, 32) });
+	for (auto& [xmmReg, location] : saved) {
+		compiler.addInstruction(section, 0, XED_ICLASS_MOVUPS, { memory(location, 128), reg(xmmReg) });
+	}
+	size_t counterJump = 0;
+	size_t body = 0;
+	if (callCounters.has_value()) {
+		encodeTableAccess(XED_ICLASS_SUB, callCounters->offset + 8 * function, X64Operand::fromImm(1, 8));
+		counterJump = compiler.addInstruction(section, 64, XED_ICLASS_JZ, { X64Operand::fromRel32() }) - 4;
+		body = section.data.size();
+	}
+
+	// Offset of each instruction, and of the epilogue at the end
+	std::vector<size_t> offsets(machineCode.size() + 1);
+	std::vector<std::pair<size_t, uint32_t>> labelJumps;
+	for (size_t i = 0; i < machineCode.size(); i++) {
+		const MachineInstr& instr = machineCode[i];
+		offsets[i] = section.data.size();
+
+		if (callTable.has_value() && instr.operands[0].kind == MachineOperand::Kind::function) {
+			encodeTableAccess(XED_ICLASS_CALL_NEAR, callTable->offset + 8 * instr.operands[0].index);
+			continue;
+		}
+		// Copies whose ends were given the same register, such as a result already in xmm0
+		if (instr.iclass == XED_ICLASS_MOVAPD && isSelfMove(instr.operands[0], instr.operands[1], allocation)) {
+			continue;
+		}
+
+		// Spilled operands are loaded into the scratch registers, a spilled result is stored back afterwards
+		std::array<X64Operand, 3> ops;
+		for (size_t k = 0; k < instr.operandCount; k++) {
+			const MachineOperand& op = instr.operands[k];
+			switch (op.kind) {
+			case MachineOperand::Kind::reg:
+				ops[k] = reg(op.reg);
+				break;
+			case MachineOperand::Kind::vreg:
+				if (allocation.spills[op.index].has_value()) {
+					xed_reg_enum_t scratch = k == 0 ? scratchXmm0 : scratchXmm1;
+					if (k != 0 || readsFirstOperand(instr.iclass)) {
+						compiler.addInstruction(section, 0, XED_ICLASS_MOVSD_XMM, { reg(scratch), memory(*allocation.spills[op.index]) });
+					}
+					ops[k] = reg(scratch);
+				}
+				else {
+					ops[k] = reg(allocation.regs[op.index]);
+				}
+				break;
+			case MachineOperand::Kind::imm:
+				ops[k] = X64Operand::fromImm(int64_t(op.value), op.width);
+				break;
+			case MachineOperand::Kind::label:
+			case MachineOperand::Kind::function:
+			case MachineOperand::Kind::external:
+				ops[k] = X64Operand::fromRel32();
+				break;
+			default:
+				unreachable();
+			}
+		}
+
+		size_t end = compiler.addInstruction(section, instr.operandWidth, instr.iclass, ops.data(), instr.operandCount);
+
+		const MachineOperand& first = instr.operands[0];
+		if (first.kind == MachineOperand::Kind::label) {
+			labelJumps.emplace_back(end - 4, first.index);
+		}
+		else if (first.kind == MachineOperand::Kind::function) {
+			(linkedCalls ? linkedCallFixups : callFixups).push_back({ end - 4, first.index });
+		}
+		else if (first.kind == MachineOperand::Kind::external) {
+			links->push_back({ codeSection, end - 4, Compiler::externSection, first.index, Link::Kind::rel32 });
+		}
+		else if (first.kind == MachineOperand::Kind::vreg && allocation.spills[first.index].has_value()
+		         && writesFirstOperand(instr.iclass)) {
+			compiler.addInstruction(section, 0, XED_ICLASS_MOVSD_XMM, { memory(*allocation.spills[first.index]), reg(scratchXmm0) });
+		}
+	}
+	offsets[machineCode.size()] = section.data.size();
+	for (auto& [dispOffset, label] : labelJumps) {
+		patchRel32(dispOffset, offsets[labels[label]]);
+	}
+
+	for (auto& [xmmReg, location] : saved) {
+		compiler.addInstruction(section, 0, XED_ICLASS_MOVUPS, { reg(xmmReg), memory(location, 128) });
+	}
+	compiler.addInstruction(section, 64, XED_ICLASS_MOV, { reg(XED_REG_RSP), reg(XED_REG_RBP) });
+	compiler.addInstruction(section, 64, XED_ICLASS_POP, { reg(XED_REG_RBP) });
+	compiler.addInstruction(section, 64, XED_ICLASS_RET_NEAR);
+
+	if (callCounters.has_value()) {
+		// Out of the way: calls the hook with the arguments kept above its shadow space, then goes back to the body
+		patchRel32(counterJump, section.data.size());
+		const Gpr rsp { Gpr::Reg::a_sp, Gpr::Type::gp64 };
+		uint32_t paramCount = module.functions[function].paramCount;
+		int32_t saveBytes = shadowSpace + 16 * int32_t(paramCount);
+		compiler.addInstruction(section, 64, XED_ICLASS_SUB, { reg(XED_REG_RSP), X64Operand::fromImm(saveBytes, 32) });
+		for (uint32_t i = 0; i < paramCount; i++) {
+			compiler.addInstruction(section, 0, XED_ICLASS_MOVUPS, { memory(Location(rsp, shadowSpace + 16 * i), 128), reg(xmm(i)) });
+		}
+		compiler.addInstruction(section, 64, XED_ICLASS_MOV, { reg(intArgs[0]), X64Operand::fromImm(int64_t(uintptr_t(callCounters->context)), 64) });
+		compiler.addInstruction(section, 64, XED_ICLASS_MOV, { reg(intArgs[1]), X64Operand::fromImm(function, 64) });
+		compiler.addInstruction(section, 64, XED_ICLASS_MOV, { reg(XED_REG_RAX), X64Operand::fromImm(int64_t(uintptr_t(callCounters->hook)), 64) });
+		compiler.addInstruction(section, 64, XED_ICLASS_CALL_NEAR, { reg(XED_REG_RAX) });
+		for (uint32_t i = 0; i < paramCount; i++) {
+			compiler.addInstruction(section, 0, XED_ICLASS_MOVUPS, { reg(xmm(i)), memory(Location(rsp, shadowSpace + 16 * i), 128) });
+		}
+		compiler.addInstruction(section, 64, XED_ICLASS_ADD, { reg(XED_REG_RSP), X64Operand::fromImm(saveBytes, 32) });
+		size_t end = compiler.addInstruction(section, 64, XED_ICLASS_JMP, { X64Operand::fromRel32() });
+		patchRel32(end - 4, body);
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "include.h"
+#include "compiling/compiler.h"
+#include "compiling/ir.h"
+#include "compiling/regalloc.h"
+#include "compiling/threadpool.h"
+#include "compiling/x64.h"
+extern "C" {
+	#include "xed/xed-interface.h"
+}
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace Silica {
+
+// Lowers the functions of an IrModule to x86-64 machine code, into one code Section of a Compiler.
+// Every value is a Float64. A function is first lowered to MachineInstrs on virtual registers,
+// which allocateRegisters maps to XMM registers and stack slots, then it's encoded by Compiler::addInstruction.
+// Functions take their arguments in XMM0-7 and return in XMM0 like the System V ABI,
+// and preserve the host's calleeSavedXmms, so values can be kept in those across calls.
+class Backend {
+public:
+	struct Error: std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	Backend(Compiler& compiler, const IrModule& module);
+
+	// Adds the C functions compiled code calls to the compiler's externs, with their addresses
+	static void addExterns(Compiler& compiler);
+
+	// Compiles every function of the module, throws Backend::Error for what it can't compile
+	void compile();
+	// Compiles every function of the module into a code section of its own, on the threads of 'pool'.
+	// Calls between functions are linked by the Compiler
+	void compile(ThreadPool& pool);
+	// Compiles only 'function', which needs a callTable for its calls
+	void compile(uint32_t function);
+
+	// When set, calls load the callee's entry point from the 8 byte entry 'offset' + 8*callee of 'section'
+	// instead of going straight to it, so a function can be replaced by pointing its entry elsewhere
+	struct CallTable {
+		size_t section;
+		size_t offset;
+	};
+	std::optional<CallTable> callTable;
+	// When set, each function counts its calls down from the uint64_t at 'offset' + 8*function of callTable's section,
+	// and calls hook(context, function) when the count reaches 0
+	struct CallCounters {
+		size_t offset;
+		void (*hook)(void* context, uint64_t function);
+		void* context;
+	};
+	std::optional<CallCounters> callCounters;
+
+	// Index of the code section in compiler.sections
+	size_t codeSection;
+	// Index in compiler.sections of the code section each function is in, in the order of IrModule::functions.
+	// All of them are codeSection, unless the functions were compiled by a ThreadPool
+	std::vector<size_t> codeSections;
+	// Offset of each function's entry point in its code section
+	std::vector<size_t> entryPoints;
+
+private:
+	static constexpr uint32_t noValue = UINT32_MAX;
+
+	Compiler& compiler;
+	const IrModule& module;
+	// Where links are added, the compiler's own except for the Backends compiling on a pool's threads
+	std::vector<Link>* links;
+
+	// Compiles into 'codeSection' of 'compiler', which is there already
+	Backend(Compiler& compiler, const IrModule& module, size_t codeSection, std::vector<Link>& links);
+
+	// A rel32 in the code section that should point at a function's entry point
+	struct CallFixup {
+		size_t dispOffset;
+		uint32_t callee;
+	};
+	std::vector<CallFixup> callFixups;
+	// When set, calls to other functions are rel32s linked by the Compiler, made by compile(ThreadPool&)
+	// once every function has its entry point
+	bool linkedCalls = false;
+	std::vector<CallFixup> linkedCallFixups;
+	// The index of power in Compiler::externs, which '**' calls
+	size_t powerExtern;
+	// The index in Compiler::externs of each of IrModule::externs
+	std::vector<size_t> moduleExterns;
+
+	// Per function state
+	std::vector<MachineInstr> machineCode;
+	// The index in machineCode each label is at
+	std::vector<uint32_t> labels;
+	uint32_t epilogueLabel = 0;
+	uint32_t vregCount = 0;
+	// Per IR value: the virtual register holding it, and how often it's used
+	std::vector<uint32_t> vregs;
+	std::vector<uint32_t> useCounts;
+	// The label at the start of each IR block
+	std::vector<uint32_t> blockLabels;
+
+	Section& code() {
+		return compiler.sections[codeSection];
+	}
+
+	// Lowering
+	template<typename...Operands>
+	void emit(xed_uint_t operandWidth, xed_iclass_enum_t iclass, Operands...operands) {
+		MachineInstr instr { iclass, operandWidth, uint8_t(sizeof...(operands)), 0, { operands... } };
+		machineCode.push_back(instr);
+	}
+	uint32_t newVreg();
+	uint32_t newLabel();
+	void placeLabel(uint32_t label);
+	// A virtual register with the value of 'value' that may be overwritten: its own when this is its only use
+	uint32_t ownedCopy(ValueId value);
+	void loadConstant(uint32_t vreg, double value);
+
+	void lowerFunction(const IrFunction& function);
+	// Returns the virtual register holding the result
+	uint32_t lowerInstr(const IrInstr& instr);
+	void lowerTerminator(const IrFunction& function, BlockId block);
+	// Moves what the phis of 'to' get from 'from' into them, then goes to 'to'.
+	// The jump is left out when 'to' is next and nothing comes in between
+	void lowerEdge(const IrFunction& function, BlockId from, BlockId to, bool mayFallThrough);
+	// Calls 'target', a function or an external
+	uint32_t lowerCall(MachineOperand target, const std::vector<ValueId>& args);
+
+	// Encoding
+	void encodeFunction(uint32_t function, const RegisterAllocation& allocation);
+	// Encodes an instruction on [rip + <the entry at 'offset' in the callTable's section>] and maybe an immediate,
+	// the displacement is linked by the Compiler
+	void encodeTableAccess(xed_iclass_enum_t iclass, size_t offset, std::optional<X64Operand> imm = std::nullopt);
+	// Makes the rel32 at 'dispOffset' point at 'target'
+	void patchRel32(size_t dispOffset, size_t target);
+};
+
+}
@@ -0,0 +1,354 @@
+#include "compiling/bytecode.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+using namespace Silica;
+
+namespace {
+
+constexpr uint32_t maxRegisters = 256;
+constexpr size_t maxWide = UINT16_MAX;
+
+// Compiles one function. Registers are handed out like a stack: lets keep theirs until the function ends,
+// the temporaries of an expression are given back once it's done
+struct BytecodeBuilder {
+	BytecodeModule& module;
+	BytecodeFunction& function;
+	const std::unordered_map<const Function*, uint32_t>& functionIndices;
+	std::unordered_map<const DeclareVar*, uint8_t> variables;
+	std::unordered_map<uint64_t, uint16_t> constantIndices;
+	// The first free register
+	uint32_t top = 0;
+
+	// Stands for "the value isn't needed"
+	static constexpr int noTarget = -1;
+
+	BytecodeBuilder(BytecodeModule& module, BytecodeFunction& function,
+	                const std::unordered_map<const Function*, uint32_t>& functionIndices):
+		module(module), function(function), functionIndices(functionIndices) {}
+
+	uint8_t allocate() {
+		if (top == maxRegisters) {
+			throw BytecodeModule::Error("Function " + std::string(symbolName(function.name)) + " needs more than "
+			                            + std::to_string(maxRegisters) + " registers");
+		}
+		function.registerCount = std::max(function.registerCount, top + 1);
+		return uint8_t(top++);
+	}
+	size_t emit(Opcode op, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0) {
+		function.code.push_back({ op, a, b, c });
+		return function.code.size() - 1;
+	}
+	size_t emitWide(Opcode op, uint8_t a, size_t bc) {
+		if (bc > maxWide) {
+			throw BytecodeModule::Error("Function " + std::string(symbolName(function.name)) + " is too big for bytecode");
+		}
+		return emit(op, a, uint8_t(bc), uint8_t(bc >> 8));
+	}
+	// Makes the jump at 'jump' go to the next instruction
+	void patchJump(size_t jump) {
+		size_t target = function.code.size();
+		if (target > maxWide) {
+			throw BytecodeModule::Error("Function " + std::string(symbolName(function.name)) + " is too big for bytecode");
+		}
+		function.code[jump].setBc(uint16_t(target));
+	}
+	void loadConstant(uint8_t target, double number) {
+		uint64_t bits;
+		std::memcpy(&bits, &number, sizeof(bits));
+		auto [it, added] = constantIndices.emplace(bits, uint16_t(function.constants.size()));
+		if (added) {
+			if (function.constants.size() > maxWide) {
+				throw BytecodeModule::Error("Function " + std::string(symbolName(function.name)) + " has too many constants");
+			}
+			function.constants.push_back(number);
+		}
+		emitWide(Opcode::loadConstant, target, it->second);
+	}
+
+	void buildFunction(const Function& source);
+	// Puts the value of 'expr' in 'target', returns false for expressions without a value.
+	// With noTarget the value is worked out for what it does and dropped
+	bool build(const Expression* expr, int target);
+	// The register with the value of 'expr': a let's own, or a new temporary
+	uint8_t value(const Expression* expr, const char* what);
+	void valueInto(const Expression* expr, uint8_t target, const char* what);
+	// Puts 'args' in consecutive registers and gives the first, where a call's result ends up too
+	uint8_t arguments(const std::vector<const Expression*>& args);
+	void buildIf(const IfExpr& ifExpr);
+};
+
+}
+
+void BytecodeBuilder::buildFunction(const Function& source) {
+	for (size_t i = 0; i < source.params.size(); i++) {
+		variables[source.params[i]] = allocate();
+	}
+	if (source.result != nullptr) {
+		build(source.result, noTarget);
+	}
+	// Falling off the end returns 0
+	uint8_t zero = allocate();
+	loadConstant(zero, 0);
+	emit(Opcode::ret, zero);
+}
+
+uint8_t BytecodeBuilder::value(const Expression* expr, const char* what) {
+	if (auto* getVar = dynamic_cast<const GetVarExpr*>(expr)) {
+		return variables.at(&getVar->decl);
+	}
+	uint8_t temporary = allocate();
+	valueInto(expr, temporary, what);
+	return temporary;
+}
+
+void BytecodeBuilder::valueInto(const Expression* expr, uint8_t target, const char* what) {
+	if (!build(expr, target)) {
+		throw BytecodeModule::Error(std::string(what) + " has no value");
+	}
+}
+
+uint8_t BytecodeBuilder::arguments(const std::vector<const Expression*>& args) {
+	uint8_t base = allocate();
+	for (size_t i = 1; i < args.size(); i++) {
+		allocate();
+	}
+	for (size_t i = 0; i < args.size(); i++) {
+		valueInto(args[i], uint8_t(base + i), "An argument");
+	}
+	return base;
+}
+
+bool BytecodeBuilder::build(const Expression* expr, int target) {
+	myAssert(expr != nullptr);
+	uint32_t saved = top;
+	if (auto* setVar = dynamic_cast<const SetVarExpr*>(expr)) {
+		auto variable = variables.find(&setVar->decl);
+		uint8_t reg = variable != variables.end() ? variable->second : allocate();
+		valueInto(setVar->value, reg, "The value of a let");
+		variables[&setVar->decl] = reg;
+		return false;
+	}
+	if (auto* ret = dynamic_cast<const Return*>(expr)) {
+		uint8_t result;
+		if (ret->value != nullptr) {
+			result = value(ret->value, "The returned expression");
+		}
+		else {
+			result = allocate();
+			loadConstant(result, 0);
+		}
+		emit(Opcode::ret, result);
+		top = saved;
+		return false;
+	}
+	if (auto* ifExpr = dynamic_cast<const IfExpr*>(expr)) {
+		buildIf(*ifExpr);
+		return false;
+	}
+	if (auto* block = dynamic_cast<const Block*>(expr)) {
+		for (const Expression* expression : block->expressions) {
+			build(expression, noTarget);
+		}
+		return false;
+	}
+
+	// The rest have a value
+	uint8_t result = target != noTarget ? uint8_t(target) : allocate();
+	if (auto* literal = dynamic_cast<const NumLitExpr*>(expr)) {
+		loadConstant(result, literal->value);
+	}
+	else if (auto* getVar = dynamic_cast<const GetVarExpr*>(expr)) {
+		emit(Opcode::move, result, variables.at(&getVar->decl));
+	}
+	else if (auto* unaryOp = dynamic_cast<const UnaryOpExpr*>(expr)) {
+		emit(Opcode::neg, result, value(unaryOp->expr, "An operand of '-'"));
+	}
+	else if (auto* binOp = dynamic_cast<const BinOpExpr*>(expr); binOp != nullptr && binOp->operation == BinOpType::power) {
+		// Calls pow, as compiled code does
+		uint8_t base = arguments({ binOp->left, binOp->right });
+		emitWide(Opcode::callExtern, base, module.externIndex("pow", 2));
+		if (base != result) {
+			emit(Opcode::move, result, base);
+		}
+	}
+	else if (binOp != nullptr) {
+		uint8_t left = value(binOp->left, "An operand");
+		uint8_t right = value(binOp->right, "An operand");
+		Opcode op;
+		switch (binOp->operation) {
+		case BinOpType::plus: op = Opcode::add; break;
+		case BinOpType::minus: op = Opcode::sub; break;
+		case BinOpType::multiply: op = Opcode::mul; break;
+		case BinOpType::divide: op = Opcode::div; break;
+		case BinOpType::smaller: op = Opcode::less; break;
+		case BinOpType::smallerEquals: op = Opcode::lessEquals; break;
+		case BinOpType::greater: op = Opcode::greater; break;
+		case BinOpType::greaterEquals: op = Opcode::greaterEquals; break;
+		default: unreachable(); op = Opcode::add;
+		}
+		emit(op, result, left, right);
+	}
+	else if (auto* call = dynamic_cast<const CallFuncExpr*>(expr)) {
+		// The arguments go where the callee's frame starts, which is also where its result ends up
+		uint8_t base = arguments(std::vector<const Expression*>(call->args.begin(), call->args.end()));
+		emitWide(Opcode::call, base, functionIndices.at(&call->func));
+		if (base != result) {
+			emit(Opcode::move, result, base);
+		}
+	}
+	else if (auto* call = dynamic_cast<const CallExternExpr*>(expr)) {
+		uint8_t base = arguments(std::vector<const Expression*>(call->args.begin(), call->args.end()));
+		emitWide(Opcode::callExtern, base, module.externIndex(symbolName(call->name), uint32_t(call->args.size())));
+		if (base != result) {
+			emit(Opcode::move, result, base);
+		}
+	}
+	else {
+		throw BytecodeModule::Error("Can't compile this kind of expression to bytecode yet");
+	}
+	// A given target belongs to the caller, a result of its own is dropped
+	top = saved;
+	return true;
+}
+
+void BytecodeBuilder::buildIf(const IfExpr& ifExpr) {
+	uint32_t saved = top;
+	size_t toFalse = emitWide(Opcode::jumpIfZero, value(ifExpr.condition, "The condition of an if"), 0);
+	top = saved;
+	build(ifExpr.ifTrue, noTarget);
+	if (ifExpr.ifFalse != nullptr) {
+		size_t toEnd = emitWide(Opcode::jump, 0, 0);
+		patchJump(toFalse);
+		build(ifExpr.ifFalse, noTarget);
+		patchJump(toEnd);
+	}
+	else {
+		patchJump(toFalse);
+	}
+}
+
+BytecodeModule BytecodeModule::from(const Ast& ast, const BytecodeModule* previous) {
+	BytecodeModule module;
+	std::unordered_map<const Function*, uint32_t> functionIndices;
+	for (const Function* function : ast.functions) {
+		functionIndices.emplace(function, uint32_t(functionIndices.size()));
+	}
+	if (functionIndices.size() > maxWide + 1) {
+		throw Error("Bytecode can't call more than " + std::to_string(maxWide + 1) + " functions");
+	}
+	std::unordered_map<const Function*, const BytecodeFunction*> compiled;
+	module.astGeneration = ast.generation;
+	if (previous != nullptr && previous->astGeneration == ast.generation) {
+		for (const BytecodeFunction& function : previous->functions) {
+			compiled.emplace(function.source, &function);
+		}
+	}
+	module.functions.reserve(ast.functions.size());
+	for (const Function* source : ast.functions) {
+		auto old = compiled.find(source);
+		if (old != compiled.end() && old->second->body == source->result) {
+			BytecodeFunction& function = module.functions.emplace_back(*old->second);
+			// The callees are the same nodes, but they may have moved, and the externs may be in another order
+			for (Instruction& instr : function.code) {
+				if (instr.op == Opcode::call) {
+					instr.setBc(uint16_t(functionIndices.at(previous->functions[instr.bc()].source)));
+				}
+				else if (instr.op == Opcode::callExtern) {
+					const BytecodeExtern& called = previous->externs[instr.bc()];
+					instr.setBc(module.externIndex(called.name, called.argCount));
+				}
+			}
+			continue;
+		}
+		BytecodeFunction& function = module.functions.emplace_back();
+		function.name = source->name;
+		function.source = source;
+		function.body = source->result;
+		function.paramCount = uint32_t(source->params.size());
+		BytecodeBuilder builder(module, function, functionIndices);
+		builder.buildFunction(*source);
+	}
+	return module;
+}
+
+uint16_t BytecodeModule::externIndex(std::string_view name, uint32_t argCount) {
+	if (argCount > maxExternArgs) {
+		throw Error("Calls with more than " + std::to_string(maxExternArgs) + " arguments are not supported");
+	}
+	for (size_t i = 0; i < externs.size(); i++) {
+		if (externs[i].name == name) {
+			return uint16_t(i);
+		}
+	}
+	if (externs.size() > maxWide) {
+		throw Error("Bytecode can't call more than " + std::to_string(maxWide + 1) + " externs");
+	}
+	externs.push_back({ std::string(name), argCount });
+	return uint16_t(externs.size() - 1);
+}
+
+namespace {
+	const char* describe(Opcode op) {
+		switch (op) {
+		case Opcode::loadConstant: return "loadConstant";
+		case Opcode::move: return "move";
+		case Opcode::add: return "add";
+		case Opcode::sub: return "sub";
+		case Opcode::mul: return "mul";
+		case Opcode::div: return "div";
+		case Opcode::less: return "less";
+		case Opcode::lessEquals: return "lessEquals";
+		case Opcode::greater: return "greater";
+		case Opcode::greaterEquals: return "greaterEquals";
+		case Opcode::neg: return "neg";
+		case Opcode::jump: return "jump";
+		case Opcode::jumpIfZero: return "jumpIfZero";
+		case Opcode::call: return "call";
+		case Opcode::callExtern: return "callExtern";
+		case Opcode::ret: return "ret";
+		default: unreachable(); return "";
+		}
+	}
+}
+
+void BytecodeModule::print(std::ostream& out) const {
+	for (const BytecodeFunction& function : functions) {
+		out << "func " << symbolName(function.name) << " (" << function.paramCount << " params, "
+		    << function.registerCount << " registers)\n";
+		for (size_t i = 0; i < function.code.size(); i++) {
+			const Instruction& instr = function.code[i];
+			out << "  " << i << ": " << describe(instr.op);
+			switch (instr.op) {
+			case Opcode::loadConstant:
+				out << " r" << int(instr.a) << ", " << function.constants[instr.bc()];
+				break;
+			case Opcode::move:
+			case Opcode::neg:
+				out << " r" << int(instr.a) << ", r" << int(instr.b);
+				break;
+			case Opcode::jump:
+				out << ' ' << instr.bc();
+				break;
+			case Opcode::jumpIfZero:
+				out << " r" << int(instr.a) << ", " << instr.bc();
+				break;
+			case Opcode::call:
+				out << " r" << int(instr.a) << ", " << symbolName(functions[instr.bc()].name);
+				break;
+			case Opcode::callExtern:
+				out << " r" << int(instr.a) << ", " << externs[instr.bc()].name;
+				break;
+			case Opcode::ret:
+				out << " r" << int(instr.a);
+				break;
+			default:
+				out << " r" << int(instr.a) << ", r" << int(instr.b) << ", r" << int(instr.c);
+				break;
+			}
+			out << '\n';
+		}
+	}
+}
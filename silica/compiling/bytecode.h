@@ -0,0 +1,103 @@
+#pragma once
+#include "include.h"
+#include "ast/ast.h"
+#include "compiling/compiler.h"
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace Silica {
+
+// Operands: a, b, c are registers of the frame, 'bc' is b and c as one 16 bit number
+enum class Opcode: uint8_t {
+	loadConstant,  // a = constants[bc]
+	move,          // a = b
+	add,           // a = b + c
+	sub,
+	mul,
+	div,
+	// These give 1 when true and 0 when false
+	less,
+	lessEquals,
+	greater,
+	greaterEquals,
+	neg,           // a = -b
+	jump,          // to instruction bc
+	jumpIfZero,    // to instruction bc when a is 0 or NaN
+	call,          // a = functions[bc](a, a + 1, ...), the callee's frame starts at a
+	callExtern,    // a = externs[bc](a, a + 1, ...)
+	ret,           // returns a
+	count
+};
+
+struct Instruction {
+	Opcode op;
+	uint8_t a = 0;
+	uint8_t b = 0;
+	uint8_t c = 0;
+
+	uint16_t bc() const {
+		return uint16_t(b | (c << 8));
+	}
+	void setBc(uint16_t value) {
+		b = uint8_t(value);
+		c = uint8_t(value >> 8);
+	}
+};
+static_assert(sizeof(Instruction) == 4);
+
+struct BytecodeFunction {
+	Symbol name;
+	// What it was compiled from. Parser::reparse keeps a function's node but gives it a new body when it changed
+	const Function* source = nullptr;
+	const Expression* body = nullptr;
+	// The parameters are in the first registers
+	uint32_t paramCount = 0;
+	uint32_t registerCount = 0;
+	std::vector<Instruction> code;
+	std::vector<double> constants;
+};
+
+// A C function that bytecode calls, such as pow for '**'
+struct BytecodeExtern {
+	std::string name;
+	uint32_t argCount;
+};
+
+// Bytecode compiled straight from the Ast, for programs that finish before compiling them would.
+// Each function has a frame of up to 256 Float64 registers. Frames are windows onto one stack:
+// a call's arguments are the first registers of the callee's frame, so nothing is copied
+struct BytecodeModule {
+	struct Error: std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	// In the same order as Ast::functions
+	std::vector<BytecodeFunction> functions;
+	// What callExtern's bc refers to
+	std::vector<BytecodeExtern> externs;
+	// As many as compiled code passes in registers
+	static constexpr uint32_t maxExternArgs = 8;
+	// The Ast::generation of the Ast it was built from
+	uint64_t astGeneration = 0;
+
+	// Throws BytecodeModule::Error for expressions without the value they need, or functions too big for the encoding.
+	// Functions of 'previous', built from an earlier parse by the same Parser, are copied when their node and body
+	// are the same, with only their calls pointed at where the callees are now. Nothing is copied when the Parser
+	// cleared its arena in between
+	static BytecodeModule from(const Ast& ast, const BytecodeModule* previous = nullptr);
+
+	// The index in externs of the one called 'name', which is added when it isn't there.
+	// Throws BytecodeModule::Error for more than maxExternArgs arguments
+	uint16_t externIndex(std::string_view name, uint32_t argCount);
+
+	void print(std::ostream& out) const;
+};
+
+// Runs 'function', which takes no arguments. Throws BytecodeModule::Error when the calls go too deep.
+// Externs are called through the externs of 'compiler', as compiled code calls them: Backend::addExterns
+// gives it the ones Silica provides, the rest are looked up in the host. Throws Compiler::LinkError for one that isn't found
+double interpret(const BytecodeModule& module, uint32_t function, Compiler& compiler);
+
+}
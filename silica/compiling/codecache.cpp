@@ -0,0 +1,239 @@
+#include "compiling/codecache.h"
+#include "parsing/scan.h"
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+using namespace Silica;
+
+namespace {
+	constexpr char magic[4] = { 'S', 'L', 'C', 'C' };
+
+	// FNV-1a
+	uint64_t hashBytes(std::string_view bytes) {
+		uint64_t hash = 0xcbf29ce484222325;
+		for (char c : bytes) {
+			hash = (hash ^ uint8_t(c)) * 0x100000001b3;
+		}
+		return hash;
+	}
+
+	// Appends values in the host's byte order, entries are only ever read on the target that wrote them
+	struct Writer {
+		std::string bytes;
+
+		template<typename T>
+		void value(T value) {
+			char raw[sizeof(T)];
+			std::memcpy(raw, &value, sizeof(T));
+			bytes.append(raw, sizeof(T));
+		}
+		void string(std::string_view text) {
+			value<uint64_t>(text.size());
+			bytes.append(text);
+		}
+	};
+
+	// Reads what Writer wrote. Reading past the end leaves 'ok' false instead, for entries that were cut short
+	struct Reader {
+		std::string_view bytes;
+		bool ok = true;
+
+		template<typename T>
+		T value() {
+			T result {};
+			if (bytes.size() < sizeof(T)) {
+				ok = false;
+				return result;
+			}
+			std::memcpy(&result, bytes.data(), sizeof(T));
+			bytes.remove_prefix(sizeof(T));
+			return result;
+		}
+		std::string_view string() {
+			uint64_t size = value<uint64_t>();
+			if (bytes.size() < size) {
+				ok = false;
+				return {};
+			}
+			std::string_view result = bytes.substr(0, size_t(size));
+			bytes.remove_prefix(size_t(size));
+			return result;
+		}
+		// The number of entries that follow, each takes at least a byte
+		size_t count() {
+			uint64_t count = value<uint64_t>();
+			if (bytes.size() < count) {
+				ok = false;
+				return 0;
+			}
+			return size_t(count);
+		}
+	};
+
+	// Whether the 'size' bytes at 'offset' are inside 'data'
+	bool fits(size_t offset, size_t size, std::string_view data) {
+		return offset <= data.size() && size <= data.size() - offset;
+	}
+}
+
+CodeCache::Key CodeCache::keyFor(const Source& source, std::string_view pipeline) {
+	std::string features;
+	for (Scan::Mode mode : { Scan::Mode::sse2, Scan::Mode::avx2 }) {
+		if (Scan::supported(mode)) {
+			features += std::string(features.empty() ? "" : ",") + Scan::describe(mode);
+		}
+	}
+	std::ostringstream key;
+	key << "version " << version << '\n'
+	    << "target " << target << '\n'
+	    << "features " << features << '\n'
+	    << "passes " << pipeline << '\n'
+	    << "source " << std::hex << hashBytes(source.text()) << ' ' << std::dec << source.text().size() << '\n';
+	std::string text = key.str();
+	uint64_t hash = hashBytes(text);
+	return { std::move(text), hash };
+}
+
+std::filesystem::path CodeCache::pathFor(const Key& key) const {
+	std::ostringstream name;
+	name << std::hex << std::setw(16) << std::setfill('0') << key.hash << ".silicache";
+	return directory / name.str();
+}
+
+std::optional<std::pair<size_t, size_t>> CodeCache::load(const Key& key, Compiler& compiler) const {
+	// Mapped like a source file would be
+	std::optional<Source> entry = Source::fromFile(pathFor(key));
+	if (!entry.has_value()) {
+		return std::nullopt;
+	}
+	Reader reader { entry->text() };
+	if (reader.bytes.substr(0, sizeof(magic)) != std::string_view(magic, sizeof(magic))) {
+		return std::nullopt;
+	}
+	reader.bytes.remove_prefix(sizeof(magic));
+	if (reader.value<uint32_t>() != version || reader.string() != key.text) {
+		return std::nullopt;
+	}
+	size_t mainSection = size_t(reader.value<uint64_t>());
+	size_t mainOffset = size_t(reader.value<uint64_t>());
+
+	// Read everything before adding any of it to the compiler
+	struct StoredSection {
+		Rights rights;
+		std::string_view data;
+	};
+	std::vector<StoredSection> sections(reader.count());
+	for (StoredSection& section : sections) {
+		section.rights = Rights(reader.value<int32_t>());
+		section.data = reader.string();
+	}
+	std::vector<Link> links(reader.count());
+	for (Link& link : links) {
+		link.pointerSection = size_t(reader.value<uint64_t>());
+		link.pointerOffset = size_t(reader.value<uint64_t>());
+		link.pointeeSection = size_t(reader.value<uint64_t>());
+		link.pointeeOffset = size_t(reader.value<uint64_t>());
+		link.kind = Link::Kind(reader.value<uint8_t>());
+		link.trailing = reader.value<uint8_t>();
+	}
+	std::vector<std::string_view> externs(reader.count());
+	for (std::string_view& name : externs) {
+		name = reader.string();
+	}
+	if (!reader.ok || !reader.bytes.empty() || mainSection >= sections.size() || !fits(mainOffset, 1, sections[mainSection].data)) {
+		return std::nullopt;
+	}
+	// A corrupt entry mustn't make linking write outside of its sections
+	for (const StoredSection& section : sections) {
+		if (section.rights != Rights::code && section.rights != Rights::rodata && section.rights != Rights::rwdata) {
+			return std::nullopt;
+		}
+	}
+	for (const Link& link : links) {
+		if (link.pointerSection >= sections.size() || link.kind > Link::Kind::ripDisp32) {
+			return std::nullopt;
+		}
+		size_t width = link.kind == Link::Kind::abs64 ? sizeof(uint64_t) : sizeof(int32_t) + link.trailing;
+		bool pointee = link.pointeeSection == Compiler::externSection
+			? link.pointeeOffset < externs.size()
+			: link.pointeeSection < sections.size() && link.pointeeOffset <= sections[link.pointeeSection].data.size();
+		if (!pointee || !fits(link.pointerOffset, width, sections[link.pointerSection].data)) {
+			return std::nullopt;
+		}
+	}
+
+	size_t firstSection = compiler.sections.size();
+	for (StoredSection& section : sections) {
+		compiler.sections.emplace_back(section.rights);
+		compiler.sections.back().data.assign(section.data.begin(), section.data.end());
+	}
+	// The compiler may know some of the externs already, with their addresses
+	std::vector<size_t> externIndices;
+	for (std::string_view name : externs) {
+		externIndices.push_back(compiler.addExtern(name));
+	}
+	for (Link link : links) {
+		link.pointerSection += firstSection;
+		if (link.pointeeSection == Compiler::externSection) {
+			link.pointeeOffset = externIndices[link.pointeeOffset];
+		}
+		else {
+			link.pointeeSection += firstSection;
+		}
+		compiler.links.push_back(link);
+	}
+	return std::pair { firstSection + mainSection, mainOffset };
+}
+
+bool CodeCache::store(const Key& key, const Compiler& compiler, size_t mainSection, size_t mainOffset) const {
+	Writer writer;
+	writer.bytes.append(magic, sizeof(magic));
+	writer.value<uint32_t>(version);
+	writer.string(key.text);
+	writer.value<uint64_t>(mainSection);
+	writer.value<uint64_t>(mainOffset);
+	writer.value<uint64_t>(compiler.sections.size());
+	for (const Section& section : compiler.sections) {
+		writer.value<int32_t>(int32_t(section.rights));
+		writer.string(std::string_view(reinterpret_cast<const char*>(section.data.data()), section.data.size()));
+	}
+	writer.value<uint64_t>(compiler.links.size());
+	for (const Link& link : compiler.links) {
+		writer.value<uint64_t>(link.pointerSection);
+		writer.value<uint64_t>(link.pointerOffset);
+		writer.value<uint64_t>(link.pointeeSection);
+		writer.value<uint64_t>(link.pointeeOffset);
+		writer.value<uint8_t>(uint8_t(link.kind));
+		writer.value<uint8_t>(link.trailing);
+	}
+	writer.value<uint64_t>(compiler.externs.size());
+	for (const Compiler::ExternSymbol& symbol : compiler.externs) {
+		writer.string(symbol.name);
+	}
+
+	// Written next to the entry and renamed over it, so a reader never sees half an entry
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	std::filesystem::path path = pathFor(key);
+	std::filesystem::path temporary = path;
+	temporary += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(writer.bytes.data(), std::streamsize(writer.bytes.size()));
+		if (!out) {
+			out.close();
+			std::filesystem::remove(temporary, error);
+			return false;
+		}
+	}
+	std::filesystem::rename(temporary, path, error);
+	if (error) {
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	return true;
+}
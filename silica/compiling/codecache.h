@@ -0,0 +1,45 @@
+#pragma once
+#include "include.h"
+#include "compiling/compiler.h"
+#include "parsing/Source.h"
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace Silica {
+
+// Compiled programs kept on disk, so running the same source again skips the frontend and the backend.
+// An entry holds a Compiler's sections, links and externs before linking, and where the program starts.
+// Entries are named by a hash of their key, which is stored in the entry too and checked when it's loaded.
+// Code compiled in tiers isn't cached, it has the address of its Tiers built into it
+class CodeCache {
+public:
+	// Changes with the generated code or the layout of the entries
+	static constexpr uint32_t version = 3;
+
+	// What the compiled code depends on: the source, version, Silica::target, the CPU's features and the passes
+	struct Key {
+		std::string text;
+		uint64_t hash;
+	};
+	static Key keyFor(const Source& source, std::string_view pipeline);
+
+	// The directory is made when the first entry is stored
+	explicit CodeCache(std::filesystem::path directory): directory(std::move(directory)) {}
+
+	// Adds the sections, links and externs of the entry for 'key' to 'compiler', which has none yet.
+	// Returns the section and offset of main, std::nullopt when there's no entry, it doesn't match 'key' or it's corrupt
+	std::optional<std::pair<size_t, size_t>> load(const Key& key, Compiler& compiler) const;
+	// Saves what 'compiler' has before it's linked. Returns false when the entry couldn't be written
+	bool store(const Key& key, const Compiler& compiler, size_t mainSection, size_t mainOffset) const;
+
+private:
+	std::filesystem::path directory;
+
+	std::filesystem::path pathFor(const Key& key) const;
+};
+
+}
@@ -5,9 +5,17 @@ extern "C" {
 	#include "xed/xed-interface.h"
 }
 #include <stdint.h>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
 #include <vector>
 #include <bitset>
+#include <initializer_list>
+#include <unordered_map>
 
 using namespace std::literals;
 
@@ -55,7 +63,7 @@ struct Location {
 	size_t size;
 	struct Sibda {
 		int32_t displacement;
-		Gpr index;
+		std::optional<Gpr> index;
 		Gpr base;
 		unsigned scale : 2;
 	};
@@ -68,6 +76,10 @@ struct Location {
 	Location(unsigned scale, Gpr index, Gpr base, int32_t displacement):
 		data(Sibda({displacement, index, base, scale})) {}
 
+	// The memory location at base + displacement
+	Location(Gpr base, int32_t displacement):
+		data(Sibda({displacement, std::nullopt, base, 0})) {}
+
 	Location(int32_t displacement):
 		data(RipRelative({displacement})) {}
 };
@@ -88,30 +100,43 @@ enum class Prefix2: uint8_t {
 
 
 struct Compiler;
+struct X64Operand;
 
 struct Section {
 	Rights rights;
 	std::vector<uint8_t> data;
 	size_t offset; // size_t sized placeholder for Compiler::run
+	uint8_t* address = nullptr; // Where the data is used from once placed by Compiler::link or Compiler::load
+	uint8_t* writable = nullptr; // Where the data was copied to, only differs from address for code in a dual mapped CodeHeap
 	Section(Rights rights) : rights(rights) {};
 };
 
 struct Link {
+	enum class Kind: uint8_t {
+		abs64,    // The 8 bytes at the pointer become the pointee's address
+		rel32,    // The 4 bytes at the pointer become the distance from their end to the pointee, as in call/jmp rel32.
+		          // An extern out of their reach is called through a thunk
+		ripDisp32 // The disp32 of a rip relative operand, with 'trailing' bytes of the instruction after it
+	};
+
 	size_t pointerSection;
 	size_t pointerOffset;
 
+	// Compiler::externSection for the extern at index pointeeOffset of Compiler::externs
 	size_t pointeeSection;
 	size_t pointeeOffset;
+
+	Kind kind = Kind::abs64;
+	uint8_t trailing = 0;
 };
 
-// *((uint64_t*) &vec[index]) becomes the rip relative address to section targetSection + offset
+// The bytes at pointerOffset in section pointerSection are written by Compiler::link or Compiler::load
+// to refer to pointeeOffset in section pointeeSection, as 'kind' says
 
 struct BadVirtualAlloc: std::bad_alloc {};
 
 struct Compiler {
 	xed_state_t state;
-	xed_encoder_instruction_t encInstruction;
-	xed_encoder_request_t encRequest;
 	friend Section;
 
 	int idx = 0;
@@ -122,7 +147,15 @@ struct Compiler {
 	size_t mainSection;
 	size_t mainOffset;
 
+	// Where link and load place the sections
+	CodeHeap* heap = &CodeHeap::global();
+	// The blocks of heap the sections are in
+	std::vector<CodeBlock> memory;
+
 	static Compiler compilerX64() {
+		// XED's tables are global and only need to be set up once
+		static bool tablesInitialized = (xed_tables_init(), true);
+		(void) tablesInitialized;
 		Compiler comp;
 		xed_state_zero(&comp.state);
 		comp.state.stack_addr_width = XED_ADDRESS_WIDTH_64b;
@@ -130,94 +163,118 @@ struct Compiler {
 		return comp;
 	}
 
-	struct XEDError: std::runtime_error {};
+	struct XEDError: std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+	struct LinkError: std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	// A function outside the compiled code, for links to point at
+	struct ExternSymbol {
+		std::string name;
+		// Looked up with findHostSymbol by link or load while it's nullptr
+		const void* address;
+	};
+	static constexpr size_t externSection = SIZE_MAX;
+	std::vector<ExternSymbol> externs;
+
+	// The index in externs of the one called 'name', which is added when it isn't there
+	size_t addExtern(std::string_view name, const void* address = nullptr);
+	// Looks up the externs without an address with findHostSymbol, throws LinkError for one that isn't found
+	void resolveExterns();
+
+	// How addInstruction encodes instructions
+	enum class Encoder: uint8_t {
+		direct,     // with encodeX64, XED only encodes what that doesn't know
+		xed,        // with XED
+		crossCheck  // with both, throws XEDError when they disagree
+	};
+#ifdef _DEBUG
+	Encoder encoder = Encoder::crossCheck;
+#else
+	Encoder encoder = Encoder::direct;
+#endif
+
+	// Encodes an instruction at the end of 'section', see x64.h.
+	// Returns the section's size after the instruction. Threads may call this at once for different sections
+	size_t addInstruction(Section& section, xed_uint_t operandWidth, xed_iclass_enum_t iclass, const X64Operand* operands, size_t count);
+	size_t addInstruction(Section& section, xed_uint_t operandWidth, xed_iclass_enum_t iclass, std::initializer_list<X64Operand> operands = {}) {
+		return addInstruction(section, operandWidth, iclass, operands.begin(), operands.size());
+	}
 
-	template<typename Fn, typename...OperandTypes>
-	void addInstruction(Section& section, xed_uint_t operandWidth, xed_iclass_enum_t iclass, OperandTypes...operands) {
-		
-		if constexpr(sizeof...(operands) == 0) {
-			xed_inst0(&encInstruction, state, operandWidth);
-			return;
+	// Encodes an instruction with XED into 'out', which has room for XED_MAX_INSTRUCTION_BYTES.
+	// Operands are made with xed_reg, xed_imm0, xed_mem_bd etc. Returns the length
+	template<typename...OperandTypes>
+	size_t xedEncode(uint8_t* out, xed_uint_t operandWidth, xed_iclass_enum_t iclass, OperandTypes...operands) const {
+		static_assert((std::is_same_v<OperandTypes, xed_encoder_operand_t> && ...), "Operands must be xed_encoder_operand_t");
+		static_assert(sizeof...(operands) <= 5, "Requires 0..5 operands");
+
+		// On the stack rather than in the Compiler, so functions can be encoded on several threads
+		xed_encoder_instruction_t encInstruction;
+		xed_encoder_request_t encRequest;
+		if constexpr (sizeof...(operands) == 0) {
+			xed_inst0(&encInstruction, state, iclass, operandWidth);
+		}
+		else if constexpr (sizeof...(operands) == 1) {
+			xed_inst1(&encInstruction, state, iclass, operandWidth, operands...);
+		}
+		else if constexpr (sizeof...(operands) == 2) {
+			xed_inst2(&encInstruction, state, iclass, operandWidth, operands...);
+		}
+		else if constexpr (sizeof...(operands) == 3) {
+			xed_inst3(&encInstruction, state, iclass, operandWidth, operands...);
+		}
+		else if constexpr (sizeof...(operands) == 4) {
+			xed_inst4(&encInstruction, state, iclass, operandWidth, operands...);
+		}
+		else {
+			xed_inst5(&encInstruction, state, iclass, operandWidth, operands...);
 		}
 
-		// type checking
-		std::array<xed_operand_t, sizeof(OperandTypes...)> arr = { operands... };
-		#define invokeXedInst(n) \
-			if constexpr(sizeof...(operands) == n) {\
-				xed_inst##n(&encInstruction, state, operandWidth, operands...);\
-				return;\
-			}
-
-		invokeXedInst(1)
-		else invokeXedInst(2)
-		else invokeXedInst(3)
-		else invokeXedInst(4)
-		else invokeXedInst(5)
-		else static_assert(false, "Requires 0..5 operands");
-
+		xed_encoder_request_zero_set_mode(&encRequest, &state);
 		if (!xed_convert_to_encoder_request(&encRequest, &encInstruction)) {
-			throw XEDError{"Couldn't convert a xed instruction into an encoder request"};
+			throw XEDError("Couldn't convert a xed instruction into an encoder request");
 		}
 
-		size_t oldSize = sections.data.size();
-		section.data.resize(oldSize + XED_MAX_INSTRUCTION_BYTES);
-		size_t ptr = &section.data[oldSize];
 		unsigned int olen = 0;
-		xed_error_enum_t xed_error = xed_encode(&encRequest, ptr, XED_MAX_INSTRUCTION_BYTES, &olen);
-		section.data.resize(oldSize + olen);
-
+		xed_error_enum_t xed_error = xed_encode(&encRequest, out, XED_MAX_INSTRUCTION_BYTES, &olen);
 		if (xed_error != XED_ERROR_NONE) {
-			throw XEDError{"Couldnt encode instruction, xed error: "sv + xed_error_enum_t2str(xed_error)};
-			return;
+			throw XEDError("Couldn't encode instruction, xed error: "s + xed_error_enum_t2str(xed_error));
 		}
+		return olen;
 	}
 
-	int run(size_t mainSection, size_t mainOffset) {
-		std::unordered_map<Rights, std::pair<size_t, void*>> map;
-		// Calculate offset and size of the code for each right
-		for (Section& i : sections) {
-			size_t& size = map[i.rights].first;
-			i.offset = size;
-			size += i.data.size();
-		}
-		// Allocate with read write permissions
-		for (auto& pair : map) {
-			if (pair.first != Rights::rwdata) {
-				pair.second.second = fancyAlloc(pair.second.first, Rights::rwdata);
-			}
-			else {
-				pair.second.second = malloc(pair.second.first);
-			}
-		}
+	// Lays out, links, copies and protects the sections. Throws LinkError for an extern that can't be found,
+	// or a rel32 or disp32 whose pointee is out of its reach
+	void link();
 
-		// Linking
-		for (Link i : links) {
-			uintptr_t* pointer = (uintptr_t*) &sections[i.pointerSection].data[i.pointerOffset];
-			*pointer = uintptr_t(map[sections[i.pointeeSection].rights].second) + sections[i.pointeeSection].offset + i.pointeeOffset;
-		}
+	// Places and copies a section added after link on its own, its links may only point at sections that are
+	// placed already. Returns its address
+	uint8_t* load(size_t section);
 
-		// Copy
-		for (Section& i : sections) {
-			std::copy(i.data.begin(), i.data.end(), (uint8_t*)map[i.rights].second + i.offset);
-		}
+	// Where the thunk of the extern at 'symbol' was placed, nullptr when there's none
+	const uint8_t* thunk(size_t symbol) const;
 
-		// Make the permission's what they are supposed to be
-		for (auto& pair : map) {
-			if (pair.first != Rights::rwdata) {
-				fancyProtect(pair.second.second, pair.second.first, pair.first);
-			}
-		}
+	// Links the sections, then calls the function at 'mainOffset' in 'mainSection'.
+	// The memory they're placed in is given back with the Compiler
+	double run(size_t mainSection, size_t mainOffset) {
+		link();
 
 		// Run it
-		auto fptr = reinterpret_cast<int(*)()>(uintptr_t(map[sections[mainSection].rights].second) + sections[mainSection].offset + mainOffset);
-		int result = fptr();
-
-		// Free
-
-		return result;
+		auto fptr = reinterpret_cast<double(*)()>(sections[mainSection].address + mainOffset);
+		return fptr();
 	}
 private:
+	// Where each extern called by a rel32 has its thunk, 'jmp [rip]' followed by its address
+	std::unordered_map<size_t, std::pair<size_t, size_t>> thunks;
+
 	Compiler() {};
+
+	// Adds thunks to 'thunkSection' for the externs the rel32s of the sections 'placing' says call and have none yet
+	void addThunks(size_t thunkSection, const std::vector<bool>& placing);
+	// Writes 'link' into its pointer section's data, which has its address already
+	void apply(const Link& link);
 };
 
 }
@@ -0,0 +1,239 @@
+#include "compiling/elf.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+using namespace Silica;
+
+namespace {
+	// The parts of the ELF64 specification this needs, elf.h isn't on every host
+	enum : uint32_t {
+		SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_RELA = 4
+	};
+	enum : uint64_t {
+		SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4, SHF_INFO_LINK = 0x40
+	};
+	enum : uint8_t {
+		STB_LOCAL = 0, STB_GLOBAL = 1,
+		STT_NOTYPE = 0, STT_FUNC = 2, STT_SECTION = 3
+	};
+	enum : uint32_t {
+		R_X86_64_64 = 1, R_X86_64_PC32 = 2, R_X86_64_PLT32 = 4
+	};
+	constexpr uint16_t ET_REL = 1;
+	constexpr uint16_t EM_X86_64 = 62;
+	constexpr uint16_t SHN_UNDEF = 0;
+
+	struct ElfHeader {
+		uint8_t ident[16];
+		uint16_t type;
+		uint16_t machine;
+		uint32_t version;
+		uint64_t entry;
+		uint64_t phoff;
+		uint64_t shoff;
+		uint32_t flags;
+		uint16_t ehsize;
+		uint16_t phentsize;
+		uint16_t phnum;
+		uint16_t shentsize;
+		uint16_t shnum;
+		uint16_t shstrndx;
+	};
+	struct ElfSectionHeader {
+		uint32_t name;
+		uint32_t type;
+		uint64_t flags;
+		uint64_t addr;
+		uint64_t offset;
+		uint64_t size;
+		uint32_t link;
+		uint32_t info;
+		uint64_t addralign;
+		uint64_t entsize;
+	};
+	struct ElfSymbol {
+		uint32_t name;
+		uint8_t info;
+		uint8_t other;
+		uint16_t shndx;
+		uint64_t value;
+		uint64_t size;
+	};
+	struct ElfRela {
+		uint64_t offset;
+		uint64_t info;
+		int64_t addend;
+	};
+	static_assert(sizeof(ElfHeader) == 64 && sizeof(ElfSectionHeader) == 64 && sizeof(ElfSymbol) == 24 && sizeof(ElfRela) == 24);
+
+	// The order of the sections in the file, after the null one
+	enum Output: uint16_t {
+		text = 1, rodata, data, relaText, relaRodata, relaData, symtab, strtab, shstrtab, noteStack, outputCount
+	};
+
+	Output outputFor(Rights rights) {
+		switch (rights) {
+		case Rights::code:
+			return text;
+		case Rights::rodata:
+			return rodata;
+		default:
+			return data;
+		}
+	}
+
+	struct StringTable {
+		std::string bytes = std::string(1, '\0');
+
+		uint32_t add(std::string_view name) {
+			uint32_t offset = uint32_t(bytes.size());
+			bytes.append(name);
+			bytes.push_back('\0');
+			return offset;
+		}
+	};
+
+	// Put in front of each function's name, so 'main' and the like don't clash with C's when linked together
+	constexpr std::string_view symbolPrefix = "silica_";
+
+	template<typename T>
+	void append(std::string& bytes, const T& value) {
+		bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+}
+
+void Silica::writeElfObject(std::ostream& out, const Compiler& compiler, const std::vector<ObjectSymbol>& functions,
+                            const std::vector<std::string>& declaredExterns) {
+	// Where each of the compiler's sections goes
+	std::array<std::string, outputCount> contents;
+	std::vector<std::pair<Output, size_t>> placement;
+	for (const Section& section : compiler.sections) {
+		Output output = outputFor(section.rights);
+		placement.emplace_back(output, contents[output].size());
+		contents[output].append(reinterpret_cast<const char*>(section.data.data()), section.data.size());
+	}
+
+	// Locals come first: a symbol for each section with contents, for relocations to point into them
+	StringTable names;
+	std::vector<ElfSymbol> symbols(1, ElfSymbol {});
+	std::array<uint32_t, outputCount> sectionSymbols {};
+	for (Output output : { text, rodata, data }) {
+		sectionSymbols[output] = uint32_t(symbols.size());
+		symbols.push_back({ 0, uint8_t((STB_LOCAL << 4) | STT_SECTION), 0, output, 0, 0 });
+	}
+	uint32_t firstGlobal = uint32_t(symbols.size());
+
+	// A function runs up to the next one in its section, or the end of the section
+	for (const ObjectSymbol& function : functions) {
+		const Section& section = compiler.sections[function.section];
+		size_t end = section.data.size();
+		for (const ObjectSymbol& other : functions) {
+			if (other.section == function.section && other.offset > function.offset) {
+				end = std::min(end, other.offset);
+			}
+		}
+		auto [output, base] = placement[function.section];
+		symbols.push_back({ names.add(std::string(symbolPrefix) + function.name), uint8_t((STB_GLOBAL << 4) | STT_FUNC), 0, output,
+		                    base + function.offset, end - function.offset });
+	}
+	uint32_t firstExtern = uint32_t(symbols.size());
+	for (const Compiler::ExternSymbol& symbol : compiler.externs) {
+		symbols.push_back({ names.add(symbol.name), uint8_t((STB_GLOBAL << 4) | STT_NOTYPE), 0, SHN_UNDEF, 0, 0 });
+	}
+	// Those that nothing calls too, after the compiler's so the links' indices stay as they are
+	for (const std::string& name : declaredExterns) {
+		auto called = std::find_if(compiler.externs.begin(), compiler.externs.end(), [&](const Compiler::ExternSymbol& symbol) {
+			return symbol.name == name;
+		});
+		if (called == compiler.externs.end()) {
+			symbols.push_back({ names.add(name), uint8_t((STB_GLOBAL << 4) | STT_NOTYPE), 0, SHN_UNDEF, 0, 0 });
+		}
+	}
+
+	for (const Link& link : compiler.links) {
+		auto [output, base] = placement[link.pointerSection];
+		ElfRela rela { base + link.pointerOffset, 0, 0 };
+		uint64_t symbol;
+		if (link.pointeeSection == Compiler::externSection) {
+			symbol = firstExtern + link.pointeeOffset;
+		}
+		else {
+			auto [pointeeOutput, pointeeBase] = placement[link.pointeeSection];
+			symbol = sectionSymbols[pointeeOutput];
+			rela.addend = int64_t(pointeeBase + link.pointeeOffset);
+		}
+		uint32_t type = R_X86_64_64;
+		if (link.kind != Link::Kind::abs64) {
+			// Relative to the end of the instruction, P is where the displacement is
+			rela.addend -= 4 + link.trailing;
+			bool calledExtern = link.kind == Link::Kind::rel32 && link.pointeeSection == Compiler::externSection;
+			type = calledExtern ? R_X86_64_PLT32 : R_X86_64_PC32;
+		}
+		rela.info = (symbol << 32) | type;
+		append(contents[Output(output + (relaText - text))], rela);
+	}
+
+	for (const ElfSymbol& symbol : symbols) {
+		append(contents[symtab], symbol);
+	}
+	contents[strtab] = names.bytes;
+
+	StringTable sectionNames;
+	std::array<ElfSectionHeader, outputCount> headers {};
+	auto describe = [&](Output output, std::string_view name, uint32_t type, uint64_t flags, uint64_t align) {
+		headers[output].name = sectionNames.add(name);
+		headers[output].type = type;
+		headers[output].flags = flags;
+		headers[output].addralign = align;
+	};
+	describe(text, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16);
+	describe(rodata, ".rodata", SHT_PROGBITS, SHF_ALLOC, 16);
+	describe(data, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 16);
+	for (Output rela : { relaText, relaRodata, relaData }) {
+		static constexpr std::string_view relaNames[] = { ".rela.text", ".rela.rodata", ".rela.data" };
+		describe(rela, relaNames[rela - relaText], SHT_RELA, SHF_INFO_LINK, 8);
+		headers[rela].link = symtab;
+		headers[rela].info = rela - relaText + text;
+		headers[rela].entsize = sizeof(ElfRela);
+	}
+	describe(symtab, ".symtab", SHT_SYMTAB, 0, 8);
+	headers[symtab].link = strtab;
+	headers[symtab].info = firstGlobal;
+	headers[symtab].entsize = sizeof(ElfSymbol);
+	describe(strtab, ".strtab", SHT_STRTAB, 0, 1);
+	// Says the code doesn't need an executable stack
+	describe(noteStack, ".note.GNU-stack", SHT_PROGBITS, 0, 1);
+	describe(shstrtab, ".shstrtab", SHT_STRTAB, 0, 1);
+	contents[shstrtab] = sectionNames.bytes;
+
+	// The header, the contents of each section aligned, then the section headers
+	std::string file(sizeof(ElfHeader), '\0');
+	for (uint16_t i = text; i < outputCount; i++) {
+		uint64_t align = std::max<uint64_t>(headers[i].addralign, 1);
+		file.resize((file.size() + align - 1) / align * align, '\0');
+		headers[i].offset = file.size();
+		headers[i].size = contents[i].size();
+		file.append(contents[i]);
+	}
+	file.resize((file.size() + 7) / 8 * 8, '\0');
+
+	ElfHeader header {};
+	std::memcpy(header.ident, "\x7f" "ELF", 4);
+	header.ident[4] = 2; // 64 bit
+	header.ident[5] = 1; // little endian
+	header.ident[6] = 1; // version 1
+	header.type = ET_REL;
+	header.machine = EM_X86_64;
+	header.version = 1;
+	header.shoff = file.size();
+	header.ehsize = sizeof(ElfHeader);
+	header.shentsize = sizeof(ElfSectionHeader);
+	header.shnum = outputCount;
+	header.shstrndx = shstrtab;
+	std::memcpy(file.data(), &header, sizeof(header));
+	for (const ElfSectionHeader& sectionHeader : headers) {
+		append(file, sectionHeader);
+	}
+	out.write(file.data(), std::streamsize(file.size()));
+}
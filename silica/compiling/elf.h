@@ -0,0 +1,27 @@
+#pragma once
+#include "include.h"
+#include "compiling/compiler.h"
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Silica {
+
+// A function for the symbol table of an object file
+struct ObjectSymbol {
+	std::string name;
+	size_t section;
+	size_t offset;
+};
+
+// Writes the sections of 'compiler', before it's linked, as a relocatable x86-64 ELF64 object.
+// Sections with Rights::code, rodata and rwdata go into .text, .rodata and .data, in the order of compiler.sections.
+// 'functions' become global symbols in .text named silica_<name>, so a Silica main doesn't clash with C's,
+// and the compiler's externs undefined ones, as are 'declaredExterns', the names the source declared with 'use'.
+// Links become relocations: abs64 is R_X86_64_64, rel32 is R_X86_64_PLT32 to an extern and R_X86_64_PC32 otherwise,
+// ripDisp32 is R_X86_64_PC32. Functions take and return doubles like the System V ABI, so C and C++ can call them
+void writeElfObject(std::ostream& out, const Compiler& compiler, const std::vector<ObjectSymbol>& functions,
+                    const std::vector<std::string>& declaredExterns = {});
+
+}
@@ -1,43 +1,323 @@
 #include "host.h"
+#include "include.h"
+#include <algorithm>
+#include <string>
+#if HOST == HOST_POSIX
+	#include <dlfcn.h>
+	#include <fcntl.h>
+#endif
 
 namespace Silica {
+#if HOST != HOST_OTHER
+	namespace {
 #if HOST == HOST_WIN
-	void* fancyAlloc(size_t size, Rights rights) {
-		SYSTEM_INFO system_info;
-		GetSystemInfo(&system_info);
-		auto const page_size = system_info.dwPageSize;
-		void* result = VirtualAlloc(NULL, page_size, MEM_RESERVE | MEM_COMMIT, DWORD(rights));
-		if (result == nullptr) {
-			throw BadFancyAlloc();
-		} else {
-			return result;
+		size_t systemPageSize() {
+			SYSTEM_INFO systemInfo;
+			GetSystemInfo(&systemInfo);
+			return systemInfo.dwPageSize;
 		}
+
+		uint8_t* reserve(size_t bytes) {
+			return (uint8_t*) VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+		}
+
+		// Pagefile backed memory mapped twice, its pages are committed through the read write view
+		bool reserveDual(size_t bytes, uint8_t*& writable, uint8_t*& executable, intptr_t& file) {
+			HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_RESERVE,
+			                                    DWORD(uint64_t(bytes) >> 32), DWORD(bytes), nullptr);
+			if (mapping == nullptr) {
+				return false;
+			}
+			file = intptr_t(mapping);
+			// Next to each other where there's room for both, so rel32s between the views reach
+			uint8_t* both = (uint8_t*) VirtualAlloc(nullptr, 2 * bytes, MEM_RESERVE, PAGE_NOACCESS);
+			if (both != nullptr) {
+				VirtualFree(both, 0, MEM_RELEASE);
+			}
+			writable = (uint8_t*) MapViewOfFileEx(mapping, FILE_MAP_WRITE, 0, 0, bytes, both);
+			executable = (uint8_t*) MapViewOfFileEx(mapping, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, bytes,
+			                                        both != nullptr ? both + bytes : nullptr);
+			if (writable != nullptr && executable == nullptr) {
+				executable = (uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, bytes);
+			}
+			return writable != nullptr && executable != nullptr;
+		}
+
+		void unreserve(uint8_t* base, uint8_t* executable, size_t, intptr_t file) {
+			if (file == -1) {
+				VirtualFree(base, 0, MEM_RELEASE);
+				return;
+			}
+			if (base != nullptr) {
+				UnmapViewOfFile(base);
+			}
+			if (executable != nullptr) {
+				UnmapViewOfFile(executable);
+			}
+			CloseHandle(HANDLE(file));
+		}
+
+		// Makes reserved pages usable, read write
+		bool obtain(uint8_t* pages, size_t bytes) {
+			return VirtualAlloc(pages, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+		}
+
+		bool changeRights(uint8_t* pages, size_t bytes, Rights rights) {
+			DWORD old;
+			return VirtualProtect(pages, bytes, DWORD(rights), &old) != 0;
+		}
+
+		// Gives the pages' memory back, they stay reserved.
+		// The pages of a view can't be decommitted, they're kept for the next block there
+		bool release(uint8_t* pages, size_t bytes, bool changedRights, intptr_t file, size_t) {
+			if (file != -1) {
+				return !changedRights || changeRights(pages, bytes, Rights::rwdata);
+			}
+			return VirtualFree(pages, bytes, MEM_DECOMMIT) != 0;
+		}
+#elif HOST == HOST_POSIX
+		size_t systemPageSize() {
+			return size_t(sysconf(_SC_PAGESIZE));
+		}
+
+		// Mapped read write from the start, the system only gives it memory once it's touched
+		uint8_t* reserve(size_t bytes) {
+			int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+			flags |= MAP_NORESERVE;
+#endif
+			void* result = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+			return result == MAP_FAILED ? nullptr : (uint8_t*) result;
+		}
+
+		// An anonymous file as big as the region, mapped twice. It's sparse, so pages only take memory once written
+		bool reserveDual(size_t bytes, uint8_t*& writable, uint8_t*& executable, intptr_t& file) {
+#ifdef __linux__
+			int fd = memfd_create("silica-code", MFD_CLOEXEC);
+#else
+			std::string name = "/silica-code-" + std::to_string(getpid());
+			int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+			shm_unlink(name.c_str());
+#endif
+			file = fd;
+			if (fd == -1 || ftruncate(fd, off_t(bytes)) != 0) {
+				return false;
+			}
+			// Next to each other, so rel32s between the views reach
+			void* both = mmap(nullptr, 2 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+			if (both == MAP_FAILED) {
+				return false;
+			}
+			void* rw = mmap(both, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+			void* rx = mmap((uint8_t*) both + bytes, bytes, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0);
+			writable = rw == MAP_FAILED ? nullptr : (uint8_t*) rw;
+			executable = rx == MAP_FAILED ? nullptr : (uint8_t*) rx;
+			return writable != nullptr && executable != nullptr;
+		}
+
+		void unreserve(uint8_t* base, uint8_t* executable, size_t bytes, intptr_t file) {
+			if (base != nullptr) {
+				munmap(base, bytes);
+			}
+			if (executable != nullptr) {
+				munmap(executable, bytes);
+			}
+			if (file != -1) {
+				close(int(file));
+			}
+		}
+
+		bool obtain(uint8_t*, size_t) {
+			return true;
+		}
+
+		bool changeRights(uint8_t* pages, size_t bytes, Rights rights) {
+			return mprotect(pages, bytes, int(rights)) == 0;
+		}
+
+		// Gives the pages' memory back, they stay mapped
+		bool release(uint8_t* pages, size_t bytes, bool changedRights, intptr_t file, size_t offset) {
+			if (file != -1) {
+				// Both views see the file, so it's the file that has to let go of the pages
+#ifdef __linux__
+				if (fallocate(int(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(offset), off_t(bytes)) != 0) {
+					return false;
+				}
+#else
+				(void) offset;
+#endif
+			}
+			else if (madvise(pages, bytes, MADV_DONTNEED) != 0) {
+				return false;
+			}
+			return !changedRights || changeRights(pages, bytes, Rights::rwdata);
+		}
+#endif
 	}
 
-	void fancyProtect(void* ptr, size_t size, Rights rights) {
-		DWORD dummy;
-		if (VirtualProtect(ptr, size, DWORD(rights), &dummy) == 0) {
+	CodeHeap::CodeHeap(size_t reserveBytes, Mapping mapping): pageSize(systemPageSize()), mapping(mapping) {
+		reservedBytes = (reserveBytes + pageSize - 1) / pageSize * pageSize;
+		if (mapping == Mapping::dual) {
+			base = nullptr;
+			if (!reserveDual(reservedBytes, base, executableBase, file)) {
+				unreserve(base, executableBase, reservedBytes, file);
+				throw BadFancyAlloc();
+			}
+		}
+		else {
+			base = reserve(reservedBytes);
+		}
+		if (base == nullptr) {
 			throw BadFancyAlloc();
 		}
-		printf("protecc");
+		freeRanges[0] = reservedBytes;
+	}
+
+	CodeHeap::~CodeHeap() {
+		unreserve(base, executableBase, reservedBytes, file);
+	}
+
+	CodeHeap& CodeHeap::global() {
+		static CodeHeap heap(defaultReserveBytes, Options::dualMapping ? Mapping::dual : Mapping::single);
+		return heap;
 	}
-#elif HOST = HOST_POSIX
-	// Untested
-	void* fancyAlloc(size_t size, Rights rights) {
-		void* result = mmap(nullptr, size, int(rights), MAP_ANON | MAP_SHARED, -1, 0);
-		if (result == MAP_FAILED) {
+
+	uint8_t* CodeHeap::allocate(size_t size) {
+		size_t bytes = (std::max<size_t>(size, 1) + pageSize - 1) / pageSize * pageSize;
+		std::lock_guard lock(mutex);
+		// The lowest range that fits, which keeps the blocks close together
+		auto range = std::find_if(freeRanges.begin(), freeRanges.end(), [&](const std::pair<const size_t, size_t>& free) {
+			return free.second >= bytes;
+		});
+		if (range == freeRanges.end()) {
 			throw BadFancyAlloc();
 		}
-		else {
-			return result;
+		size_t offset = range->first;
+		if (!obtain(base + offset, bytes)) {
+			throw BadFancyAlloc();
+		}
+		if (range->second > bytes) {
+			freeRanges[offset + bytes] = range->second - bytes;
+		}
+		freeRanges.erase(range);
+		blocks[offset] = Block { bytes, Rights::rwdata };
+		return base + offset;
+	}
+
+	void CodeHeap::free(uint8_t* block) {
+		if (block == nullptr) {
+			return;
+		}
+		std::lock_guard lock(mutex);
+		size_t offset = size_t(block - base);
+		auto found = blocks.find(offset);
+		if (found == blocks.end()) {
+			return;
+		}
+		size_t bytes = found->second.bytes;
+		bool changedRights = found->second.rights != Rights::rwdata;
+		protectCalls += changedRights;
+		bool released = release(block, bytes, changedRights, file, offset);
+		blocks.erase(found);
+		pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const std::pair<size_t, Rights>& change) {
+			return change.first == offset;
+		}), pending.end());
+		// The pages may still hold code or have its rights, so they're never handed out again
+		if (!released) {
+			lostBytes += bytes;
+			return;
+		}
+
+		// Joined with the free ranges on either side
+		auto next = freeRanges.lower_bound(offset);
+		if (next != freeRanges.end() && next->first == offset + bytes) {
+			bytes += next->second;
+			next = freeRanges.erase(next);
+		}
+		if (next != freeRanges.begin()) {
+			auto previous = std::prev(next);
+			if (previous->first + previous->second == offset) {
+				previous->second += bytes;
+				return;
+			}
 		}
+		freeRanges[offset] = bytes;
 	}
 
-	void fancyProtect(void* ptr, size_t size, Rights rights) {
-		if (mprotect(ptr, size, int(rights)) != 0) {
+	void CodeHeap::protect(uint8_t* block, Rights rights) {
+		if (mapping == Mapping::dual && rights == Rights::code) {
+			return;
+		}
+		std::lock_guard lock(mutex);
+		pending.emplace_back(size_t(block - base), rights);
+	}
+
+	void CodeHeap::commit() {
+		std::lock_guard lock(mutex);
+		// Later requests for a block win
+		std::stable_sort(pending.begin(), pending.end(), [](const std::pair<size_t, Rights>& a, const std::pair<size_t, Rights>& b) {
+			return a.first < b.first;
+		});
+		std::vector<std::pair<size_t, Rights>> changes;
+		for (size_t i = 0; i < pending.size(); i++) {
+			if (i + 1 < pending.size() && pending[i + 1].first == pending[i].first) {
+				continue;
+			}
+			Block& block = blocks.at(pending[i].first);
+			if (block.rights != pending[i].second) {
+				block.rights = pending[i].second;
+				changes.push_back(pending[i]);
+			}
+		}
+		pending.clear();
+
+		// Blocks that are next to each other and get the same rights are changed together
+		for (size_t i = 0; i < changes.size();) {
+			size_t offset = changes[i].first;
+			size_t end = offset + blocks[offset].bytes;
+			size_t j = i + 1;
+			while (j < changes.size() && changes[j].first == end && changes[j].second == changes[i].second) {
+				end += blocks[changes[j].first].bytes;
+				j++;
+			}
+			setRights(offset, end - offset, changes[i].second);
+			i = j;
+		}
+	}
+
+	void CodeHeap::setRights(size_t offset, size_t bytes, Rights rights) {
+		protectCalls++;
+		if (!changeRights(base + offset, bytes, rights)) {
 			throw BadFancyAlloc();
 		}
 	}
 
+	CodeHeap::Stats CodeHeap::stats() const {
+		std::lock_guard lock(mutex);
+		Stats stats {};
+		stats.reservedBytes = reservedBytes;
+		stats.usedBlocks = blocks.size();
+		for (auto& [offset, block] : blocks) {
+			stats.usedBytes += block.bytes;
+		}
+		stats.freeRanges = freeRanges.size();
+		for (auto& [offset, bytes] : freeRanges) {
+			stats.freeBytes += bytes;
+			stats.largestFreeBytes = std::max(stats.largestFreeBytes, bytes);
+		}
+		stats.protectCalls = protectCalls;
+		stats.lostBytes = lostBytes;
+		return stats;
+	}
+
+#if HOST == HOST_WIN
+	const void* findHostSymbol(const char* name) {
+		return reinterpret_cast<const void*>(GetProcAddress(GetModuleHandleW(nullptr), name));
+	}
+#else
+	const void* findHostSymbol(const char* name) {
+		return dlsym(RTLD_DEFAULT, name);
+	}
+#endif
 #endif
 }
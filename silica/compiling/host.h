@@ -1,5 +1,12 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #define HOST_WIN   1 // x86_64 Windows
 #define HOST_POSIX 2 // x86_64 Posix
@@ -15,6 +22,7 @@
 		#if defined(_POSIX_VERSION)
 		// An x86_64 posix host
 			#define HOST HOST_POSIX
+			#include <sys/mman.h>
 		#endif
 	#endif
 #endif
@@ -28,13 +36,15 @@ namespace Silica {
 	enum class Rights {
 		rodata = PAGE_READONLY,
 		rwdata = PAGE_READWRITE,
-		code   = PAGE_EXECUTE
+		// Readable too, thunks load the address stored after their jump
+		code   = PAGE_EXECUTE_READ
 	};
 #elif HOST == HOST_POSIX
 	enum class Rights {
 		rodata = PROT_READ,
 		rwdata = PROT_READ | PROT_WRITE,
-		code   = PROT_EXEC
+		// Readable too, thunks load the address stored after their jump. Execute only pages can't do that
+		code   = PROT_READ | PROT_EXEC
 	};
 #else
 	enum class Rights {
@@ -46,11 +56,103 @@ namespace Silica {
 
 #if HOST != HOST_OTHER
 	struct BadFancyAlloc : public std::bad_alloc {};
-	// Allocates a region of memory 'size' bytes long with the specified rights
-	void* fancyAlloc(size_t size, Rights rights);
 
-	// Changes the right's of a memory region pointed by the result of 'fancyAlloc'
-	void fancyProtect(void* ptr, size_t size, Rights rights);
+	// Hands out page aligned blocks of one region of address space that's reserved up front,
+	// so compiling again doesn't map anything new. Blocks start out read write. Their rights change
+	// at the next commit after protect, which changes neighbouring blocks with the same rights in one call.
+	// Freed blocks are given back to the system, and their space is handed out again. Thread safe
+	class CodeHeap {
+	public:
+		static constexpr size_t defaultReserveBytes = size_t(1) << 30;
+
+		enum class Mapping: uint8_t {
+			// Blocks are written and run at the same address, code is made executable by commit
+			single,
+			// The region is shared memory mapped twice, read write and read execute. Blocks are written at one
+			// address and run from the other, so code never changes rights and can be patched while it runs.
+			// Compilers still assemble their sections in Section::data and copy each into its block once
+			dual
+		};
+
+		// Throws BadFancyAlloc when the region can't be reserved
+		explicit CodeHeap(size_t reserveBytes = defaultReserveBytes, Mapping mapping = Mapping::single);
+		~CodeHeap();
+		CodeHeap(const CodeHeap&) = delete;
+		CodeHeap& operator=(const CodeHeap&) = delete;
+
+		// The heap Compilers place their sections in, reserved on first use with Options::dualMapping
+		static CodeHeap& global();
+
+		// A read write block of at least 'size' bytes, throws BadFancyAlloc when there's no room left
+		uint8_t* allocate(size_t size);
+		// Gives back a block from allocate, nullptr is ignored.
+		// A block whose pages can't be released isn't reused, see Stats::lostBytes
+		void free(uint8_t* block);
+		// Gives the block 'rights' at the next commit, code needs nothing when the heap is dual mapped
+		void protect(uint8_t* block, Rights rights);
+		// Where the block is run from: the same address, or its alias in the read execute view when dual mapped
+		uint8_t* executable(uint8_t* block) const {
+			return mapping == Mapping::dual ? executableBase + (block - base) : block;
+		}
+		// Changes the rights protect was asked for
+		void commit();
+
+		struct Stats {
+			size_t reservedBytes;
+			size_t usedBytes;
+			size_t usedBlocks;
+			size_t freeBytes;
+			// Runs of free pages between the used blocks
+			size_t freeRanges;
+			size_t largestFreeBytes;
+			// Calls to mprotect or VirtualProtect so far
+			size_t protectCalls;
+			// In freed blocks whose pages couldn't be released, they're left out of the free ranges
+			size_t lostBytes;
+
+			// 0 when the free space is in one piece, towards 1 the more it's split up
+			double fragmentation() const {
+				return freeBytes == 0 ? 0 : 1 - double(largestFreeBytes) / double(freeBytes);
+			}
+		};
+		Stats stats() const;
+
+	private:
+		struct Block {
+			size_t bytes;
+			Rights rights;
+		};
+
+		uint8_t* base;
+		size_t reservedBytes;
+		size_t pageSize;
+		Mapping mapping;
+		// The read execute view of a dual mapped heap, and the shared memory behind both views
+		uint8_t* executableBase = nullptr;
+		intptr_t file = -1;
+		mutable std::mutex mutex;
+		// By offset from base, both in address order
+		std::map<size_t, Block> blocks;
+		std::map<size_t, size_t> freeRanges;
+		// The offsets of blocks waiting for commit, and their new rights
+		std::vector<std::pair<size_t, Rights>> pending;
+		size_t protectCalls = 0;
+		size_t lostBytes = 0;
+
+		void setRights(size_t offset, size_t bytes, Rights rights);
+	};
+
+	// A block of a CodeHeap that's given back when it goes away
+	struct CodeHeapFree {
+		CodeHeap* heap;
+		void operator()(uint8_t* block) const {
+			heap->free(block);
+		}
+	};
+	using CodeBlock = std::unique_ptr<uint8_t, CodeHeapFree>;
+
+	// The function called 'name' in the program or the libraries it has loaded, nullptr when there's none
+	const void* findHostSymbol(const char* name);
 #endif
 
 }
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "compiling/bytecode.h"
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace Silica;
+
+// GCC and Clang can jump to the handler of the next instruction straight from the end of each handler,
+// which predicts better than coming back to one switch
+#if defined(__GNUC__)
+#define SILICA_THREADED_DISPATCH 1
+#else
+#define SILICA_THREADED_DISPATCH 0
+#endif
+
+namespace {
+	// Frames on the stack at once
+	constexpr size_t maxDepth = 1 << 20;
+
+	struct Frame {
+		const BytecodeFunction* function;
+		// Where to carry on in the caller, just after its call
+		const Instruction* pc;
+		// Where the caller's registers start on the stack
+		size_t registers;
+	};
+
+	template<typename... Args>
+	double callAt(const void* address, Args... args) {
+		return reinterpret_cast<double(*)(Args...)>(const_cast<void*>(address))(args...);
+	}
+
+	// Calls the C function at 'address' with the 'argCount' doubles at 'args'
+	double callExtern(const void* address, uint32_t argCount, const double* args) {
+		switch (argCount) {
+		case 0: return callAt(address);
+		case 1: return callAt(address, args[0]);
+		case 2: return callAt(address, args[0], args[1]);
+		case 3: return callAt(address, args[0], args[1], args[2]);
+		case 4: return callAt(address, args[0], args[1], args[2], args[3]);
+		case 5: return callAt(address, args[0], args[1], args[2], args[3], args[4]);
+		case 6: return callAt(address, args[0], args[1], args[2], args[3], args[4], args[5]);
+		case 7: return callAt(address, args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+		case 8: return callAt(address, args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
+		default: unreachable(); return 0;
+		}
+	}
+	static_assert(BytecodeModule::maxExternArgs == 8, "callExtern needs a case for each argument count");
+}
+
+#if SILICA_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+double Silica::interpret(const BytecodeModule& module, uint32_t function, Compiler& compiler) {
+	myAssert(function < module.functions.size());
+	std::vector<size_t> symbols;
+	for (const BytecodeExtern& symbol : module.externs) {
+		symbols.push_back(compiler.addExtern(symbol.name));
+	}
+	compiler.resolveExterns();
+	std::vector<const void*> externs;
+	for (size_t symbol : symbols) {
+		externs.push_back(compiler.externs[symbol].address);
+	}
+	const BytecodeFunction* current = &module.functions[function];
+	// Grows as calls need it, so the registers are found by their offset from the start
+	std::vector<double> stack(std::max<size_t>(current->registerCount, 1024));
+	std::vector<Frame> frames;
+	size_t base = 0;
+	double* r = stack.data();
+	const double* k = current->constants.data();
+	const Instruction* pc = current->code.data();
+	Instruction instr;
+
+#if SILICA_THREADED_DISPATCH
+	static void* const handlers[] = {
+		&&op_loadConstant, &&op_move, &&op_add, &&op_sub, &&op_mul, &&op_div,
+		&&op_less, &&op_lessEquals, &&op_greater, &&op_greaterEquals, &&op_neg,
+		&&op_jump, &&op_jumpIfZero, &&op_call, &&op_callExtern, &&op_ret
+	};
+	static_assert(std::size(handlers) == size_t(Opcode::count));
+#define OP(name) op_##name:
+#define NEXT() instr = *pc++; goto *handlers[size_t(instr.op)]
+	NEXT();
+#else
+#define OP(name) case Opcode::name:
+#define NEXT() break
+	for (;;) {
+	instr = *pc++;
+	switch (instr.op) {
+#endif
+
+	OP(loadConstant) {
+		r[instr.a] = k[instr.bc()];
+		NEXT();
+	}
+	OP(move) {
+		r[instr.a] = r[instr.b];
+		NEXT();
+	}
+	OP(add) {
+		r[instr.a] = r[instr.b] + r[instr.c];
+		NEXT();
+	}
+	OP(sub) {
+		r[instr.a] = r[instr.b] - r[instr.c];
+		NEXT();
+	}
+	OP(mul) {
+		r[instr.a] = r[instr.b] * r[instr.c];
+		NEXT();
+	}
+	OP(div) {
+		r[instr.a] = r[instr.b] / r[instr.c];
+		NEXT();
+	}
+	// Comparisons with NaN are false, as in the compiled code
+	OP(less) {
+		r[instr.a] = r[instr.b] < r[instr.c] ? 1 : 0;
+		NEXT();
+	}
+	OP(lessEquals) {
+		r[instr.a] = r[instr.b] <= r[instr.c] ? 1 : 0;
+		NEXT();
+	}
+	OP(greater) {
+		r[instr.a] = r[instr.b] > r[instr.c] ? 1 : 0;
+		NEXT();
+	}
+	OP(greaterEquals) {
+		r[instr.a] = r[instr.b] >= r[instr.c] ? 1 : 0;
+		NEXT();
+	}
+	OP(neg) {
+		r[instr.a] = -r[instr.b];
+		NEXT();
+	}
+	OP(jump) {
+		pc = current->code.data() + instr.bc();
+		NEXT();
+	}
+	OP(jumpIfZero) {
+		double condition = r[instr.a];
+		if (!(condition < 0 || condition > 0)) {
+			pc = current->code.data() + instr.bc();
+		}
+		NEXT();
+	}
+	OP(call) {
+		const BytecodeFunction* callee = &module.functions[instr.bc()];
+		if (frames.size() == maxDepth) {
+			throw BytecodeModule::Error("The calls went more than " + std::to_string(maxDepth) + " deep");
+		}
+		frames.push_back({ current, pc, base });
+		base += instr.a;
+		if (base + callee->registerCount > stack.size()) {
+			stack.resize(std::max(stack.size() * 2, base + callee->registerCount));
+		}
+		current = callee;
+		r = stack.data() + base;
+		k = callee->constants.data();
+		pc = callee->code.data();
+		NEXT();
+	}
+	OP(callExtern) {
+		r[instr.a] = callExtern(externs[instr.bc()], module.externs[instr.bc()].argCount, r + instr.a);
+		NEXT();
+	}
+	OP(ret) {
+		double result = r[instr.a];
+		if (frames.empty()) {
+			return result;
+		}
+		const Frame& caller = frames.back();
+		current = caller.function;
+		pc = caller.pc;
+		base = caller.registers;
+		frames.pop_back();
+		r = stack.data() + base;
+		k = current->constants.data();
+		// The callee's frame started at the register the call puts the result in
+		r[pc[-1].a] = result;
+		NEXT();
+	}
+
+#if !SILICA_THREADED_DISPATCH
+	default:
+		unreachable();
+		return 0;
+	}
+	}
+#endif
+#undef OP
+#undef NEXT
+}
+
+#if SILICA_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,233 @@
+#include "compiling/ir.h"
+
+using namespace Silica;
+
+ValueId IrFunction::append(BlockId block, IrInstr instr) {
+	instr.block = block;
+	values.push_back(std::move(instr));
+	ValueId value = ValueId(values.size() - 1);
+	blocks[block].instrs.push_back(value);
+	return value;
+}
+
+BlockId IrFunction::addBlock() {
+	blocks.emplace_back();
+	return BlockId(blocks.size() - 1);
+}
+
+void IrFunction::jump(BlockId from, BlockId to) {
+	myAssert(blocks[from].terminator.kind == IrTerminator::Kind::none);
+	blocks[from].terminator = { IrTerminator::Kind::jump, noValueId, { to, 0 } };
+	blocks[to].preds.push_back(from);
+}
+
+void IrFunction::branch(BlockId from, ValueId condition, BlockId ifTrue, BlockId ifFalse) {
+	myAssert(blocks[from].terminator.kind == IrTerminator::Kind::none);
+	blocks[from].terminator = { IrTerminator::Kind::branch, condition, { ifTrue, ifFalse } };
+	blocks[ifTrue].preds.push_back(from);
+	blocks[ifFalse].preds.push_back(from);
+}
+
+void IrFunction::replaceAllUses(ValueId from, ValueId to) {
+	for (IrBlock& block : blocks) {
+		for (ValueId value : block.instrs) {
+			for (ValueId& operand : values[value].operands) {
+				if (operand == from) {
+					operand = to;
+				}
+			}
+		}
+		if (block.terminator.value == from) {
+			block.terminator.value = to;
+		}
+	}
+}
+
+void IrFunction::sortBlocks() {
+	// Depth first, the false branch is visited first so the true branch comes first in the result
+	std::vector<BlockId> postOrder;
+	std::vector<bool> visited(blocks.size(), false);
+	std::vector<std::pair<BlockId, int>> stack { { 0, 0 } };
+	visited[0] = true;
+	while (!stack.empty()) {
+		auto& [block, next] = stack.back();
+		const IrTerminator& terminator = blocks[block].terminator;
+		BlockId successor = noBlock;
+		if (terminator.kind == IrTerminator::Kind::jump && next == 0) {
+			successor = terminator.targets[0];
+		}
+		else if (terminator.kind == IrTerminator::Kind::branch && next < 2) {
+			successor = terminator.targets[1 - next];
+		}
+		if (successor == noBlock) {
+			postOrder.push_back(block);
+			stack.pop_back();
+			continue;
+		}
+		next++;
+		if (!visited[successor]) {
+			visited[successor] = true;
+			stack.push_back({ successor, 0 });
+		}
+	}
+
+	std::vector<BlockId> newIndex(blocks.size(), noBlock);
+	for (size_t i = 0; i < postOrder.size(); i++) {
+		newIndex[postOrder[postOrder.size() - 1 - i]] = BlockId(i);
+	}
+	std::vector<IrBlock> sorted(postOrder.size());
+	for (BlockId old = 0; old < blocks.size(); old++) {
+		IrBlock& block = blocks[old];
+		BlockId index = newIndex[old];
+		if (index == noBlock) {
+			for (ValueId value : block.instrs) {
+				values[value].block = noBlock;
+			}
+			continue;
+		}
+		// Forget the predecessors that are gone, along with what the phis got from them
+		std::vector<bool> keep;
+		std::vector<BlockId> preds;
+		for (BlockId pred : block.preds) {
+			keep.push_back(newIndex[pred] != noBlock);
+			if (keep.back()) {
+				preds.push_back(newIndex[pred]);
+			}
+		}
+		for (ValueId value : block.instrs) {
+			IrInstr& instr = values[value];
+			instr.block = index;
+			if (instr.op == IrOp::phi) {
+				std::vector<ValueId> operands;
+				for (size_t i = 0; i < instr.operands.size(); i++) {
+					if (keep[i]) {
+						operands.push_back(instr.operands[i]);
+					}
+				}
+				instr.operands = std::move(operands);
+			}
+		}
+		block.preds = std::move(preds);
+		if (block.terminator.kind == IrTerminator::Kind::jump || block.terminator.kind == IrTerminator::Kind::branch) {
+			block.terminator.targets[0] = newIndex[block.terminator.targets[0]];
+			block.terminator.targets[1] = block.terminator.kind == IrTerminator::Kind::branch ? newIndex[block.terminator.targets[1]] : 0;
+		}
+		sorted[index] = std::move(block);
+	}
+	blocks = std::move(sorted);
+}
+
+size_t IrFunction::instrCount() const {
+	size_t count = 0;
+	for (const IrBlock& block : blocks) {
+		count += block.instrs.size();
+	}
+	return count;
+}
+
+void IrFunction::print(std::ostream& out) const {
+	out << "func " << symbolName(name) << " -> " << returnType->name << '\n';
+	for (BlockId b = 0; b < blocks.size(); b++) {
+		const IrBlock& block = blocks[b];
+		out << "bb" << b << ':';
+		if (!block.preds.empty()) {
+			out << "  ; preds";
+			for (BlockId pred : block.preds) {
+				out << " bb" << pred;
+			}
+		}
+		out << '\n';
+
+		for (ValueId value : block.instrs) {
+			const IrInstr& instr = values[value];
+			out << Tabs(1) << '%' << value << ": " << instr.type->name << " = " << describeIrOp(instr.op);
+			switch (instr.op) {
+			case IrOp::param:
+				out << ' ' << instr.index;
+				break;
+			case IrOp::constant:
+				out << ' ' << instr.number;
+				break;
+			case IrOp::call:
+				out << " @" << instr.index;
+				break;
+			case IrOp::callExtern:
+				out << " $" << instr.index;
+				break;
+			default:
+				break;
+			}
+			for (size_t i = 0; i < instr.operands.size(); i++) {
+				out << (i == 0 ? " " : ", ");
+				if (instr.op == IrOp::phi) {
+					out << "[%" << instr.operands[i] << ", bb" << block.preds[i] << ']';
+				}
+				else {
+					out << '%' << instr.operands[i];
+				}
+			}
+			out << '\n';
+		}
+
+		const IrTerminator& terminator = block.terminator;
+		switch (terminator.kind) {
+		case IrTerminator::Kind::none:
+			out << Tabs(1) << "<unterminated>\n";
+			break;
+		case IrTerminator::Kind::jump:
+			out << Tabs(1) << "jump bb" << terminator.targets[0] << '\n';
+			break;
+		case IrTerminator::Kind::branch:
+			out << Tabs(1) << "branch %" << terminator.value << ", bb" << terminator.targets[0] << ", bb" << terminator.targets[1] << '\n';
+			break;
+		case IrTerminator::Kind::ret:
+			out << Tabs(1) << "ret %" << terminator.value << '\n';
+			break;
+		}
+	}
+}
+
+size_t IrModule::instrCount() const {
+	size_t count = 0;
+	for (const IrFunction& function : functions) {
+		count += function.instrCount();
+	}
+	return count;
+}
+
+void IrModule::print(std::ostream& out) const {
+	for (size_t i = 0; i < externs.size(); i++) {
+		out << '$' << i << " use " << symbolName(externs[i]) << '\n';
+	}
+	for (size_t i = 0; i < functions.size(); i++) {
+		out << '@' << i << ' ';
+		functions[i].print(out);
+	}
+}
+
+std::string_view Silica::describeIrOp(IrOp op) {
+	switch (op) {
+	case IrOp::param: return "param";
+	case IrOp::constant: return "const";
+	case IrOp::add: return "add";
+	case IrOp::sub: return "sub";
+	case IrOp::mul: return "mul";
+	case IrOp::div: return "div";
+	case IrOp::pow: return "pow";
+	case IrOp::less: return "less";
+	case IrOp::lessEquals: return "lessEquals";
+	case IrOp::greater: return "greater";
+	case IrOp::greaterEquals: return "greaterEquals";
+	case IrOp::neg: return "neg";
+	case IrOp::call: return "call";
+	case IrOp::callExtern: return "callExtern";
+	case IrOp::phi: return "phi";
+	}
+	unreachable();
+	return "";
+}
+
+bool Silica::isPure(const IrInstr& instr) {
+	// A call might never return, an extern might do anything
+	return instr.op != IrOp::call && instr.op != IrOp::callExtern;
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "include.h"
+#include "ast/ast.h"
+#include "parsing/symbols.h"
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// An SSA value: the index of the instruction that defines it in IrFunction::values
+using ValueId = uint32_t;
+// An index into IrFunction::blocks
+using BlockId = uint32_t;
+constexpr ValueId noValueId = std::numeric_limits<ValueId>::max();
+
+enum class IrOp: uint8_t {
+	param,         // index: argument number
+	constant,      // number
+	add,           // operands: lhs, rhs
+	sub,
+	mul,
+	div,
+	pow,
+	// These give 1 when true and 0 when false
+	less,
+	lessEquals,
+	greater,
+	greaterEquals,
+	neg,           // operands: value
+	call,          // index: callee in IrModule::functions, operands: args
+	callExtern,    // index: callee in IrModule::externs, operands: args
+	phi            // operands: one per predecessor of its block, in the same order
+};
+
+struct IrInstr {
+	IrOp op;
+	const Type* type;
+	// The block the instruction is in, noBlock once it was removed
+	BlockId block;
+	uint32_t index = 0;
+	double number = 0;
+	std::vector<ValueId> operands;
+};
+
+struct IrTerminator {
+	enum class Kind: uint8_t {
+		none,   // the block is still being built
+		jump,   // to targets[0]
+		branch, // to targets[0] when value is not 0, to targets[1] otherwise
+		ret     // returns value
+	};
+	Kind kind = Kind::none;
+	ValueId value = noValueId;
+	BlockId targets[2] = {};
+};
+
+struct IrBlock {
+	// Phis come first
+	std::vector<ValueId> instrs;
+	std::vector<BlockId> preds;
+	IrTerminator terminator;
+};
+
+// A function in SSA form. Values are never reassigned, a value that depends on the path taken
+// through the blocks is a phi.
+// Silica has no loops, so blocks are kept in an order where branches only go forwards.
+// blocks[0] is the entry, every function ends in one block with the only ret.
+struct IrFunction {
+	static constexpr BlockId noBlock = std::numeric_limits<BlockId>::max();
+
+	Symbol name;
+	const Type* returnType;
+	const Function* source;
+	uint32_t paramCount = 0;
+	std::vector<IrInstr> values;
+	std::vector<IrBlock> blocks;
+
+	// Appends an instruction to the end of 'block'
+	ValueId append(BlockId block, IrInstr instr);
+	BlockId addBlock();
+	void jump(BlockId from, BlockId to);
+	void branch(BlockId from, ValueId condition, BlockId ifTrue, BlockId ifFalse);
+	// Uses of 'from' become uses of 'to'
+	void replaceAllUses(ValueId from, ValueId to);
+	// Drops the blocks that can't be reached from the entry and puts the rest in reverse post order,
+	// which is the order branches only go forwards in
+	void sortBlocks();
+	// Instructions still in a block
+	size_t instrCount() const;
+
+	void print(std::ostream& out) const;
+};
+
+// The functions of an Ast, in SSA form
+struct IrModule {
+	struct Error: std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	// In the same order as Ast::functions
+	std::vector<IrFunction> functions;
+	// The externs called with callExtern, by name
+	std::vector<Symbol> externs;
+
+	// Builds the IR of every function, throws IrModule::Error for expressions without the value they need
+	static IrModule from(const Ast& ast);
+
+	size_t instrCount() const;
+	void print(std::ostream& out) const;
+};
+
+std::string_view describeIrOp(IrOp op);
+// Whether the instruction can be removed, or merged with an equal one, without changing what the program does
+bool isPure(const IrInstr& instr);
+
+}
@@ -0,0 +1,186 @@
+#include "compiling/ir.h"
+#include <algorithm>
+#include <unordered_map>
+
+using namespace Silica;
+
+namespace {
+
+// Builds the IR of one function
+struct IrBuilder {
+	IrModule& module;
+	IrFunction& function;
+	const std::unordered_map<const Function*, uint32_t>& functionIndices;
+	// Lets can't be changed, so a variable is the value it was set to
+	std::unordered_map<const DeclareVar*, ValueId> variables;
+	// Where new instructions go
+	BlockId current = 0;
+	// Each return, with the block it ends
+	std::vector<std::pair<BlockId, ValueId>> returns;
+
+	IrBuilder(IrModule& module, IrFunction& function, const std::unordered_map<const Function*, uint32_t>& functionIndices):
+		module(module), function(function), functionIndices(functionIndices) {}
+
+	ValueId emit(IrOp op, const Type* type, std::vector<ValueId> operands = {}, uint32_t index = 0, double number = 0) {
+		return function.append(current, { op, type, current, index, number, std::move(operands) });
+	}
+	ValueId constant(double number) {
+		return emit(IrOp::constant, &Types::Float64, {}, 0, number);
+	}
+
+	void buildFunction(const Function& source);
+	// Returns noValueId for expressions without a value
+	ValueId build(const Expression* expr);
+	// Like build, but throws when there is no value
+	ValueId value(const Expression* expr, const char* what);
+	void buildIf(const IfExpr& ifExpr);
+};
+
+}
+
+void IrBuilder::buildFunction(const Function& source) {
+	current = function.addBlock();
+	for (size_t i = 0; i < source.params.size(); i++) {
+		variables[source.params[i]] = emit(IrOp::param, source.params[i]->type, {}, uint32_t(i));
+	}
+	if (source.result != nullptr) {
+		build(source.result);
+	}
+	// Falling off the end returns 0
+	returns.push_back({ current, constant(0) });
+
+	// Every return jumps to the exit, which returns what the phi got from the block it came from
+	BlockId exit = function.addBlock();
+	std::vector<ValueId> results;
+	for (auto [block, result] : returns) {
+		function.jump(block, exit);
+		results.push_back(result);
+	}
+	current = exit;
+	ValueId phi = emit(IrOp::phi, function.returnType, std::move(results));
+	function.blocks[exit].terminator = { IrTerminator::Kind::ret, phi, {} };
+
+	function.sortBlocks();
+	IrInstr& merged = function.values[phi];
+	if (merged.operands.size() == 1) {
+		function.replaceAllUses(phi, merged.operands[0]);
+		function.blocks[merged.block].instrs.clear();
+		merged.block = IrFunction::noBlock;
+	}
+}
+
+ValueId IrBuilder::value(const Expression* expr, const char* what) {
+	ValueId result = build(expr);
+	if (result == noValueId) {
+		throw IrModule::Error(std::string(what) + " has no value");
+	}
+	return result;
+}
+
+ValueId IrBuilder::build(const Expression* expr) {
+	myAssert(expr != nullptr);
+	if (auto* literal = dynamic_cast<const NumLitExpr*>(expr)) {
+		return constant(literal->value);
+	}
+	if (auto* getVar = dynamic_cast<const GetVarExpr*>(expr)) {
+		return variables.at(&getVar->decl);
+	}
+	if (auto* setVar = dynamic_cast<const SetVarExpr*>(expr)) {
+		variables[&setVar->decl] = value(setVar->value, "The value of a let");
+		return noValueId;
+	}
+	if (auto* unaryOp = dynamic_cast<const UnaryOpExpr*>(expr)) {
+		return emit(IrOp::neg, unaryOp->type, { value(unaryOp->expr, "An operand of '-'") });
+	}
+	if (auto* binOp = dynamic_cast<const BinOpExpr*>(expr)) {
+		ValueId left = value(binOp->left, "An operand");
+		ValueId right = value(binOp->right, "An operand");
+		IrOp op;
+		switch (binOp->operation) {
+		case BinOpType::plus: op = IrOp::add; break;
+		case BinOpType::minus: op = IrOp::sub; break;
+		case BinOpType::multiply: op = IrOp::mul; break;
+		case BinOpType::divide: op = IrOp::div; break;
+		case BinOpType::power: op = IrOp::pow; break;
+		case BinOpType::smaller: op = IrOp::less; break;
+		case BinOpType::smallerEquals: op = IrOp::lessEquals; break;
+		case BinOpType::greater: op = IrOp::greater; break;
+		case BinOpType::greaterEquals: op = IrOp::greaterEquals; break;
+		default: unreachable(); op = IrOp::add;
+		}
+		return emit(op, binOp->type, { left, right });
+	}
+	if (auto* call = dynamic_cast<const CallFuncExpr*>(expr)) {
+		std::vector<ValueId> args;
+		for (const Expression* arg : call->args) {
+			args.push_back(value(arg, "An argument"));
+		}
+		return emit(IrOp::call, call->type, std::move(args), functionIndices.at(&call->func));
+	}
+	if (auto* call = dynamic_cast<const CallExternExpr*>(expr)) {
+		std::vector<ValueId> args;
+		for (const Expression* arg : call->args) {
+			args.push_back(value(arg, "An argument"));
+		}
+		auto found = std::find(module.externs.begin(), module.externs.end(), call->name);
+		if (found == module.externs.end()) {
+			found = module.externs.insert(found, call->name);
+		}
+		return emit(IrOp::callExtern, call->type, std::move(args), uint32_t(found - module.externs.begin()));
+	}
+	if (auto* ret = dynamic_cast<const Return*>(expr)) {
+		ValueId result = ret->value != nullptr ? value(ret->value, "The returned expression") : constant(0);
+		returns.push_back({ current, result });
+		// Anything after a return can't be reached, sortBlocks drops it
+		current = function.addBlock();
+		return noValueId;
+	}
+	if (auto* ifExpr = dynamic_cast<const IfExpr*>(expr)) {
+		buildIf(*ifExpr);
+		return noValueId;
+	}
+	if (auto* block = dynamic_cast<const Block*>(expr)) {
+		for (const Expression* expression : block->expressions) {
+			build(expression);
+		}
+		return noValueId;
+	}
+	throw IrModule::Error("Can't build the IR of this kind of expression yet");
+}
+
+void IrBuilder::buildIf(const IfExpr& ifExpr) {
+	ValueId condition = value(ifExpr.condition, "The condition of an if");
+	BlockId ifTrue = function.addBlock();
+	BlockId ifFalse = ifExpr.ifFalse != nullptr ? function.addBlock() : IrFunction::noBlock;
+	BlockId merge = function.addBlock();
+	function.branch(current, condition, ifTrue, ifFalse != IrFunction::noBlock ? ifFalse : merge);
+
+	current = ifTrue;
+	build(ifExpr.ifTrue);
+	function.jump(current, merge);
+	if (ifFalse != IrFunction::noBlock) {
+		current = ifFalse;
+		build(ifExpr.ifFalse);
+		function.jump(current, merge);
+	}
+	current = merge;
+}
+
+IrModule IrModule::from(const Ast& ast) {
+	IrModule module;
+	std::unordered_map<const Function*, uint32_t> functionIndices;
+	for (const Function* function : ast.functions) {
+		functionIndices.emplace(function, uint32_t(functionIndices.size()));
+	}
+	module.functions.reserve(ast.functions.size());
+	for (const Function* source : ast.functions) {
+		IrFunction& function = module.functions.emplace_back();
+		function.name = source->name;
+		function.returnType = source->returnType;
+		function.source = source;
+		function.paramCount = uint32_t(source->params.size());
+		IrBuilder builder(module, function, functionIndices);
+		builder.buildFunction(*source);
+	}
+	return module;
+}
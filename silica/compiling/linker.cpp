@@ -0,0 +1,154 @@
+#include "compiling/compiler.h"
+#include "compiling/x64.h"
+#include <algorithm>
+
+using namespace Silica;
+
+namespace {
+	// Whether a rel32 or disp32 that's relative to 'from' can reach 'to'
+	bool reaches(const uint8_t* from, const uint8_t* to) {
+		int64_t distance = int64_t(uintptr_t(to)) - int64_t(uintptr_t(from));
+		return distance >= INT32_MIN && distance <= INT32_MAX;
+	}
+}
+
+size_t Compiler::addExtern(std::string_view name, const void* address) {
+	for (size_t i = 0; i < externs.size(); i++) {
+		if (externs[i].name == name) {
+			if (externs[i].address == nullptr) {
+				externs[i].address = address;
+			}
+			return i;
+		}
+	}
+	externs.push_back({ std::string(name), address });
+	return externs.size() - 1;
+}
+
+void Compiler::resolveExterns() {
+	for (ExternSymbol& symbol : externs) {
+		if (symbol.address == nullptr) {
+			symbol.address = findHostSymbol(symbol.name.c_str());
+		}
+		if (symbol.address == nullptr) {
+			throw LinkError("Couldn't find the extern " + symbol.name);
+		}
+	}
+}
+
+void Compiler::addThunks(size_t thunkSection, const std::vector<bool>& placing) {
+	std::vector<size_t> called;
+	for (const Link& i : links) {
+		if (i.kind == Link::Kind::rel32 && i.pointeeSection == externSection && placing[i.pointerSection]
+		    && thunks.count(i.pointeeOffset) == 0 && std::find(called.begin(), called.end(), i.pointeeOffset) == called.end()) {
+			called.push_back(i.pointeeOffset);
+		}
+	}
+	for (size_t symbol : called) {
+		Section& section = sections[thunkSection];
+		thunks[symbol] = { thunkSection, section.data.size() };
+		// The address comes right after the jump
+		size_t end = addInstruction(section, 64, XED_ICLASS_JMP, { X64Operand::fromLocation(Location(int32_t(0))) });
+		section.data.resize(end + 8);
+		links.push_back({ thunkSection, end, externSection, symbol });
+	}
+}
+
+const uint8_t* Compiler::thunk(size_t symbol) const {
+	auto found = thunks.find(symbol);
+	if (found == thunks.end() || sections[found->second.first].address == nullptr) {
+		return nullptr;
+	}
+	return sections[found->second.first].address + found->second.second;
+}
+
+void Compiler::apply(const Link& link) {
+	Section& section = sections[link.pointerSection];
+	uint8_t* data = &section.data[link.pointerOffset];
+	const uint8_t* pointee = link.pointeeSection == externSection
+		? static_cast<const uint8_t*>(externs[link.pointeeOffset].address)
+		: sections[link.pointeeSection].address + link.pointeeOffset;
+
+	if (link.kind == Link::Kind::abs64) {
+		// The pointer may be an unaligned immediate in code
+		uintptr_t address = uintptr_t(pointee);
+		std::memcpy(data, &address, sizeof(address));
+		return;
+	}
+
+	// Relative to the end of the instruction
+	const uint8_t* end = section.address + link.pointerOffset + 4 + link.trailing;
+	if (link.kind == Link::Kind::rel32 && link.pointeeSection == externSection && !reaches(end, pointee)) {
+		auto [thunkSection, thunkOffset] = thunks.at(link.pointeeOffset);
+		pointee = sections[thunkSection].address + thunkOffset;
+	}
+	if (!reaches(end, pointee)) {
+		throw LinkError("A 32 bit displacement in section " + std::to_string(link.pointerSection) + " can't reach "
+		                + (link.pointeeSection == externSection ? externs[link.pointeeOffset].name : "section " + std::to_string(link.pointeeSection)));
+	}
+	int32_t distance = int32_t(int64_t(uintptr_t(pointee)) - int64_t(uintptr_t(end)));
+	std::memcpy(data, &distance, sizeof(distance));
+}
+
+void Compiler::link() {
+	resolveExterns();
+	size_t thunkSection = sections.size();
+	sections.emplace_back(Rights::code);
+	addThunks(thunkSection, std::vector<bool>(sections.size(), true));
+
+	std::unordered_map<Rights, std::pair<size_t, uint8_t*>> map;
+	// Calculate offset and size of the code for each right
+	for (Section& i : sections) {
+		size_t& size = map[i.rights].first;
+		i.offset = size;
+		size += i.data.size();
+	}
+	// Allocate with read write permissions
+	for (auto& pair : map) {
+		memory.emplace_back(heap->allocate(pair.second.first), CodeHeapFree { heap });
+		pair.second.second = memory.back().get();
+	}
+	for (Section& i : sections) {
+		i.writable = map[i.rights].second + i.offset;
+		i.address = i.rights == Rights::code ? heap->executable(i.writable) : i.writable;
+	}
+
+	// Linking
+	for (const Link& i : links) {
+		apply(i);
+	}
+
+	// Copy
+	for (Section& i : sections) {
+		std::copy(i.data.begin(), i.data.end(), i.writable);
+	}
+
+	// Make the permission's what they are supposed to be
+	for (auto& pair : map) {
+		heap->protect(pair.second.second, pair.first);
+	}
+	heap->commit();
+}
+
+uint8_t* Compiler::load(size_t section) {
+	resolveExterns();
+	std::vector<bool> placing(sections.size(), false);
+	placing[section] = true;
+	// The section's own thunks are added to its end
+	addThunks(section, placing);
+
+	Section& loaded = sections[section];
+	loaded.offset = 0;
+	memory.emplace_back(heap->allocate(loaded.data.size()), CodeHeapFree { heap });
+	loaded.writable = memory.back().get();
+	loaded.address = loaded.rights == Rights::code ? heap->executable(loaded.writable) : loaded.writable;
+	for (const Link& i : links) {
+		if (i.pointerSection == section) {
+			apply(i);
+		}
+	}
+	std::copy(loaded.data.begin(), loaded.data.end(), loaded.writable);
+	heap->protect(loaded.writable, loaded.rights);
+	heap->commit();
+	return loaded.address;
+}
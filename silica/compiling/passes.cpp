@@ -0,0 +1,504 @@
+#include "compiling/passes.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+
+using namespace Silica;
+
+namespace {
+
+constexpr std::pair<std::string_view, bool (*)(IrModule&)> passTable[] = {
+	{ "inline", Passes::inlineCalls },
+	{ "copyprop", Passes::propagateCopies },
+	{ "fold", Passes::foldConstants },
+	{ "cse", Passes::eliminateCommonSubexpressions },
+	{ "dce", Passes::eliminateDeadCode },
+	{ "simplifycfg", Passes::mergeBlocks }
+};
+
+// The blocks a terminator goes to
+std::vector<BlockId> successors(const IrTerminator& terminator) {
+	switch (terminator.kind) {
+	case IrTerminator::Kind::jump:
+		return { terminator.targets[0] };
+	case IrTerminator::Kind::branch:
+		return { terminator.targets[0], terminator.targets[1] };
+	default:
+		return {};
+	}
+}
+
+void replacePred(IrFunction& function, BlockId block, BlockId from, BlockId to) {
+	for (BlockId& pred : function.blocks[block].preds) {
+		if (pred == from) {
+			pred = to;
+		}
+	}
+}
+
+// Removes the edge from 'from' to 'to', along with what the phis of 'to' got from it
+void removeEdge(IrFunction& function, BlockId from, BlockId to) {
+	IrBlock& block = function.blocks[to];
+	size_t index = std::find(block.preds.begin(), block.preds.end(), from) - block.preds.begin();
+	block.preds.erase(block.preds.begin() + index);
+	for (ValueId value : block.instrs) {
+		IrInstr& instr = function.values[value];
+		if (instr.op != IrOp::phi) {
+			break;
+		}
+		instr.operands.erase(instr.operands.begin() + index);
+	}
+}
+
+// Takes the instructions that were given noBlock out of their blocks
+void dropRemoved(IrFunction& function) {
+	for (IrBlock& block : function.blocks) {
+		block.instrs.erase(std::remove_if(block.instrs.begin(), block.instrs.end(), [&](ValueId value) {
+			return function.values[value].block == IrFunction::noBlock;
+		}), block.instrs.end());
+	}
+}
+
+// The immediate dominator of each block, the entry is its own.
+// Blocks are in reverse post order, so every predecessor is done before the blocks it goes to
+std::vector<BlockId> immediateDominators(const IrFunction& function) {
+	std::vector<BlockId> idom(function.blocks.size(), IrFunction::noBlock);
+	idom[0] = 0;
+	for (BlockId b = 1; b < function.blocks.size(); b++) {
+		BlockId dominator = IrFunction::noBlock;
+		for (BlockId pred : function.blocks[b].preds) {
+			if (dominator == IrFunction::noBlock) {
+				dominator = pred;
+				continue;
+			}
+			// Walk up from both until they meet
+			BlockId other = pred;
+			while (other != dominator) {
+				while (other > dominator) {
+					other = idom[other];
+				}
+				while (dominator > other) {
+					dominator = idom[dominator];
+				}
+			}
+		}
+		idom[b] = dominator;
+	}
+	return idom;
+}
+
+bool dominates(const std::vector<BlockId>& idom, BlockId a, BlockId b) {
+	while (b > a) {
+		b = idom[b];
+	}
+	return a == b;
+}
+
+// What makes two pure instructions equal
+struct ExprKey {
+	IrOp op;
+	uint32_t index;
+	uint64_t number;
+	// Phis in different blocks choose between different paths
+	BlockId block;
+	std::vector<ValueId> operands;
+
+	bool operator==(const ExprKey& other) const {
+		return op == other.op && index == other.index && number == other.number
+			&& block == other.block && operands == other.operands;
+	}
+};
+
+struct ExprKeyHash {
+	size_t operator()(const ExprKey& key) const {
+		size_t hash = size_t(key.op) * 31 + key.index;
+		hash = hash * 1'000'003 ^ std::hash<uint64_t>()(key.number);
+		hash = hash * 1'000'003 ^ key.block;
+		for (ValueId operand : key.operands) {
+			hash = hash * 1'000'003 ^ operand;
+		}
+		return hash;
+	}
+};
+
+// Same results as the machine code the backend generates
+double fold(IrOp op, double left, double right) {
+	switch (op) {
+	case IrOp::add: return left + right;
+	case IrOp::sub: return left - right;
+	case IrOp::mul: return left * right;
+	case IrOp::div: return left / right;
+	case IrOp::pow: return std::pow(left, right);
+	case IrOp::less: return left < right;
+	case IrOp::lessEquals: return left <= right;
+	case IrOp::greaterEquals: return left >= right;
+	case IrOp::greater: return left > right;
+	default: unreachable();
+	}
+	return 0;
+}
+
+void inlineCall(IrFunction& caller, ValueId call, const IrFunction& callee) {
+	BlockId block = caller.values[call].block;
+	std::vector<ValueId> args = caller.values[call].operands;
+
+	// The instructions after the call move to a new block, which the callee returns to
+	BlockId rest = caller.addBlock();
+	std::vector<ValueId>& instrs = caller.blocks[block].instrs;
+	auto position = std::find(instrs.begin(), instrs.end(), call);
+	caller.blocks[rest].instrs.assign(position + 1, instrs.end());
+	instrs.erase(position, instrs.end());
+	for (ValueId value : caller.blocks[rest].instrs) {
+		caller.values[value].block = rest;
+	}
+	caller.blocks[rest].terminator = caller.blocks[block].terminator;
+	caller.blocks[block].terminator = {};
+	for (BlockId successor : successors(caller.blocks[rest].terminator)) {
+		replacePred(caller, successor, block, rest);
+	}
+
+	// Copy the callee's blocks, its params are the arguments
+	BlockId first = BlockId(caller.blocks.size());
+	for (size_t i = 0; i < callee.blocks.size(); i++) {
+		caller.addBlock();
+	}
+	std::vector<ValueId> valueMap(callee.values.size(), noValueId);
+	std::vector<ValueId> results;
+	for (BlockId b = 0; b < callee.blocks.size(); b++) {
+		const IrBlock& source = callee.blocks[b];
+		BlockId copy = first + b;
+		for (BlockId pred : source.preds) {
+			caller.blocks[copy].preds.push_back(first + pred);
+		}
+		for (ValueId value : source.instrs) {
+			const IrInstr& instr = callee.values[value];
+			if (instr.op == IrOp::param) {
+				valueMap[value] = args[instr.index];
+				continue;
+			}
+			IrInstr copied = instr;
+			for (ValueId& operand : copied.operands) {
+				operand = valueMap[operand];
+			}
+			valueMap[value] = caller.append(copy, std::move(copied));
+		}
+
+		IrTerminator terminator = source.terminator;
+		if (terminator.kind == IrTerminator::Kind::ret) {
+			results.push_back(valueMap[terminator.value]);
+			caller.blocks[copy].terminator = { IrTerminator::Kind::jump, noValueId, { rest, 0 } };
+			caller.blocks[rest].preds.push_back(copy);
+			continue;
+		}
+		if (terminator.value != noValueId) {
+			terminator.value = valueMap[terminator.value];
+		}
+		for (BlockId& target : terminator.targets) {
+			target += first;
+		}
+		caller.blocks[copy].terminator = terminator;
+	}
+	caller.jump(block, first);
+
+	ValueId result = results[0];
+	if (results.size() > 1) {
+		const Type* type = caller.values[call].type;
+		caller.values.push_back({ IrOp::phi, type, rest, 0, 0, std::move(results) });
+		result = ValueId(caller.values.size() - 1);
+		caller.blocks[rest].instrs.insert(caller.blocks[rest].instrs.begin(), result);
+	}
+	caller.values[call].block = IrFunction::noBlock;
+	caller.replaceAllUses(call, result);
+}
+
+}
+
+bool Passes::inlineCalls(IrModule& module) {
+	bool changed = false;
+	for (uint32_t f = 0; f < module.functions.size(); f++) {
+		IrFunction& caller = module.functions[f];
+		std::vector<ValueId> calls;
+		for (const IrBlock& block : caller.blocks) {
+			for (ValueId value : block.instrs) {
+				const IrInstr& instr = caller.values[value];
+				// Recursion would never end
+				if (instr.op == IrOp::call && instr.index != f && module.functions[instr.index].instrCount() <= inlineLimit) {
+					calls.push_back(value);
+				}
+			}
+		}
+		for (ValueId call : calls) {
+			inlineCall(caller, call, module.functions[caller.values[call].index]);
+		}
+		if (!calls.empty()) {
+			caller.sortBlocks();
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool Passes::propagateCopies(IrModule& module) {
+	bool changed = false;
+	for (IrFunction& function : module.functions) {
+		// Replacing one phi can make another one trivial
+		bool again = true;
+		while (again) {
+			again = false;
+			for (IrBlock& block : function.blocks) {
+				for (ValueId value : block.instrs) {
+					IrInstr& instr = function.values[value];
+					if (instr.op != IrOp::phi || instr.block == IrFunction::noBlock) {
+						continue;
+					}
+					ValueId same = noValueId;
+					bool trivial = true;
+					for (ValueId operand : instr.operands) {
+						if (operand == value || operand == same) {
+							continue;
+						}
+						if (same != noValueId) {
+							trivial = false;
+							break;
+						}
+						same = operand;
+					}
+					if (trivial && same != noValueId) {
+						instr.block = IrFunction::noBlock;
+						function.replaceAllUses(value, same);
+						again = changed = true;
+					}
+				}
+			}
+		}
+		dropRemoved(function);
+	}
+	return changed;
+}
+
+bool Passes::foldConstants(IrModule& module) {
+	bool changed = false;
+	for (IrFunction& function : module.functions) {
+		auto constant = [&](ValueId value) {
+			return function.values[value].op == IrOp::constant;
+		};
+		for (const IrBlock& block : function.blocks) {
+			for (ValueId value : block.instrs) {
+				IrInstr& instr = function.values[value];
+				switch (instr.op) {
+				case IrOp::constant:
+				case IrOp::param:
+				case IrOp::call:
+				case IrOp::callExtern:
+				case IrOp::phi:
+					continue;
+				case IrOp::neg:
+					if (!constant(instr.operands[0])) {
+						continue;
+					}
+					instr.number = -function.values[instr.operands[0]].number;
+					break;
+				default:
+					if (!constant(instr.operands[0]) || !constant(instr.operands[1])) {
+						continue;
+					}
+					instr.number = fold(instr.op, function.values[instr.operands[0]].number, function.values[instr.operands[1]].number);
+					break;
+				}
+				instr.op = IrOp::constant;
+				instr.operands.clear();
+				changed = true;
+			}
+		}
+
+		bool removedEdges = false;
+		for (BlockId b = 0; b < function.blocks.size(); b++) {
+			IrTerminator& terminator = function.blocks[b].terminator;
+			if (terminator.kind != IrTerminator::Kind::branch || !constant(terminator.value)) {
+				continue;
+			}
+			// Like the backend, 0 and NaN are false
+			double condition = function.values[terminator.value].number;
+			bool taken = condition != 0 && !std::isnan(condition);
+			BlockId target = terminator.targets[taken ? 0 : 1];
+			removeEdge(function, b, terminator.targets[taken ? 1 : 0]);
+			terminator = { IrTerminator::Kind::jump, noValueId, { target, 0 } };
+			removedEdges = changed = true;
+		}
+		if (removedEdges) {
+			function.sortBlocks();
+		}
+	}
+	return changed;
+}
+
+bool Passes::eliminateCommonSubexpressions(IrModule& module) {
+	bool changed = false;
+	for (IrFunction& function : module.functions) {
+		std::vector<BlockId> idom = immediateDominators(function);
+		std::unordered_map<ExprKey, std::vector<ValueId>, ExprKeyHash> seen;
+		// What each removed instruction was replaced with. Uses always come after the definition
+		// in block order, so one forward sweep catches all of them
+		std::vector<ValueId> replacement(function.values.size(), noValueId);
+		auto resolve = [&](ValueId& value) {
+			if (value != noValueId && replacement[value] != noValueId) {
+				value = replacement[value];
+			}
+		};
+		for (BlockId b = 0; b < function.blocks.size(); b++) {
+			IrBlock& block = function.blocks[b];
+			for (ValueId value : block.instrs) {
+				IrInstr& instr = function.values[value];
+				for (ValueId& operand : instr.operands) {
+					resolve(operand);
+				}
+				if (!isPure(instr) || instr.op == IrOp::param) {
+					continue;
+				}
+				uint64_t bits;
+				std::memcpy(&bits, &instr.number, sizeof(bits));
+				ExprKey key { instr.op, instr.index, bits, instr.op == IrOp::phi ? b : 0, instr.operands };
+				if (instr.op == IrOp::add || instr.op == IrOp::mul) {
+					std::sort(key.operands.begin(), key.operands.end());
+				}
+				std::vector<ValueId>& equal = seen[std::move(key)];
+				auto dominating = std::find_if(equal.begin(), equal.end(), [&](ValueId other) {
+					return dominates(idom, function.values[other].block, b);
+				});
+				if (dominating == equal.end()) {
+					equal.push_back(value);
+					continue;
+				}
+				replacement[value] = *dominating;
+				instr.block = IrFunction::noBlock;
+				changed = true;
+			}
+			resolve(block.terminator.value);
+		}
+		dropRemoved(function);
+	}
+	return changed;
+}
+
+bool Passes::eliminateDeadCode(IrModule& module) {
+	bool changed = false;
+	for (IrFunction& function : module.functions) {
+		std::vector<bool> live(function.values.size(), false);
+		std::vector<ValueId> worklist;
+		auto markLive = [&](ValueId value) {
+			if (value != noValueId && !live[value]) {
+				live[value] = true;
+				worklist.push_back(value);
+			}
+		};
+		for (const IrBlock& block : function.blocks) {
+			markLive(block.terminator.value);
+			for (ValueId value : block.instrs) {
+				if (!isPure(function.values[value])) {
+					markLive(value);
+				}
+			}
+		}
+		while (!worklist.empty()) {
+			ValueId value = worklist.back();
+			worklist.pop_back();
+			for (ValueId operand : function.values[value].operands) {
+				markLive(operand);
+			}
+		}
+
+		for (const IrBlock& block : function.blocks) {
+			for (ValueId value : block.instrs) {
+				if (!live[value]) {
+					function.values[value].block = IrFunction::noBlock;
+					changed = true;
+				}
+			}
+		}
+		dropRemoved(function);
+	}
+	return changed;
+}
+
+bool Passes::mergeBlocks(IrModule& module) {
+	bool changed = false;
+	for (IrFunction& function : module.functions) {
+		bool merged = false;
+		for (BlockId b = 0; b < function.blocks.size(); b++) {
+			while (true) {
+				IrTerminator terminator = function.blocks[b].terminator;
+				if (terminator.kind != IrTerminator::Kind::jump || function.blocks[terminator.targets[0]].preds.size() != 1) {
+					break;
+				}
+				BlockId next = terminator.targets[0];
+				// With one predecessor, a phi is just its one operand
+				for (ValueId value : function.blocks[next].instrs) {
+					IrInstr& instr = function.values[value];
+					if (instr.op == IrOp::phi) {
+						instr.block = IrFunction::noBlock;
+						function.replaceAllUses(value, instr.operands[0]);
+						continue;
+					}
+					instr.block = b;
+					function.blocks[b].instrs.push_back(value);
+				}
+				function.blocks[next].instrs.clear();
+				function.blocks[next].preds.clear();
+				function.blocks[b].terminator = function.blocks[next].terminator;
+				function.blocks[next].terminator = {};
+				for (BlockId successor : successors(function.blocks[b].terminator)) {
+					replacePred(function, successor, next, b);
+				}
+				merged = changed = true;
+			}
+		}
+		// The merged blocks can't be reached anymore
+		if (merged) {
+			function.sortBlocks();
+		}
+	}
+	return changed;
+}
+
+PassManager::PassManager(std::string_view pipeline) {
+	while (!pipeline.empty()) {
+		size_t comma = std::min(pipeline.find(','), pipeline.size());
+		std::string_view name = pipeline.substr(0, comma);
+		pipeline.remove_prefix(std::min(comma + 1, pipeline.size()));
+		if (name.empty()) {
+			continue;
+		}
+		auto pass = std::find_if(std::begin(passTable), std::end(passTable), [&](const auto& entry) {
+			return entry.first == name;
+		});
+		if (pass == std::end(passTable)) {
+			throw Error("There is no pass called '" + std::string(name) + "'");
+		}
+		passes.push_back({ pass->first, pass->second });
+	}
+}
+
+void PassManager::run(IrModule& module, std::ostream* report) const {
+	for (const Pass& pass : passes) {
+		size_t before = module.instrCount();
+		auto start = std::chrono::high_resolution_clock::now();
+		pass.run(module);
+		auto end = std::chrono::high_resolution_clock::now();
+		if (report == nullptr) {
+			continue;
+		}
+		size_t after = module.instrCount();
+		// Formatted on the side so the flags of 'report' stay as they were
+		std::ostringstream line;
+		line << std::left << std::setw(12) << pass.name << std::right << std::fixed << std::setprecision(3)
+		     << std::setw(9) << std::chrono::duration<double, std::milli>(end - start).count() << "ms  "
+		     << std::setw(5) << before << " -> " << std::setw(5) << after << " instructions";
+		if (after != before) {
+			line << " (" << std::showpos << (int64_t(after) - int64_t(before)) << ')';
+		}
+		*report << line.str() << '\n';
+	}
+}
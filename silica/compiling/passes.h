@@ -0,0 +1,56 @@
+#pragma once
+#include "include.h"
+#include "compiling/ir.h"
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// The passes, each returns whether it changed anything
+namespace Passes {
+	// Replaces calls to small functions with a copy of their body
+	bool inlineCalls(IrModule& module);
+	// Replaces phis that get the same value from every predecessor with that value
+	bool propagateCopies(IrModule& module);
+	// Computes operations on constants, and turns branches on constants into jumps
+	bool foldConstants(IrModule& module);
+	// Replaces an instruction with an equal one from a block that dominates it
+	bool eliminateCommonSubexpressions(IrModule& module);
+	// Removes the pure instructions nothing uses
+	bool eliminateDeadCode(IrModule& module);
+	// Merges a block into the only block that jumps to it
+	bool mergeBlocks(IrModule& module);
+
+	// Functions with at most this many instructions are inlined
+	constexpr size_t inlineLimit = 32;
+}
+
+// Folding a branch leaves trivial phis and blocks to merge, which can make more to fold
+constexpr std::string_view defaultPipeline = "inline,fold,copyprop,simplifycfg,fold,cse,dce";
+
+// Runs a list of passes over an IrModule
+class PassManager {
+public:
+	struct Error: std::invalid_argument {
+		using std::invalid_argument::invalid_argument;
+	};
+
+	// The names of the passes separated by commas, each can appear more than once.
+	// Throws PassManager::Error for a name that isn't a pass
+	explicit PassManager(std::string_view pipeline = defaultPipeline);
+
+	// Prints how long each pass took and how the number of instructions changed to 'report', when it isn't nullptr
+	void run(IrModule& module, std::ostream* report = nullptr) const;
+
+private:
+	struct Pass {
+		std::string_view name;
+		bool (*run)(IrModule& module);
+	};
+	std::vector<Pass> passes;
+};
+
+}
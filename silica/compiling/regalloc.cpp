@@ -0,0 +1,193 @@
+#include "compiling/regalloc.h"
+#include <algorithm>
+
+using namespace Silica;
+
+bool Silica::readsFirstOperand(xed_iclass_enum_t iclass) {
+	switch (iclass) {
+	case XED_ICLASS_MOVSD_XMM:
+	case XED_ICLASS_MOVAPD:
+	case XED_ICLASS_MOVQ:
+	case XED_ICLASS_MOV:
+		return false;
+	default:
+		return true;
+	}
+}
+
+bool Silica::writesFirstOperand(xed_iclass_enum_t iclass) {
+	switch (iclass) {
+	case XED_ICLASS_UCOMISD:
+	case XED_ICLASS_CALL_NEAR:
+	case XED_ICLASS_JMP:
+	case XED_ICLASS_JZ:
+	case XED_ICLASS_JNZ:
+		return false;
+	default:
+		return true;
+	}
+}
+
+namespace {
+	constexpr uint32_t unseen = UINT32_MAX;
+
+	struct Interval {
+		uint32_t vreg;
+		uint32_t start;
+		uint32_t end;
+	};
+
+	// When a register of the calling convention must not be handed out, from its write up to its last read
+	struct FixedRange {
+		uint32_t start;
+		uint32_t end;
+	};
+
+	int xmmIndex(xed_reg_enum_t reg) {
+		int index = int(reg) - int(XED_REG_XMM0);
+		return index >= 0 && index < 16 ? index : -1;
+	}
+
+	bool overlaps(const Interval& interval, FixedRange range) {
+		// Sharing the instruction at either end is fine: the register is read before it's written
+		return interval.start < range.end && range.start < interval.end;
+	}
+}
+
+RegisterAllocation Silica::allocateRegisters(const std::vector<MachineInstr>& code, uint32_t vregCount,
+                                             size_t paramCount, int32_t frameOffset) {
+	RegisterAllocation result;
+	result.regs.assign(vregCount, XED_REG_INVALID);
+	result.spills.resize(vregCount);
+
+	std::vector<Interval> intervals(vregCount, { 0, unseen, 0 });
+	std::vector<uint32_t> calls;
+	std::array<std::vector<FixedRange>, 16> fixed;
+	// Arguments arrive in XMM0..7 and stay there until they are copied out
+	for (size_t i = 0; i < paramCount; i++) {
+		fixed[i].push_back({ 0, 0 });
+	}
+
+	for (uint32_t i = 0; i < code.size(); i++) {
+		const MachineInstr& instr = code[i];
+		if (instr.iclass == XED_ICLASS_CALL_NEAR) {
+			calls.push_back(i);
+			for (int arg = 0; arg < instr.argCount; arg++) {
+				if (!fixed[arg].empty()) {
+					fixed[arg].back().end = i;
+				}
+			}
+			// The result
+			fixed[0].push_back({ i, i });
+		}
+		// 'xorpd x, x' only writes x
+		bool zeroIdiom = instr.operandCount == 2 && instr.operands[0].kind == instr.operands[1].kind
+			&& instr.operands[0].reg == instr.operands[1].reg && instr.operands[0].index == instr.operands[1].index;
+		for (size_t k = 0; k < instr.operandCount; k++) {
+			const MachineOperand& op = instr.operands[k];
+			if (op.kind == MachineOperand::Kind::vreg) {
+				Interval& interval = intervals[op.index];
+				interval.vreg = op.index;
+				interval.start = std::min(interval.start, i);
+				interval.end = std::max(interval.end, i);
+			}
+			else if (op.kind == MachineOperand::Kind::reg) {
+				int xmm = xmmIndex(op.reg);
+				if (xmm < 0) {
+					continue;
+				}
+				bool read = k != 0 || (readsFirstOperand(instr.iclass) && !zeroIdiom);
+				bool written = k == 0 && writesFirstOperand(instr.iclass);
+				if (read && !fixed[xmm].empty()) {
+					fixed[xmm].back().end = i;
+				}
+				if (written) {
+					fixed[xmm].push_back({ i, i });
+				}
+			}
+		}
+	}
+
+	std::vector<Interval> sorted;
+	for (const Interval& interval : intervals) {
+		if (interval.start != unseen) {
+			sorted.push_back(interval);
+		}
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const Interval& a, const Interval& b) {
+		return a.start < b.start;
+	});
+
+	auto crossesCall = [&](const Interval& interval) {
+		auto call = std::upper_bound(calls.begin(), calls.end(), interval.start);
+		return call != calls.end() && *call < interval.end;
+	};
+	auto conflicts = [&](int xmm, const Interval& interval) {
+		for (FixedRange range : fixed[xmm]) {
+			if (overlaps(interval, range)) {
+				return true;
+			}
+		}
+		return false;
+	};
+	int32_t nextSlot = frameOffset;
+	auto spill = [&](uint32_t vreg) {
+		nextSlot -= 8;
+		result.regs[vreg] = XED_REG_INVALID;
+		result.spills[vreg] = Location(Gpr { Gpr::Reg::c_bp, Gpr::Type::gp64 }, nextSlot);
+	};
+	auto assign = [&](uint32_t vreg, int xmm) {
+		result.regs[vreg] = xed_reg_enum_t(int(XED_REG_XMM0) + xmm);
+		result.usedXmms |= 1u << xmm;
+	};
+
+	// Sorted by end
+	std::vector<Interval> active;
+	uint32_t freeXmms = (1u << allocatableXmms) - 1;
+	for (const Interval& current : sorted) {
+		// Expire the intervals that ended, their registers are free again
+		while (!active.empty() && active.front().end <= current.start) {
+			freeXmms |= 1u << xmmIndex(result.regs[active.front().vreg]);
+			active.erase(active.begin());
+		}
+		// Only the callee saved registers survive a call. The others are tried first otherwise,
+		// so the callee saved ones are left for the intervals that need them
+		bool needsCalleeSaved = crossesCall(current);
+		uint32_t allowed = needsCalleeSaved ? calleeSavedXmms : (1u << allocatableXmms) - 1;
+		int chosen = -1;
+		for (uint32_t preferred : { allowed & ~calleeSavedXmms, allowed & calleeSavedXmms }) {
+			for (int xmm = 0; chosen == -1 && xmm < allocatableXmms; xmm++) {
+				if ((preferred & freeXmms & (1u << xmm)) != 0 && !conflicts(xmm, current)) {
+					chosen = xmm;
+				}
+			}
+		}
+		if (chosen == -1) {
+			// Spill whichever ends last, the current interval or an active one whose register it can use
+			auto victim = active.end();
+			for (auto it = active.begin(); it != active.end(); it++) {
+				int xmm = xmmIndex(result.regs[it->vreg]);
+				if ((allowed & (1u << xmm)) != 0 && !conflicts(xmm, current)) {
+					victim = it;
+				}
+			}
+			if (victim == active.end() || victim->end <= current.end) {
+				spill(current.vreg);
+				continue;
+			}
+			chosen = xmmIndex(result.regs[victim->vreg]);
+			spill(victim->vreg);
+			active.erase(victim);
+		}
+		else {
+			freeXmms &= ~(1u << chosen);
+		}
+		assign(current.vreg, chosen);
+		auto position = std::upper_bound(active.begin(), active.end(), current, [](const Interval& a, const Interval& b) {
+			return a.end < b.end;
+		});
+		active.insert(position, current);
+	}
+	result.spillBytes = frameOffset - nextSlot;
+	return result;
+}
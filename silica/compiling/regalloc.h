@@ -0,0 +1,104 @@
+#pragma once
+#include "include.h"
+#include "compiling/compiler.h"
+extern "C" {
+	#include "xed/xed-interface.h"
+}
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace Silica {
+
+struct MachineOperand {
+	enum class Kind: uint8_t {
+		none,
+		reg,      // a fixed register, 'reg'
+		vreg,     // the virtual XMM register 'index'
+		imm,      // 'value', 'width' bits wide
+		label,    // a rel32 to the instruction at labels['index']
+		function, // a rel32 to the entry point of Ast::functions['index']
+		external  // a rel32 to Compiler::externs['index']
+	};
+	Kind kind = Kind::none;
+	xed_reg_enum_t reg = XED_REG_INVALID;
+	uint32_t index = 0;
+	uint32_t width = 0;
+	uint64_t value = 0;
+
+	static MachineOperand fixed(xed_reg_enum_t reg) {
+		MachineOperand op;
+		op.kind = Kind::reg;
+		op.reg = reg;
+		return op;
+	}
+	static MachineOperand virt(uint32_t vreg) {
+		MachineOperand op;
+		op.kind = Kind::vreg;
+		op.index = vreg;
+		return op;
+	}
+	static MachineOperand imm(uint64_t value, uint32_t width) {
+		MachineOperand op;
+		op.kind = Kind::imm;
+		op.value = value;
+		op.width = width;
+		return op;
+	}
+	static MachineOperand target(Kind kind, uint32_t index) {
+		MachineOperand op;
+		op.kind = kind;
+		op.index = index;
+		return op;
+	}
+};
+
+// An instruction whose XMM operands may still be virtual registers
+struct MachineInstr {
+	xed_iclass_enum_t iclass;
+	xed_uint_t operandWidth;
+	uint8_t operandCount = 0;
+	// Calls: how many of XMM0-7 hold arguments
+	uint8_t argCount = 0;
+	std::array<MachineOperand, 3> operands;
+};
+
+// Whether an instruction reads and/or writes its first operand, the others are only read
+bool readsFirstOperand(xed_iclass_enum_t iclass);
+bool writesFirstOperand(xed_iclass_enum_t iclass);
+
+// XMM registers the register allocator never hands out, they hold spilled operands while encoding
+constexpr xed_reg_enum_t scratchXmm0 = XED_REG_XMM14;
+constexpr xed_reg_enum_t scratchXmm1 = XED_REG_XMM15;
+constexpr int allocatableXmms = 14;
+
+// XMM registers a function has to preserve for its caller, as a mask of XMM0..15
+#if HOST == HOST_WIN
+constexpr uint32_t calleeSavedXmms = 0xFFC0;
+#else
+// System V: every XMM register is caller saved
+constexpr uint32_t calleeSavedXmms = 0;
+#endif
+
+struct RegisterAllocation {
+	// Per virtual register: its XMM register, or XED_REG_INVALID when it was spilled
+	std::vector<xed_reg_enum_t> regs;
+	// Per virtual register: its stack slot when it was spilled
+	std::vector<std::optional<Location>> spills;
+	// The XMM registers handed out, as a mask of XMM0..15
+	uint32_t usedXmms = 0;
+	// Bytes of stack frame the spill slots take
+	int32_t spillBytes = 0;
+};
+
+// Linear scan register allocation (Poletto & Sarkar) of the virtual registers in 'code'.
+// Code only jumps forwards, so a virtual register is live from its first to its last appearance.
+// Calls clobber the XMM registers outside calleeSavedXmms: values live across one are kept in a callee saved
+// register when one is free and spilled otherwise, and the XMM registers the calling convention uses around
+// calls and at the entry are kept free while they are needed.
+// Spill slots are below 'frameOffset', relative to rbp.
+RegisterAllocation allocateRegisters(const std::vector<MachineInstr>& code, uint32_t vregCount,
+                                     size_t paramCount, int32_t frameOffset);
+
+}
@@ -0,0 +1,120 @@
+#include "compiling/threadpool.h"
+#include <algorithm>
+
+using namespace Silica;
+
+ThreadPool::ThreadPool(size_t threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threadCount; i++) {
+		queues.push_back(std::make_unique<Queue>());
+	}
+	// Queue 0 belongs to the thread that calls forEach
+	for (size_t i = 1; i < threadCount; i++) {
+		threads.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	batchStarted.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::forEach(size_t count, const std::function<void(size_t)>& function) {
+	if (count == 0) {
+		return;
+	}
+	// Contiguous shares, neighbouring tasks tend to be alike
+	size_t share = (count + queues.size() - 1) / queues.size();
+	for (size_t i = 0; i < queues.size(); i++) {
+		std::lock_guard lock(queues[i]->mutex);
+		for (size_t t = i * share; t < std::min(count, (i + 1) * share); t++) {
+			queues[i]->tasks.push_back(t);
+		}
+	}
+	{
+		std::lock_guard lock(mutex);
+		task = &function;
+		remaining = count;
+		busyThreads = threads.size();
+		error = nullptr;
+		batch++;
+	}
+	batchStarted.notify_all();
+
+	work(0);
+
+	// The workers may still be finishing tasks they took, or looking for more
+	std::unique_lock lock(mutex);
+	batchDone.wait(lock, [&] { return busyThreads == 0; });
+	task = nullptr;
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void ThreadPool::workerLoop(size_t self) {
+	uint64_t seen = 0;
+	while (true) {
+		{
+			std::unique_lock lock(mutex);
+			batchStarted.wait(lock, [&] { return stopping || batch != seen; });
+			if (stopping) {
+				return;
+			}
+			seen = batch;
+		}
+		work(self);
+		{
+			std::lock_guard lock(mutex);
+			busyThreads--;
+		}
+		batchDone.notify_one();
+	}
+}
+
+void ThreadPool::work(size_t self) {
+	size_t taskIndex;
+	while (remaining > 0 && take(self, taskIndex)) {
+		try {
+			(*task)(taskIndex);
+		}
+		catch (...) {
+			std::lock_guard lock(mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+		}
+		remaining--;
+	}
+}
+
+bool ThreadPool::take(size_t self, size_t& taskIndex) {
+	{
+		Queue& own = *queues[self];
+		std::lock_guard lock(own.mutex);
+		if (!own.tasks.empty()) {
+			taskIndex = own.tasks.front();
+			own.tasks.pop_front();
+			return true;
+		}
+	}
+	// Steal from the back, the end the owner gets to last
+	for (size_t i = 1; i < queues.size(); i++) {
+		Queue& other = *queues[(self + i) % queues.size()];
+		std::lock_guard lock(other.mutex);
+		if (!other.tasks.empty()) {
+			taskIndex = other.tasks.back();
+			other.tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
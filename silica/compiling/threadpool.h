@@ -0,0 +1,62 @@
+#pragma once
+#include "include.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Silica {
+
+// A fixed set of threads that run batches of independent tasks.
+// Each thread, including the one waiting for the batch, starts on its own share of the tasks,
+// and takes tasks from the back of another thread's share once its own runs out
+class ThreadPool {
+public:
+	// 'threads' counts the calling thread, 0 is one per core
+	explicit ThreadPool(size_t threads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls task(i) for every i below 'count' and returns once they're all done.
+	// When tasks throw, the first exception is rethrown here after the rest have finished.
+	// Not reentrant: a task can't call forEach on the same pool
+	void forEach(size_t count, const std::function<void(size_t)>& task);
+
+	// The threads tasks run on, the calling thread included
+	size_t size() const {
+		return queues.size();
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	// The current batch
+	std::mutex mutex;
+	std::condition_variable batchStarted;
+	std::condition_variable batchDone;
+	const std::function<void(size_t)>* task = nullptr;
+	uint64_t batch = 0;
+	std::atomic<size_t> remaining = 0;
+	size_t busyThreads = 0;
+	std::exception_ptr error;
+	bool stopping = false;
+
+	void workerLoop(size_t self);
+	// Runs tasks of the current batch until there are none left to take
+	void work(size_t self);
+	bool take(size_t self, size_t& taskIndex);
+};
+
+}
@@ -0,0 +1,69 @@
+#include "compiling/tiers.h"
+#include <cstring>
+#include <exception>
+
+using namespace Silica;
+
+Tiers::Tiers(Compiler& compiler, IrModule module, std::string_view pipeline, uint64_t threshold, std::ostream* report):
+	compiler(compiler), module(std::move(module)), passes(pipeline), threshold(threshold), report(report) {}
+
+void Tiers::compile(ThreadPool* pool) {
+	size_t functionCount = module.functions.size();
+	tableSection = compiler.sections.size();
+	compiler.sections.emplace_back(Rights::rwdata);
+	compiler.sections[tableSection].data.resize(16 * functionCount);
+
+	Backend baseline(compiler, module);
+	baseline.callTable = Backend::CallTable { tableSection, 0 };
+	baseline.callCounters = Backend::CallCounters { countersOffset(), &Tiers::tierUp, this };
+	if (pool != nullptr) {
+		baseline.compile(*pool);
+	}
+	else {
+		baseline.compile();
+	}
+
+	for (size_t i = 0; i < functionCount; i++) {
+		compiler.links.push_back({ tableSection, 8 * i, baseline.codeSections[i], baseline.entryPoints[i] });
+		std::memcpy(&compiler.sections[tableSection].data[countersOffset() + 8 * i], &threshold, sizeof(threshold));
+	}
+}
+
+double Tiers::run(uint32_t function) {
+	// The entry in the table is filled in by linking
+	compiler.link();
+	uintptr_t entry;
+	std::memcpy(&entry, compiler.sections[tableSection].address + 8 * function, sizeof(entry));
+	return reinterpret_cast<double(*)()>(entry)();
+}
+
+void Tiers::tierUp(void* context, uint64_t function) {
+	Tiers& tiers = *static_cast<Tiers*>(context);
+	// Nothing can be thrown through the generated code, the baseline tier just stays in use
+	try {
+		tiers.optimise(uint32_t(function));
+	}
+	catch (std::exception& e) {
+		if (tiers.report != nullptr) {
+			*tiers.report << "Couldn't optimise " << symbolName(tiers.module.functions[function].name) << ": " << e.what() << '\n';
+		}
+	}
+}
+
+void Tiers::optimise(uint32_t function) {
+	if (!optimisedModule.has_value()) {
+		optimisedModule = module;
+		passes.run(*optimisedModule, report);
+	}
+
+	Backend optimising(compiler, *optimisedModule);
+	optimising.callTable = Backend::CallTable { tableSection, 0 };
+	optimising.compile(function);
+	uintptr_t entry = uintptr_t(compiler.load(optimising.codeSection) + optimising.entryPoints[function]);
+	std::memcpy(compiler.sections[tableSection].address + 8 * function, &entry, sizeof(entry));
+
+	optimisedFunctions.push_back(function);
+	if (report != nullptr) {
+		*report << "Optimised " << symbolName(module.functions[function].name) << " after " << threshold << " calls\n";
+	}
+}
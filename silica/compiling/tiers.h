@@ -0,0 +1,60 @@
+#pragma once
+#include "include.h"
+#include "compiling/backend.h"
+#include "compiling/compiler.h"
+#include "compiling/ir.h"
+#include "compiling/passes.h"
+#include "compiling/threadpool.h"
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// Compiles an IrModule in two tiers. At first every function is compiled without the optimisation passes,
+// which is quick, and counts its calls. A function called 'threshold' times is compiled again from the
+// optimised module and its entry in the call table is pointed at the new code, which the following calls go to.
+// Calls between functions always go through the table, so they reach the newest code of the callee.
+class Tiers {
+public:
+	// Throws PassManager::Error for a bad pipeline. 'report', when it isn't nullptr, gets the functions that are optimised
+	Tiers(Compiler& compiler, IrModule module, std::string_view pipeline, uint64_t threshold, std::ostream* report = nullptr);
+	Tiers(const Tiers&) = delete;
+	Tiers& operator=(const Tiers&) = delete;
+
+	// Compiles the baseline tier of every function, on the threads of 'pool' when it isn't nullptr.
+	// Throws Backend::Error for what it can't compile
+	void compile(ThreadPool* pool = nullptr);
+
+	// Links the compiler and calls 'function', which takes no arguments
+	double run(uint32_t function);
+
+	// The functions that were compiled again with the optimisation passes, in the order they got hot
+	const std::vector<uint32_t>& optimised() const {
+		return optimisedFunctions;
+	}
+
+private:
+	Compiler& compiler;
+	IrModule module;
+	PassManager passes;
+	uint64_t threshold;
+	std::ostream* report;
+
+	// The call table: the entry point of function i at 8*i, then the call counter of function i at 8*(functions + i)
+	size_t tableSection;
+	// Made from 'module' when the first function gets hot
+	std::optional<IrModule> optimisedModule;
+	std::vector<uint32_t> optimisedFunctions;
+
+	size_t countersOffset() const {
+		return 8 * module.functions.size();
+	}
+	// Called by the baseline code of 'function' when its counter reaches 0
+	static void tierUp(void* context, uint64_t function);
+	void optimise(uint32_t function);
+};
+
+}
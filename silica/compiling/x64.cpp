@@ -0,0 +1,414 @@
+#include "compiling/x64.h"
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+using namespace Silica;
+
+X64Operand X64Operand::fromReg(xed_reg_enum_t reg) {
+	X64Operand op;
+	op.kind = Kind::reg;
+	op.reg = reg;
+	return op;
+}
+
+X64Operand X64Operand::fromGpr(Gpr gpr) {
+	myAssert(gpr.type == Gpr::Type::gp64);
+	return fromReg(xed_reg_enum_t(int(XED_REG_RAX) + int(gpr.value)));
+}
+
+X64Operand X64Operand::fromLocation(const Location& location, uint32_t widthBits) {
+	X64Operand op;
+	op.kind = Kind::memory;
+	op.width = widthBits;
+	if (auto* rip = std::get_if<Location::RipRelative>(&location.data)) {
+		op.ripRelative = true;
+		op.displacement = rip->displacement;
+		return op;
+	}
+	const auto& sibda = std::get<Location::Sibda>(location.data);
+	op.base = sibda.base;
+	op.index = sibda.index;
+	op.scale = sibda.scale;
+	op.displacement = sibda.displacement;
+	return op;
+}
+
+X64Operand X64Operand::fromImm(int64_t value, uint32_t widthBits) {
+	X64Operand op;
+	op.kind = Kind::imm;
+	op.value = value;
+	op.width = widthBits;
+	return op;
+}
+
+X64Operand X64Operand::fromRel32() {
+	X64Operand op;
+	op.kind = Kind::rel32;
+	return op;
+}
+
+namespace {
+
+enum class Form: uint8_t {
+	none,       // no operands
+	xmmRm,      // xmm, xmm/m
+	rmXmm,      // m, xmm
+	xmmRmImm8,  // xmm, xmm/m, imm8
+	xmmGprRm,   // xmm, r/m64
+	rmGpr,      // r/m64, r64
+	gprRm,      // r64, m64
+	gprImm64,   // r64, imm64 with the register in the opcode
+	rmImm,      // r/m64, imm32, or imm8 with 'opcode' + 2
+	rm,         // r/m64, 64 bit without REX.W
+	plusReg,    // r64 in the opcode, 64 bit without REX.W
+	rel32
+};
+
+struct Encoding {
+	xed_iclass_enum_t iclass;
+	Form form;
+	// 0x66, 0xF2, or 0 for none
+	uint8_t prefix;
+	// 0x0F, or 0 for a one byte opcode
+	uint8_t escape;
+	uint8_t opcode;
+	// ModRM.reg for the forms with one register or memory operand
+	uint8_t extension;
+};
+
+// The first form of an iclass that fits the operands is used
+constexpr Encoding encodings[] = {
+	{ XED_ICLASS_ADDSD,       Form::xmmRm,     0xF2, 0x0F, 0x58, 0 },
+	{ XED_ICLASS_SUBSD,       Form::xmmRm,     0xF2, 0x0F, 0x5C, 0 },
+	{ XED_ICLASS_MULSD,       Form::xmmRm,     0xF2, 0x0F, 0x59, 0 },
+	{ XED_ICLASS_DIVSD,       Form::xmmRm,     0xF2, 0x0F, 0x5E, 0 },
+	{ XED_ICLASS_SQRTSD,      Form::xmmRm,     0xF2, 0x0F, 0x51, 0 },
+	{ XED_ICLASS_MINSD,       Form::xmmRm,     0xF2, 0x0F, 0x5D, 0 },
+	{ XED_ICLASS_MAXSD,       Form::xmmRm,     0xF2, 0x0F, 0x5F, 0 },
+	{ XED_ICLASS_ANDPD,       Form::xmmRm,     0x66, 0x0F, 0x54, 0 },
+	{ XED_ICLASS_XORPD,       Form::xmmRm,     0x66, 0x0F, 0x57, 0 },
+	{ XED_ICLASS_UCOMISD,     Form::xmmRm,     0x66, 0x0F, 0x2E, 0 },
+	{ XED_ICLASS_CMPSD_XMM,   Form::xmmRmImm8, 0xF2, 0x0F, 0xC2, 0 },
+	{ XED_ICLASS_MOVSD_XMM,   Form::xmmRm,     0xF2, 0x0F, 0x10, 0 },
+	{ XED_ICLASS_MOVSD_XMM,   Form::rmXmm,     0xF2, 0x0F, 0x11, 0 },
+	{ XED_ICLASS_MOVAPD,      Form::xmmRm,     0x66, 0x0F, 0x28, 0 },
+	{ XED_ICLASS_MOVAPD,      Form::rmXmm,     0x66, 0x0F, 0x29, 0 },
+	{ XED_ICLASS_MOVUPS,      Form::xmmRm,     0x00, 0x0F, 0x10, 0 },
+	{ XED_ICLASS_MOVUPS,      Form::rmXmm,     0x00, 0x0F, 0x11, 0 },
+	{ XED_ICLASS_MOVQ,        Form::xmmGprRm,  0x66, 0x0F, 0x6E, 0 },
+	{ XED_ICLASS_MOV,         Form::gprImm64,  0x00, 0x00, 0xB8, 0 },
+	{ XED_ICLASS_MOV,         Form::rmGpr,     0x00, 0x00, 0x89, 0 },
+	{ XED_ICLASS_MOV,         Form::gprRm,     0x00, 0x00, 0x8B, 0 },
+	{ XED_ICLASS_ADD,         Form::rmImm,     0x00, 0x00, 0x81, 0 },
+	{ XED_ICLASS_ADD,         Form::rmGpr,     0x00, 0x00, 0x01, 0 },
+	{ XED_ICLASS_SUB,         Form::rmImm,     0x00, 0x00, 0x81, 5 },
+	{ XED_ICLASS_SUB,         Form::rmGpr,     0x00, 0x00, 0x29, 0 },
+	{ XED_ICLASS_CMP,         Form::rmImm,     0x00, 0x00, 0x81, 7 },
+	{ XED_ICLASS_CMP,         Form::rmGpr,     0x00, 0x00, 0x39, 0 },
+	{ XED_ICLASS_PUSH,        Form::plusReg,   0x00, 0x00, 0x50, 0 },
+	{ XED_ICLASS_POP,         Form::plusReg,   0x00, 0x00, 0x58, 0 },
+	{ XED_ICLASS_CALL_NEAR,   Form::rel32,     0x00, 0x00, 0xE8, 0 },
+	{ XED_ICLASS_CALL_NEAR,   Form::rm,        0x00, 0x00, 0xFF, 2 },
+	{ XED_ICLASS_JMP,         Form::rel32,     0x00, 0x00, 0xE9, 0 },
+	{ XED_ICLASS_JMP,         Form::rm,        0x00, 0x00, 0xFF, 4 },
+	{ XED_ICLASS_JB,          Form::rel32,     0x00, 0x0F, 0x82, 0 },
+	{ XED_ICLASS_JNB,         Form::rel32,     0x00, 0x0F, 0x83, 0 },
+	{ XED_ICLASS_JZ,          Form::rel32,     0x00, 0x0F, 0x84, 0 },
+	{ XED_ICLASS_JNZ,         Form::rel32,     0x00, 0x0F, 0x85, 0 },
+	{ XED_ICLASS_JBE,         Form::rel32,     0x00, 0x0F, 0x86, 0 },
+	{ XED_ICLASS_JNBE,        Form::rel32,     0x00, 0x0F, 0x87, 0 },
+	{ XED_ICLASS_JP,          Form::rel32,     0x00, 0x0F, 0x8A, 0 },
+	{ XED_ICLASS_JNP,         Form::rel32,     0x00, 0x0F, 0x8B, 0 },
+	{ XED_ICLASS_RET_NEAR,    Form::none,      0x00, 0x00, 0xC3, 0 }
+};
+
+bool isXmm(const X64Operand& op) {
+	return op.kind == X64Operand::Kind::reg && op.reg >= XED_REG_XMM0 && op.reg <= XED_REG_XMM15;
+}
+bool isGpr(const X64Operand& op) {
+	return op.kind == X64Operand::Kind::reg && op.reg >= XED_REG_RAX && op.reg <= XED_REG_R15;
+}
+bool isMemory(const X64Operand& op) {
+	return op.kind == X64Operand::Kind::memory;
+}
+bool isImm(const X64Operand& op, uint32_t width) {
+	return op.kind == X64Operand::Kind::imm && op.width == width;
+}
+bool fitsInt8(int64_t value) {
+	return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+// The register's number in ModRM, SIB and REX
+int number(xed_reg_enum_t reg) {
+	return reg >= XED_REG_XMM0 ? int(reg) - int(XED_REG_XMM0) : int(reg) - int(XED_REG_RAX);
+}
+int number(Gpr gpr) {
+	return int(gpr.value);
+}
+
+bool matches(const Encoding& encoding, xed_uint_t operandWidth, const X64Operand* ops, size_t count) {
+	switch (encoding.form) {
+	case Form::none:
+		return count == 0;
+	case Form::xmmRm:
+		return count == 2 && isXmm(ops[0]) && (isXmm(ops[1]) || isMemory(ops[1]));
+	case Form::rmXmm:
+		return count == 2 && isMemory(ops[0]) && isXmm(ops[1]);
+	case Form::xmmRmImm8:
+		return count == 3 && isXmm(ops[0]) && (isXmm(ops[1]) || isMemory(ops[1])) && isImm(ops[2], 8);
+	case Form::xmmGprRm:
+		return count == 2 && isXmm(ops[0]) && (isGpr(ops[1]) || isMemory(ops[1]));
+	case Form::rmGpr:
+		return operandWidth == 64 && count == 2 && (isGpr(ops[0]) || isMemory(ops[0])) && isGpr(ops[1]);
+	case Form::gprRm:
+		return operandWidth == 64 && count == 2 && isGpr(ops[0]) && isMemory(ops[1]);
+	case Form::gprImm64:
+		return operandWidth == 64 && count == 2 && isGpr(ops[0]) && isImm(ops[1], 64);
+	case Form::rmImm:
+		return operandWidth == 64 && count == 2 && (isGpr(ops[0]) || isMemory(ops[0]))
+			&& ((isImm(ops[1], 8) && fitsInt8(ops[1].value)) || isImm(ops[1], 32));
+	case Form::rm:
+		return count == 1 && (isGpr(ops[0]) || isMemory(ops[0]));
+	case Form::plusReg:
+		return count == 1 && isGpr(ops[0]);
+	case Form::rel32:
+		return count == 1 && ops[0].kind == X64Operand::Kind::rel32;
+	}
+	return false;
+}
+
+// Bytes of displacement the ModRM form of a memory operand takes: 0, 1 or 4
+int displacementBytes(const X64Operand& memory) {
+	if (memory.ripRelative) {
+		return 4;
+	}
+	// [rbp] and [r13] can only be written with a displacement
+	if (memory.displacement == 0 && (number(memory.base) & 7) != 5) {
+		return 0;
+	}
+	return fitsInt8(memory.displacement) ? 1 : 4;
+}
+
+struct Writer {
+	uint8_t* out;
+	size_t length = 0;
+
+	void byte(uint8_t value) {
+		out[length++] = value;
+	}
+	void little(uint64_t value, int bytes) {
+		for (int i = 0; i < bytes; i++) {
+			byte(uint8_t(value >> (8 * i)));
+		}
+	}
+
+	// Left out when there is nothing to put in it
+	void rex(bool wide, int reg, const X64Operand* rm) {
+		int x = 0;
+		int b = 0;
+		if (rm != nullptr && rm->kind == X64Operand::Kind::reg) {
+			b = number(rm->reg) >> 3;
+		}
+		else if (rm != nullptr && rm->kind == X64Operand::Kind::memory && !rm->ripRelative) {
+			b = number(rm->base) >> 3;
+			x = rm->index.has_value() ? number(*rm->index) >> 3 : 0;
+		}
+		uint8_t value = uint8_t(0x40 | (wide << 3) | ((reg >> 3) << 2) | (x << 1) | b);
+		if (value != 0x40) {
+			byte(value);
+		}
+	}
+
+	void modrm(int reg, const X64Operand& rm) {
+		reg &= 7;
+		if (rm.kind == X64Operand::Kind::reg) {
+			byte(uint8_t(0xC0 | (reg << 3) | (number(rm.reg) & 7)));
+			return;
+		}
+		if (rm.ripRelative) {
+			byte(uint8_t(0x05 | (reg << 3)));
+			little(uint32_t(rm.displacement), 4);
+			return;
+		}
+		int displacement = displacementBytes(rm);
+		int mod = displacement == 0 ? 0 : displacement == 1 ? 1 : 2;
+		int base = number(rm.base) & 7;
+		// rsp and r12 as the base need a SIB byte
+		if (!rm.index.has_value() && base != 4) {
+			byte(uint8_t((mod << 6) | (reg << 3) | base));
+		}
+		else {
+			// An index of 4 (rsp) means there is none
+			int index = rm.index.has_value() ? number(*rm.index) & 7 : 4;
+			myAssert(!rm.index.has_value() || number(*rm.index) != 4, "rsp can't be an index");
+			byte(uint8_t((mod << 6) | (reg << 3) | 4));
+			byte(uint8_t((rm.scale << 6) | (index << 3) | base));
+		}
+		little(uint32_t(rm.displacement), displacement);
+	}
+
+	void opcode(const Encoding& encoding) {
+		if (encoding.escape != 0) {
+			byte(encoding.escape);
+		}
+		byte(encoding.opcode);
+	}
+};
+
+}
+
+xed_encoder_operand_t X64Operand::toXed() const {
+	switch (kind) {
+	case Kind::reg:
+		return xed_reg(reg);
+	case Kind::imm:
+		return width == 64 ? xed_imm0(uint64_t(value), 64) : xed_simm0(int32_t(value), width);
+	case Kind::rel32:
+		return xed_relbr(0, 32);
+	case Kind::memory: {
+		int displacement = displacementBytes(*this);
+		xed_enc_displacement_t disp = xed_disp(this->displacement, displacement * 8);
+		if (ripRelative) {
+			return xed_mem_bd(XED_REG_RIP, disp, width);
+		}
+		auto gpr64 = [](Gpr gpr) {
+			return xed_reg_enum_t(int(XED_REG_RAX) + number(gpr));
+		};
+		if (!index.has_value()) {
+			return displacement == 0 ? xed_mem_b(gpr64(base), width) : xed_mem_bd(gpr64(base), disp, width);
+		}
+		return xed_mem_bisd(gpr64(base), gpr64(*index), 1u << scale, disp, width);
+	}
+	case Kind::none:
+		break;
+	}
+	unreachable();
+	return xed_reg(XED_REG_INVALID);
+}
+
+size_t Silica::encodeX64(uint8_t* out, xed_uint_t operandWidth, xed_iclass_enum_t iclass, const X64Operand* ops, size_t count) {
+	const Encoding* encoding = nullptr;
+	for (const Encoding& candidate : encodings) {
+		if (candidate.iclass == iclass && matches(candidate, operandWidth, ops, count)) {
+			encoding = &candidate;
+			break;
+		}
+	}
+	if (encoding == nullptr) {
+		return 0;
+	}
+
+	Writer w { out };
+	// Mandatory prefixes go before REX
+	if (encoding->prefix != 0) {
+		w.byte(encoding->prefix);
+	}
+	switch (encoding->form) {
+	case Form::none:
+		w.opcode(*encoding);
+		break;
+	case Form::xmmRm:
+	case Form::xmmRmImm8:
+		w.rex(false, number(ops[0].reg), &ops[1]);
+		w.opcode(*encoding);
+		w.modrm(number(ops[0].reg), ops[1]);
+		if (encoding->form == Form::xmmRmImm8) {
+			w.byte(uint8_t(ops[2].value));
+		}
+		break;
+	case Form::rmXmm:
+		w.rex(false, number(ops[1].reg), &ops[0]);
+		w.opcode(*encoding);
+		w.modrm(number(ops[1].reg), ops[0]);
+		break;
+	case Form::xmmGprRm:
+		w.rex(true, number(ops[0].reg), &ops[1]);
+		w.opcode(*encoding);
+		w.modrm(number(ops[0].reg), ops[1]);
+		break;
+	case Form::rmGpr:
+		w.rex(true, number(ops[1].reg), &ops[0]);
+		w.opcode(*encoding);
+		w.modrm(number(ops[1].reg), ops[0]);
+		break;
+	case Form::gprRm:
+		w.rex(true, number(ops[0].reg), &ops[1]);
+		w.opcode(*encoding);
+		w.modrm(number(ops[0].reg), ops[1]);
+		break;
+	case Form::gprImm64:
+		w.rex(true, 0, &ops[0]);
+		w.byte(uint8_t(encoding->opcode + (number(ops[0].reg) & 7)));
+		w.little(uint64_t(ops[1].value), 8);
+		break;
+	case Form::rmImm: {
+		bool short8 = ops[1].width == 8;
+		w.rex(true, 0, &ops[0]);
+		w.byte(short8 ? uint8_t(encoding->opcode + 2) : encoding->opcode);
+		w.modrm(encoding->extension, ops[0]);
+		w.little(uint64_t(ops[1].value), short8 ? 1 : 4);
+		break;
+	}
+	case Form::rm:
+		w.rex(false, 0, &ops[0]);
+		w.opcode(*encoding);
+		w.modrm(encoding->extension, ops[0]);
+		break;
+	case Form::plusReg:
+		w.rex(false, 0, &ops[0]);
+		w.byte(uint8_t(encoding->opcode + (number(ops[0].reg) & 7)));
+		break;
+	case Form::rel32:
+		w.opcode(*encoding);
+		w.little(uint32_t(ops[0].value), 4);
+		break;
+	}
+	return w.length;
+}
+
+namespace {
+
+// Encodes with XED instead, into a buffer of maxInstructionBytes
+size_t encodeWithXed(Compiler& compiler, uint8_t* out, xed_uint_t operandWidth, xed_iclass_enum_t iclass, const X64Operand* ops, size_t count) {
+	switch (count) {
+	case 0:
+		return compiler.xedEncode(out, operandWidth, iclass);
+	case 1:
+		return compiler.xedEncode(out, operandWidth, iclass, ops[0].toXed());
+	case 2:
+		return compiler.xedEncode(out, operandWidth, iclass, ops[0].toXed(), ops[1].toXed());
+	case 3:
+		return compiler.xedEncode(out, operandWidth, iclass, ops[0].toXed(), ops[1].toXed(), ops[2].toXed());
+	default:
+		return compiler.xedEncode(out, operandWidth, iclass, ops[0].toXed(), ops[1].toXed(), ops[2].toXed(), ops[3].toXed());
+	}
+}
+
+std::string hex(const uint8_t* bytes, size_t length) {
+	std::ostringstream out;
+	for (size_t i = 0; i < length; i++) {
+		out << (i == 0 ? "" : " ") << std::hex << std::setw(2) << std::setfill('0') << int(bytes[i]);
+	}
+	return out.str();
+}
+
+}
+
+size_t Compiler::addInstruction(Section& section, xed_uint_t operandWidth, xed_iclass_enum_t iclass, const X64Operand* operands, size_t count) {
+	myAssert(count <= 4);
+	uint8_t bytes[maxInstructionBytes];
+	size_t length = encoder != Encoder::xed ? encodeX64(bytes, operandWidth, iclass, operands, count) : 0;
+	if (length == 0 || encoder == Encoder::crossCheck) {
+		uint8_t viaXed[maxInstructionBytes];
+		size_t xedLength = encodeWithXed(*this, viaXed, operandWidth, iclass, operands, count);
+		if (length != 0 && (length != xedLength || std::memcmp(bytes, viaXed, length) != 0)) {
+			throw XEDError("The direct encoding of "s + xed_iclass_enum_t2str(iclass) + " is " + hex(bytes, length)
+			               + ", XED encodes " + hex(viaXed, xedLength));
+		}
+		std::memcpy(bytes, viaXed, xedLength);
+		length = xedLength;
+	}
+	section.data.insert(section.data.end(), bytes, bytes + length);
+	return section.data.size();
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "include.h"
+#include "compiling/compiler.h"
+extern "C" {
+	#include "xed/xed-interface.h"
+}
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace Silica {
+
+// An operand of encodeX64
+struct X64Operand {
+	enum class Kind: uint8_t {
+		none,
+		reg,    // 'reg', a 64 bit general purpose register or an XMM register
+		memory, // [base + index*(2^scale) + displacement], or [rip + displacement] when 'ripRelative'
+		imm,    // 'value', 'width' bits wide
+		rel32   // a branch target, the displacement is patched in later
+	};
+	Kind kind = Kind::none;
+	xed_reg_enum_t reg = XED_REG_INVALID;
+	// memory: bits read or written, imm: bits of the immediate
+	uint32_t width = 0;
+	int64_t value = 0;
+	// memory
+	bool ripRelative = false;
+	Gpr base {};
+	std::optional<Gpr> index;
+	uint8_t scale = 0;
+	int32_t displacement = 0;
+
+	static X64Operand fromReg(xed_reg_enum_t reg);
+	static X64Operand fromGpr(Gpr gpr);
+	static X64Operand fromLocation(const Location& location, uint32_t widthBits = 64);
+	static X64Operand fromImm(int64_t value, uint32_t widthBits);
+	static X64Operand fromRel32();
+
+	// The same operand for XED, with the displacement width encodeX64 picks
+	xed_encoder_operand_t toXed() const;
+};
+
+constexpr size_t maxInstructionBytes = 15;
+
+// Encodes one instruction of the subset the Backend emits into 'out', which has room for maxInstructionBytes.
+// Returns the length, or 0 when the encoder doesn't know the instruction and XED has to encode it.
+// Picks the same forms as XED: the first opcode listed in the manual, and the shortest displacement
+size_t encodeX64(uint8_t* out, xed_uint_t operandWidth, xed_iclass_enum_t iclass, const X64Operand* operands, size_t count);
+
+}
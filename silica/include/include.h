@@ -1,16 +1,33 @@
 #pragma once
+#include <cstdint>
 #include <optional>
 #include <iostream>
 #include <filesystem>
 
 namespace Silica {
+	class Source;
 	constexpr std::string_view target = TARGET_OS "-" TARGET_PROCESSOR;
+	std::optional<double> run(const Source& source, std::ostream& outStream);
 	std::optional<double> run(std::istream& stream, std::string name, std::ostream& outStream);
 };
 
 namespace Options {
 	extern bool useColour;
 	extern bool useUnicode;
+	// The optimisation passes run before code generation, see PassManager
+	extern std::string_view passPipeline;
+	// Functions are compiled again with the passes after this many calls, 0 compiles everything with them up front
+	extern uint64_t tierUpCalls;
+	// Threads that parse and compile functions at once, 0 is one per core and 1 uses the calling thread only
+	extern size_t compileThreads;
+	// Code is written through a read write mapping and run from a read execute one of the same memory, see CodeHeap
+	extern bool dualMapping;
+	// Where compiled programs are cached, nothing is cached when it's empty
+	extern std::string_view codeCacheDirectory;
+	// Where programs are also written as object files, see writeElfObject. Nothing is written when it's empty
+	extern std::string_view objectDirectory;
+	// Programs are run by the bytecode interpreter instead of being compiled, see BytecodeModule
+	extern bool interpret;
 }
 
 #define unreachable() std::cerr << "Reached what is supposedly unreachable code!"
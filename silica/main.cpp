@@ -1,17 +1,53 @@
 #include "ast/ast.h"
 #include "parsing/Parser.h"
 #include "compiling/compiler.h"
+#include "compiling/backend.h"
+#include "compiling/bytecode.h"
+#include "compiling/codecache.h"
+#include "compiling/elf.h"
+#include "compiling/ir.h"
+#include "compiling/passes.h"
+#include "compiling/threadpool.h"
+#include "compiling/tiers.h"
 #include "include.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <sstream>
 #include <optional>
 #include "tests/test.h"
+#include "tests/bench.h"
 extern "C" {
 	#include "xed/xed-interface.h"
 }
 
 namespace Silica {
 	std::optional<double> run(std::istream& stream, std::string name, std::ostream& outStream) {
-		Parser parser(stream, "epic JIT", name);
+		return run(Source::fromStream(stream, std::move(name)), outStream);
+	}
+
+	std::optional<double> run(const Source& source, std::ostream& outStream) {
+		std::optional<CodeCache> cache;
+		std::optional<CodeCache::Key> cacheKey;
+		if (!Options::codeCacheDirectory.empty() && Options::tierUpCalls == 0 && !Options::interpret) {
+			cache.emplace(Options::codeCacheDirectory);
+			cacheKey = CodeCache::keyFor(source, Options::passPipeline);
+			try {
+				Compiler compiler = Compiler::compilerX64();
+				Backend::addExterns(compiler);
+				if (auto main = cache->load(*cacheKey, compiler)) {
+					outStream << "Loaded from the code cache\n";
+					return compiler.run(main->first, main->second);
+				}
+			}
+			catch (Compiler::LinkError& e) {
+				outStream << "Failed to link the cached code: " << e.what() << '\n';
+			}
+		}
+
+		// Made on first use, the threads are kept for the following runs
+		static ThreadPool pool(Options::compileThreads);
+		Parser parser(source, "epic JIT", &pool);
 		if (parser.errorCount > 0) {
 			outStream << "Failed with " << parser.errorCount << " errors.\n";
 			parser.printErrors(outStream);
@@ -21,6 +57,92 @@ namespace Silica {
 		}
 		outStream << "Parsing success! Printing AST\n";
 		parser.ast.print(outStream);
+
+		auto main = parser.ast.functionsByName.find(intern("main"));
+		if (main == parser.ast.functionsByName.end() || !main->second->params.empty()) {
+			outStream << "There is no main function without arguments to run\n";
+			return std::nullopt;
+		}
+		if (Options::interpret) {
+			try {
+				BytecodeModule module = BytecodeModule::from(parser.ast);
+				outStream << "Bytecode:\n";
+				module.print(outStream);
+				uint32_t entry = uint32_t(std::find(parser.ast.functions.begin(), parser.ast.functions.end(), main->second)
+				                          - parser.ast.functions.begin());
+				Compiler compiler = Compiler::compilerX64();
+				Backend::addExterns(compiler);
+				return interpret(module, entry, compiler);
+			}
+			catch (BytecodeModule::Error& e) {
+				outStream << "Failed to interpret: " << e.what() << '\n';
+			}
+			catch (Compiler::LinkError& e) {
+				outStream << "Failed to interpret: " << e.what() << '\n';
+			}
+			return std::nullopt;
+		}
+		try {
+			IrModule module = IrModule::from(parser.ast);
+			outStream << "IR:\n";
+			module.print(outStream);
+			uint32_t entry = uint32_t(std::find_if(module.functions.begin(), module.functions.end(), [&](const IrFunction& function) {
+				return function.source == main->second;
+			}) - module.functions.begin());
+
+			Compiler compiler = Compiler::compilerX64();
+			// Objects are written from the optimised code, which is all there is without tiers
+			if (Options::tierUpCalls != 0 && Options::objectDirectory.empty()) {
+				outStream << "Tiers:\n";
+				Tiers tiers(compiler, std::move(module), Options::passPipeline, Options::tierUpCalls, &outStream);
+				tiers.compile(&pool);
+				return tiers.run(entry);
+			}
+
+			outStream << "Passes:\n";
+			PassManager(Options::passPipeline).run(module, &outStream);
+			outStream << "Optimised IR:\n";
+			module.print(outStream);
+
+			Backend backend(compiler, module);
+			backend.compile(pool);
+			if (cache.has_value() && !cache->store(*cacheKey, compiler, backend.codeSections[entry], backend.entryPoints[entry])) {
+				outStream << "Couldn't write to the code cache\n";
+			}
+			if (!Options::objectDirectory.empty()) {
+				std::vector<ObjectSymbol> functions;
+				for (uint32_t i = 0; i < module.functions.size(); i++) {
+					functions.push_back({ std::string(symbolName(module.functions[i].name)), backend.codeSections[i], backend.entryPoints[i] });
+				}
+				std::filesystem::path path = std::filesystem::path(Options::objectDirectory) / std::filesystem::path(source.name()).stem();
+				path += ".o";
+				std::ofstream object(path, std::ios::binary);
+				std::vector<std::string> declaredExterns;
+				for (const auto& [name, declared] : parser.ast.externs) {
+					declaredExterns.emplace_back(symbolName(name));
+				}
+				// In the same order every time
+				std::sort(declaredExterns.begin(), declaredExterns.end());
+				writeElfObject(object, compiler, functions, declaredExterns);
+				outStream << (object ? "Wrote " : "Couldn't write ") << path.string() << '\n';
+			}
+			return compiler.run(backend.codeSections[entry], backend.entryPoints[entry]);
+		}
+		catch (PassManager::Error& e) {
+			outStream << "Bad pass pipeline: " << e.what() << '\n';
+		}
+		catch (IrModule::Error& e) {
+			outStream << "Failed to build the IR: " << e.what() << '\n';
+		}
+		catch (Backend::Error& e) {
+			outStream << "Failed to compile: " << e.what() << '\n';
+		}
+		catch (Compiler::XEDError& e) {
+			outStream << "Failed to encode: " << e.what() << '\n';
+		}
+		catch (Compiler::LinkError& e) {
+			outStream << "Failed to link: " << e.what() << '\n';
+		}
 		return std::nullopt;
 	}
 }
@@ -29,6 +151,13 @@ namespace Silica {
 namespace Options {
 	bool useColour = false;
 	bool useUnicode = false;
+	std::string_view passPipeline = Silica::defaultPipeline;
+	uint64_t tierUpCalls = 1000;
+	size_t compileThreads = 0;
+	bool dualMapping = false;
+	std::string_view codeCacheDirectory;
+	std::string_view objectDirectory;
+	bool interpret = false;
 }
 
 extern "C" void signalHandler(int signalNumber) {
@@ -36,30 +165,32 @@ extern "C" void signalHandler(int signalNumber) {
 	switch (signalNumber) {
 	case SIGABRT:
 		std::clog << "SIGABRT\n";
-		return;
+		break;
 	case SIGFPE:
 		std::clog << "SIGFPE\n";
-		return;
+		break;
 	case SIGILL:
 		std::clog << "SIGILL\n";
-		return;
+		break;
 	case SIGINT:
 		std::clog << "SIGINT\n";
-		return;
+		break;
 	case SIGSEGV:
 		std::clog << "SIGSEGV\n";
-		return;
+		break;
 	case SIGTERM:
 		std::clog << "SIGTERM\n";
-		return;
+		break;
 	default:
 		std::clog << "unknown (" << signalNumber << ")\n";
-		return;
+		break;
 	}
+	// Returning would run the faulting instruction again, forever
+	std::_Exit(128 + signalNumber);
 }
 
 
-int main() {
+int main(int argc, char** argv) {
 	signal(SIGABRT, signalHandler);
 	signal(SIGFPE, signalHandler);
 	signal(SIGILL, signalHandler);
@@ -67,11 +198,47 @@ int main() {
 	signal(SIGSEGV, signalHandler);
 	signal(SIGTERM, signalHandler);
 	try {
+		if (argc > 1 && argv[1] == "--bench"sv) {
+			return Silica::bench() ? 0 : 1;
+		}
+		for (int i = 1; i < argc; i++) {
+			std::string_view arg = argv[i];
+			// --passes=inline,dce,... replaces the default optimisation passes, --passes= turns them off
+			if (arg.substr(0, 9) == "--passes="sv) {
+				Options::passPipeline = arg.substr(9);
+			}
+			// --tier-up=N optimises a function after N calls, --tier-up=0 optimises everything before running
+			else if (arg.substr(0, 10) == "--tier-up="sv) {
+				Options::tierUpCalls = std::stoull(std::string(arg.substr(10)));
+			}
+			// --threads=N parses and compiles on N threads, --threads=1 on this one only
+			else if (arg.substr(0, 10) == "--threads="sv) {
+				Options::compileThreads = std::stoull(std::string(arg.substr(10)));
+			}
+			// --dual-map places code in memory that's mapped twice, written through one view and run from the other,
+			// instead of changing its rights
+			else if (arg == "--dual-map"sv) {
+				Options::dualMapping = true;
+			}
+			// --cache=DIR keeps compiled programs in DIR and runs them from there the next time, see CodeCache
+			else if (arg.substr(0, 8) == "--cache="sv) {
+				Options::codeCacheDirectory = arg.substr(8);
+			}
+			// --aot=DIR also writes every program to DIR as an ELF object, named after its source
+			else if (arg.substr(0, 6) == "--aot="sv) {
+				Options::objectDirectory = arg.substr(6);
+			}
+			// --interpret runs programs as bytecode without compiling them
+			else if (arg == "--interpret"sv) {
+				Options::interpret = true;
+			}
+		}
 		//Todo:fix
 		//Silica::test();
 		std::cout << "begin\n";
-		Silica::test();
+		bool passed = Silica::test();
 		std::cout << "\nend\n";
+		return passed ? 0 : 1;
 	}
 	catch (std::bad_alloc&) {
 		std::cout << "Out of memory\n";
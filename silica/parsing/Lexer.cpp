@@ -0,0 +1,91 @@
+#include "parsing/Lexer.h"
+#include "parsing/scan.h"
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+using namespace Silica;
+using namespace std::literals;
+
+Lexer::Lexer(std::string_view text):
+	Lexer(text, 0, uint32_t(std::min<size_t>(text.size(), std::numeric_limits<uint32_t>::max())), 1) {}
+
+Lexer::Lexer(std::string_view text, uint32_t rangeBegin, uint32_t rangeEnd, int firstLine): text(text), firstLine(firstLine) {
+	myAssert(text.size() < std::numeric_limits<uint32_t>::max(), "Sources are limited to 4 GiB");
+	myAssert(rangeBegin <= rangeEnd && rangeEnd <= text.size());
+	lineStarts.push_back(rangeBegin);
+	// Roughly one token every 5 bytes in typical sources
+	tokens.reserve((rangeEnd - rangeBegin) / 5 + 1);
+
+	const char* begin = text.data();
+	const char* end = begin + rangeEnd;
+	const char* it = begin + rangeBegin;
+	while (it != end) {
+		char current = *it;
+		uint32_t offset = uint32_t(it - begin);
+
+		// Skip white space
+		if (current == ' ' || current == '\t') {
+			it = Scan::spaces(it + 1, end);
+			continue;
+		}
+
+		if (current == '\n') {
+			push(Token::newline, offset);
+			lineStarts.push_back(offset + 1);
+			it++;
+			continue;
+		}
+
+		// Skip comments, up to the newline
+		if (current == '#') {
+			it = Scan::newline(it + 1, end);
+			continue;
+		}
+
+		// Parse number literals
+		if (isdigit(uint8_t(current))) {
+			const char* digitsEnd = Scan::digits(it + 1, end);
+			double value = 0;
+			for (; it != digitsEnd; it++) {
+				value = (value * 10) + *it - '0';
+			}
+			push(Token::number, offset, uint32_t(numbers.size()));
+			numbers.push_back(value);
+			continue;
+		}
+
+		// Parse identifiers and keywords
+		if (isalpha(uint8_t(current))) {
+			const char* wordEnd = Scan::identifier(it + 1, end);
+			std::string_view word(it, size_t(wordEnd - it));
+			Token kind = keywordToken(word);
+			push(kind, offset, kind == Token::identifier ? uint32_t(intern(word)) : 0);
+			it = wordEnd;
+			continue;
+		}
+
+		// Parse operators
+		Token op;
+		size_t length = matchOperator(std::string_view(it, size_t(end - it)), op);
+		if (length != 0) {
+			push(op, offset);
+			it += length;
+			continue;
+		}
+
+		errors.push_back({ offset, "Invalid char '"s + current + "' (" + std::to_string(current) + ")" });
+		it++;
+	}
+	push(Token::eof, rangeEnd);
+}
+
+Lexer::Position Lexer::position(uint32_t offset) const {
+	auto next = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset);
+	uint32_t lineStart = *(next - 1);
+	int column = 1;
+	for (uint32_t i = lineStart; i < offset && i < text.size(); i++) {
+		column += text[i] == '\t' ? 4 : 1;
+	}
+	return { int(next - lineStarts.begin()) + firstLine - 1, column, lineStart };
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "include.h"
+#include "parsing/tokens.h"
+#include "parsing/symbols.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// A token in the Lexer's token array
+struct Lexeme {
+	Token kind;
+	// Byte offset of the token's first char in the source
+	uint32_t offset;
+	// Token::number: index into Lexer::numbers
+	// Token::identifier: the Symbol
+	// Otherwise 0
+	uint32_t payload;
+};
+static_assert(sizeof(Lexeme) == 12, "Lexemes should stay compact");
+
+// Turns a whole source into an array of Lexemes up front, so the parser can look ahead freely.
+// Newlines are always lexed, the parser skips them where they don't matter.
+// Sources are limited to 4 GiB by the 32 bit offsets.
+class Lexer {
+public:
+	struct Error {
+		uint32_t offset;
+		std::string msg;
+	};
+	struct Position {
+		// 1 based
+		int line;
+		// 1 based, a tab is 4 columns wide
+		int column;
+		uint32_t lineStart;
+	};
+
+	// The whole source, offsets are from its start
+	std::string_view text;
+	// Always ends with a Token::eof
+	std::vector<Lexeme> tokens;
+	// The values of number literals
+	std::vector<double> numbers;
+	// The offset of the first char of each line
+	std::vector<uint32_t> lineStarts;
+	std::vector<Error> errors;
+
+	explicit Lexer(std::string_view text);
+	// Lexes only the bytes [begin, end) of 'text', which start a line numbered 'firstLine'.
+	// Offsets and positions are still those in the whole of 'text'
+	Lexer(std::string_view text, uint32_t begin, uint32_t end, int firstLine);
+
+	Position position(uint32_t offset) const;
+
+	double number(const Lexeme& lexeme) const {
+		return numbers[lexeme.payload];
+	}
+	static Symbol symbol(const Lexeme& lexeme) {
+		return Symbol(lexeme.payload);
+	}
+
+private:
+	int firstLine = 1;
+
+	void push(Token kind, uint32_t offset, uint32_t payload = 0) {
+		tokens.push_back({ kind, offset, payload });
+	}
+};
+
+}
@@ -1,10 +1,268 @@
 #include "parsing/Parser.h"
+#include <cmath>
 #include <functional>
+#include <unordered_map>
 using namespace Silica;
+using namespace std::literals;
 
-void Parser::parse() {
+void Parser::getToken(bool inclNewline) {
+	const Lexeme* lexeme;
+	do {
+		lexeme = &peek();
+		if (nextIndex < lexer->tokens.size()) {
+			nextIndex++;
+		}
+	} while (!inclNewline && lexeme->kind == Token::newline);
+
+	token = lexeme->kind;
+	tokenOffset = lexeme->offset;
+	if (token == Token::number) {
+		token_number = lexer->number(*lexeme);
+	}
+	else if (token == Token::identifier) {
+		token_symbol = Lexer::symbol(*lexeme);
+	}
+#ifdef SILICA_TRACE_TOKENS
+	std::cout << '(' << descibeToken(token) << '-' << token_number << '-' << (token == Token::identifier ? tokenName() : ""sv) << ")\n";
+#endif
+}
+
+void Parser::err(std::string msg, uint32_t offset) {
+	errorCount++;
+	Lexer::Position position = lexer->position(offset);
+	views.emplace_back(source->lineAt(position.lineStart), std::move(msg), View::Type::error, position.line, position.column);
+}
+
+void Parser::note(std::string msg, uint32_t offset) {
+	Lexer::Position position = lexer->position(offset);
+	views.emplace_back(source->lineAt(position.lineStart), std::move(msg), View::Type::note, position.line, position.column);
+}
+
+void Parser::forEach(size_t count, const std::function<void(size_t)>& task) {
+	if (pool != nullptr && count > 1) {
+		pool->forEach(count, task);
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		task(i);
+	}
+}
+
+void Parser::reparse(const Source& newSource) {
+	source = &newSource;
+	size_t liveBytes = 0;
+	for (const ParsedItem& item : items) {
+		liveBytes += item.bytes;
+	}
+	size_t replacedBytes = ast.arena.bytesAllocated() > liveBytes ? ast.arena.bytesAllocated() - liveBytes : 0;
+	if (replacedBytes <= std::max(liveBytes, compactMinimum)) {
+		parse(std::move(items));
+		return;
+	}
+	// Parsing everything again costs about as much as the parses that left the replaced nodes behind,
+	// so it's only done once they take more than the nodes in use. Nothing may point into the arena afterwards
+	items.clear();
+	ast.functionsByName.clear();
+	ast.functions.clear();
+	declarationOrder.clear();
+	ast.arena.clear();
+	ast.generation++;
+	parse({});
+}
+
+void Parser::parse(std::vector<ParsedItem> previous) {
+	errorCount = 0;
+	views.clear();
+	items.clear();
+	reusedItems = 0;
+	parsedItems = 0;
+	earlierFunctions = std::move(ast.functionsByName);
+	ast.functionsByName.clear();
+	ast.functions.clear();
+	ast.externs.clear();
+	declarationOrder.clear();
+
+	// The first of the previous items with each text
+	std::unordered_map<uint64_t, const ParsedItem*> previousByHash;
+	for (const ParsedItem& item : previous) {
+		previousByHash.emplace(item.hash, &item);
+	}
+	std::string_view text = source->text();
+	std::string previousText = std::move(parsedText);
+	parsedText = std::string(text);
+	std::vector<ItemRange> ranges = splitItems(text);
+	items.resize(ranges.size());
+
+	// Items are hashed and those that changed lexed on their own
+	std::vector<const ParsedItem*> unchanged(ranges.size());
+	std::vector<std::optional<Lexer>> lexers(ranges.size());
+	auto lex = [&](size_t i) {
+		lexers[i].emplace(text, ranges[i].begin, ranges[i].end, ranges[i].line);
+	};
+	forEach(ranges.size(), [&](size_t i) {
+		items[i].range = ranges[i];
+		std::string_view itemText = text.substr(ranges[i].begin, ranges[i].end - ranges[i].begin);
+		items[i].hash = hashItem(itemText);
+		// The hash only says where to look, the text has to be the same too
+		auto old = previousByHash.find(items[i].hash);
+		if (old != previousByHash.end()
+		    && std::string_view(previousText).substr(old->second->range.begin, old->second->range.end - old->second->range.begin) == itemText) {
+			unchanged[i] = old->second;
+		}
+		else {
+			lex(i);
+		}
+	});
+
+	// Then the signatures, in order, so each function is declared before the ones after it
+	struct ItemResult {
+		size_t viewsBegin = 0;
+		size_t viewsEnd = 0;
+		int errorCount = 0;
+		size_t functionCount = 0;
+		bool declaredExterns = false;
+		size_t bytes = 0;
+	};
+	std::vector<ItemResult> results(items.size());
+	std::vector<DeferredBody> bodies;
+	deferredBodies = &bodies;
+	for (size_t i = 0; i < items.size(); i++) {
+		if (unchanged[i] != nullptr && reuse(*unchanged[i], items[i])) {
+			continue;
+		}
+		if (!lexers[i].has_value()) {
+			lex(i);
+		}
+		ItemResult& result = results[i];
+		result.viewsBegin = views.size();
+		int errorsBefore = errorCount;
+		size_t functionsBefore = ast.functions.size();
+		size_t externsBefore = ast.externs.size();
+		size_t bytesBefore = ast.arena.bytesAllocated();
+		lexer = &*lexers[i];
+		for (const Lexer::Error& error : lexer->errors) {
+			err(error.msg, error.offset);
+		}
+		nextIndex = 0;
+		currentItemIndex = i;
+		parseTopLevel();
+		result.viewsEnd = views.size();
+		result.errorCount = errorCount - errorsBefore;
+		result.functionCount = ast.functions.size() - functionsBefore;
+		result.declaredExterns = ast.externs.size() != externsBefore;
+		result.bytes = ast.arena.bytesAllocated() - bytesBefore;
+		parsedItems++;
+	}
+	deferredBodies = nullptr;
+	lexer = nullptr;
+	earlierFunctions.clear();
+
+	parseBodies(bodies, lexers);
+
+	// Each item's diagnostics in the order they're in the source, as parsing it in one go would give them
+	std::vector<View> signatureViews = std::move(views);
+	views.clear();
+	size_t body = 0;
+	for (size_t i = 0; i < items.size(); i++) {
+		ItemResult& result = results[i];
+		size_t first = views.size();
+		views.insert(views.end(), std::make_move_iterator(signatureViews.begin() + result.viewsBegin),
+		             std::make_move_iterator(signatureViews.begin() + result.viewsEnd));
+		Function* declared = nullptr;
+		bool callsExterns = false;
+		// Reused items already have the bytes of their nodes from before
+		items[i].bytes += result.bytes;
+		for (; body < bodies.size() && bodies[body].item == i; body++) {
+			DeferredBody& deferred = bodies[body];
+			views.insert(views.end(), std::make_move_iterator(deferred.views.begin()), std::make_move_iterator(deferred.views.end()));
+			result.errorCount += deferred.errorCount;
+			errorCount += deferred.errorCount;
+			items[i].callees.insert(items[i].callees.end(), deferred.callees.begin(), deferred.callees.end());
+			declared = deferred.function;
+			callsExterns = callsExterns || deferred.callsExterns;
+			items[i].bytes += deferred.bytes;
+		}
+		std::stable_sort(views.begin() + first, views.end(), [](const View& a, const View& b) {
+			return a.line != b.line ? a.line < b.line : a.byte < b.byte;
+		});
+		// Only an item that is exactly one valid function can be reused
+		if (result.errorCount == 0 && result.functionCount == 1 && !result.declaredExterns && !callsExterns && declared != nullptr) {
+			items[i].function = declared;
+		}
+	}
+}
+
+void Parser::parseBodies(std::vector<DeferredBody>& bodies, const std::vector<std::optional<Lexer>>& lexers) {
+	// A few batches per thread, so threads that finish early can take some from the others.
+	// Each batch has an arena of its own, which becomes part of the Ast's afterwards
+	size_t batchCount = std::min(bodies.size(), pool != nullptr ? pool->size() * 4 : 1);
+	std::vector<std::unique_ptr<Parser>> workers(batchCount);
+	forEach(batchCount, [&](size_t batch) {
+		workers[batch].reset(new Parser(*this));
+		for (size_t i = batch * bodies.size() / batchCount; i < (batch + 1) * bodies.size() / batchCount; i++) {
+			workers[batch]->parseBody(bodies[i], *lexers[bodies[i].item]);
+		}
+	});
+	for (std::unique_ptr<Parser>& worker : workers) {
+		ast.arena.adopt(std::move(worker->ast.arena));
+	}
+}
+
+void Parser::parseBody(DeferredBody& body, const Lexer& itemLexer) {
+	lexer = &itemLexer;
+	nextIndex = body.firstToken;
+	callees = &body.callees;
+	callsExterns = &body.callsExterns;
+	currentFunction = body.function;
+	size_t bytesBefore = ast.arena.bytesAllocated();
+	body.function->result = handleBlock(body.function->params);
+	body.bytes = ast.arena.bytesAllocated() - bytesBefore;
+	// Error recovery in the body can end it at an earlier '}' than the one that matches its '{'
+	if (nextIndex < body.endToken) {
+		err("Expected the end of the body of function " + std::string(symbolName(body.function->name)));
+	}
+	body.views = std::move(views);
+	views.clear();
+	body.errorCount = errorCount;
+	errorCount = 0;
+	callees = nullptr;
+	callsExterns = nullptr;
+	currentFunction = nullptr;
+}
+
+bool Parser::reuse(const ParsedItem& old, ParsedItem& item) {
+	Function* function = old.function;
+	if (function == nullptr || old.range.end - old.range.begin != item.range.end - item.range.begin) {
+		return false;
+	}
+	// Parsing it again would give the same errors as parsing it did
+	if (ast.functionsByName.count(function->name) != 0 || ast.externs.count(function->name) != 0) {
+		return false;
+	}
+	// The functions it calls are declared before it, so they've been reused or parsed again by now
+	for (const Function* callee : old.callees) {
+		auto current = ast.functionsByName.find(callee->name);
+		if (callee != function && (current == ast.functionsByName.end() || current->second != callee)) {
+			return false;
+		}
+	}
+	// A later item with the same name mustn't get its node
+	auto earlier = earlierFunctions.find(function->name);
+	if (earlier != earlierFunctions.end() && earlier->second == function) {
+		earlierFunctions.erase(earlier);
+	}
+	ast.functions.push_back(function);
+	ast.functionsByName.emplace(function->name, function);
+	declarationOrder.emplace(function, ast.functions.size() - 1);
+	item.function = function;
+	item.callees = old.callees;
+	item.bytes = old.bytes;
+	reusedItems++;
+	return true;
+}
+
+void Parser::parseTopLevel() {
 	getToken();
-	int oldByte = byte + 1;
 	while (true) {
 		switch (token) {
 		case Token::keyword_func:
@@ -21,11 +279,11 @@ void Parser::parse() {
 			getToken();
 			continue;
 		case Token::identifier:
-			err("Invalid identifier \"" + token_string + "\" at the start of a top level statement", oldByte);
+			err("Invalid identifier \"" + std::string(tokenName()) + "\" at the start of a top level statement");
 			getToken();
 			continue;
 		default:
-			err("Invalid token (" + descibeToken(token) + ") in a top level statement", byte);
+			err("Invalid token (" + descibeToken(token) + ") in a top level statement");
 			getToken();
 			continue;
 		}
@@ -41,10 +299,18 @@ static Defer<DT> defer_fn(DT func) { return Defer<DT>{func}; };
 #define defer(lambda) auto _deferred_##__LINE__ = defer_fn(lambda);
 
 //  Return is not nullptr
-std::unique_ptr<Block> Parser::handleBlock() {
-	Block block;
-	ast.currentBlock = &block;
-	defer([&] { ast.currentBlock = nullptr; });
+Block* Parser::handleBlock(const std::vector<DeclareVar*>& params) {
+	Block* block = ast.make<Block>();
+	block->parent = ast.currentBlock;
+	ast.currentBlock = block;
+	variables.enter();
+	for (DeclareVar* param : params) {
+		variables.declare(param->name, param);
+	}
+	defer([&] {
+		variables.leave();
+		ast.currentBlock = block->parent;
+	});
 	auto discardLine = [&]() {
 		while (token != Token::newline && token != Token::eof) {
 			getToken();
@@ -72,18 +338,18 @@ std::unique_ptr<Block> Parser::handleBlock() {
 			break;
 		case Token::keyword_return:
 			getToken();
-			block.expressions.push_back(std::make_unique<Return>(expectExpression()));
+			block->expressions.push_back(ast.make<Return>(expectExpression()));
 			break;
 		case Token::eof:
-			return std::make_unique<Block>(std::move(block));
+			return block;
 		case Token::newline:
-			getToken();
+			// Empty line, the loop moves on to the next token
 			continue;
 		case Token::closedCurly:
 			getToken();
-			return std::make_unique<Block>(std::move(block));
+			return block;
 		default: {
-			std::unique_ptr<Expression> expr = expectExpression();
+			Expression* expr = expectExpression();
 			if (expr == nullptr) {
 				err("Unexpected " + descibeToken(token));
 				discardLine();
@@ -93,12 +359,12 @@ std::unique_ptr<Block> Parser::handleBlock() {
 				discardLine();
 				continue;
 			}
-			block.expressions.push_back(std::move(expr));
+			block->expressions.push_back(expr);
 		}
 			
 		}
 		if (token == Token::eof) {
-			return std::make_unique<Block>(std::move(block));
+			return block;
 		}
 		else if (token != Token::newline) {
 			err("Expected newline after statement");
@@ -107,42 +373,54 @@ std::unique_ptr<Block> Parser::handleBlock() {
 	}
 }
 // When token is Token::openBracket, advances token to after the ')'
-std::unique_ptr<Expression> Parser::handleFuncCall(std::string name) {
-	auto result = parseArgList<std::unique_ptr<Expression>>("function", "expression", [&] { expectExpression(); });
+Expression* Parser::handleFuncCall(Symbol name) {
+	auto result = parseArgList<Expression*>("function", "expression", [&] { return expectExpression(); });
 	if (!result.has_value()) {
 		return nullptr;
 	};
-	// Find the function
-	auto it = std::find_if(ast.functions.begin(), ast.functions.end(), [&](Function& f) {
-		if (f.name != name) {
-			return false;
-		}
-		if (f.args.size() != result->size()) {
-			return false;
+	getToken();
+	std::vector<Expression*> exprList;
+	for (auto& pair : *result) {
+		exprList.push_back(pair.second);
+	};
+	const Parser& declarations = root();
+	// Externs can be called from anywhere, they're declared before the bodies are parsed
+	auto called = declarations.ast.externs.find(name);
+	if (called != declarations.ast.externs.end()) {
+		bool matches = called->second.args.size() == result->size();
+		for (size_t i = 0; matches && i < result->size(); i++) {
+			matches = called->second.args[i].first == (*result)[i].first;
 		}
-		for (size_t i = 0; i < f.args.size(); i++) {
-			if (f.args[i].first != (*result)[i].first) {
-				return false;
-			}
+		if (!matches) {
+			err("The extern with this signature could not be found");
+			return nullptr;
 		}
-		return true;
-	});
-	if (it == ast.functions.end()) {
+		*callsExterns = true;
+		return ast.make<CallExternExpr>(name, called->second.returnType, std::move(exprList));
+	}
+	// Find the function, then check the argument labels match
+	// Only functions declared before this one, and itself, can be called
+	auto it = declarations.ast.functionsByName.find(name);
+	bool matches = it != declarations.ast.functionsByName.end() && it->second->args.size() == result->size()
+		&& declarations.declarationOrder.at(it->second) <= declarations.declarationOrder.at(currentFunction);
+	for (size_t i = 0; matches && i < result->size(); i++) {
+		// Symbols compare as integers
+		matches = it->second->args[i].first == (*result)[i].first;
+	}
+	if (!matches) {
 		err("The function with this signature could not be found");
 		return nullptr;
-	} else {
-		std::vector<std::unique_ptr<Expression>> exprList;
-		for (auto& pair : *result) {
-			exprList.emplace_back(std::move(pair.first));
-
-		};
-		ast.currentBlock->expressions.emplace_back(std::make_unique<CallFuncExpr>( *it, std::move(exprList) ));
 	}
+	if (std::find(callees->begin(), callees->end(), it->second) == callees->end()) {
+		callees->push_back(it->second);
+	}
+	return ast.make<CallFuncExpr>(*it->second, std::move(exprList));
 }
 
 
 //                      V-Func name
-std::optional<std::pair<std::string, Extern>> Parser::parseFuncSignature() {
+// Leaves token after the signature
+std::optional<std::pair<Symbol, Extern>> Parser::parseFuncSignature() {
 	/*
 	auto failed = [&]() {
 		// Go to the first '{'
@@ -238,14 +516,18 @@ end:
 		err("Expected identifier in expected function declaration");
 		return std::nullopt;
 	}
-	std::string name = std::move(token_string);
+	Symbol name = token_symbol;
 	getToken();
 	if (token != Token::openBracket) {
 		err("Expected a '(' after expected function declaration");
 		return std::nullopt;
 	}
 
-	auto optResult = parseArgList<const Type*>("function signature", "type", [&] { return handleType(); } );
+	auto optResult = parseArgList<const Type*>("function signature", "type", [&] {
+		const Type* type = handleType();
+		getToken();
+		return type;
+	});
 	if (!optResult.has_value()) {
 		// Go to the first '{'
 		do {
@@ -278,12 +560,14 @@ end:
 	Extern signature;
 	signature.args = std::move(result);
 
+	getToken();
 	if (token == Token::arrow) {
 		getToken();
 		signature.returnType = handleType();
 		if (signature.returnType == nullptr) {
 			err("Expected type after '->'");
 		}
+		getToken();
 	}
 	else {
 		signature.returnType = &Types::Void;
@@ -298,7 +582,6 @@ void Parser::handleExtern() {
 		err("Unable to extern an invalid function declaration");
 		return;
 	}
-	getToken();
 	if (token != Token::newline && token != Token::eof) {
 		err("Expected a newline or the end of file after extern");
 		return;
@@ -308,21 +591,21 @@ void Parser::handleExtern() {
 }
 
 // When token == Token::identifier. Gets next token
-std::unique_ptr<Expression> Parser::handleIdentifier() {
-	std::string name = token_string;
+Expression* Parser::handleIdentifier() {
+	Symbol name = token_symbol;
 	getToken();
 	if (token == Token::asign) {
-		std::unique_ptr<Expression> result = expectExpression();
+		Expression* result = expectExpression();
 		if (result == nullptr) {
 			getToken();
-			err("Cannot asign variable " + name + " to invalid expression");
+			err("Cannot asign variable " + std::string(symbolName(name)) + " to invalid expression");
 			return nullptr;
 		}
 		else {
 			getToken();
 
 			//TODO: fix
-			//return std::make_unique<SetVarExpr>(name, std::move(result));
+			//return ast.make<SetVarExpr>(name, result);
 		}
 	}
 	else if (token == Token::openBracket) {
@@ -330,7 +613,7 @@ std::unique_ptr<Expression> Parser::handleIdentifier() {
 	}
 	else {
 		// TODO:fix
-		//return std::make_unique<GetVarExpr>(name);
+		//return ast.make<GetVarExpr>(name);
 	}
 }
 
@@ -341,25 +624,61 @@ void Parser::handleFuncDecl() {
 		return;
 	}
 	if (ast.externs.find(funcDecl->first) != ast.externs.end()){
-		err("Cannot create function " + funcDecl->first +", as it was already externed");
+		err("Cannot create function " + std::string(symbolName(funcDecl->first)) + ", as it was already externed");
 		return;
 	}
 
-	if (std::find(ast.functions.begin(), ast.functions.end(), funcDecl->first) != ast.functions.end()) {
-		err("Cannot create function " + funcDecl->first + ", as it was already declared");
+	if (ast.functionsByName.find(funcDecl->first) != ast.functionsByName.end()) {
+		err("Cannot create function " + std::string(symbolName(funcDecl->first)) + ", as it was already declared");
 		return;
 	}
-	getToken();
 	if (token != Token::openCurly) {
 		err("Expected an open curly bracket after function declaration");
 		return;
 	}
-	Function f { funcDecl->second.args, funcDecl->second.returnType, handleBlock() };
-	// the function that was moved into the map
-	Function& func = ast.functions.emplace(funcDecl->first, std::move(f)).first->second;
-	//ast.functions.emplace(funcDecl)??;
-	
-	
+	std::vector<DeclareVar*> params;
+	for (auto& [argName, argType] : funcDecl->second.args) {
+		params.push_back(ast.make<DeclareVar>(argName, argType, false));
+	}
+	// The node of the previous parse is kept when the signature is the same, so calls to it stay valid
+	Function* function = nullptr;
+	auto earlier = earlierFunctions.find(funcDecl->first);
+	if (earlier != earlierFunctions.end() && earlier->second->args == funcDecl->second.args
+	    && earlier->second->returnType == funcDecl->second.returnType) {
+		function = earlier->second;
+		function->params = std::move(params);
+		function->result = nullptr;
+		earlierFunctions.erase(earlier);
+	}
+	else {
+		function = ast.make<Function>(funcDecl->first, std::move(funcDecl->second.args), std::move(params),
+		                              funcDecl->second.returnType, nullptr);
+	}
+	ast.functions.push_back(function);
+	ast.functionsByName.emplace(function->name, function);
+	declarationOrder.emplace(function, ast.functions.size() - 1);
+
+	// The body is parsed by parseBodies once every signature is known, here it's only skipped
+	DeferredBody& body = deferredBodies->emplace_back();
+	body.item = currentItemIndex;
+	body.function = function;
+	body.firstToken = nextIndex;
+	int curlyDepth = 1;
+	while (curlyDepth != 0) {
+		getToken();
+		if (token == Token::eof) {
+			break;
+		}
+		if (token == Token::openCurly) {
+			curlyDepth++;
+		}
+		else if (token == Token::closedCurly) {
+			curlyDepth--;
+		}
+	}
+	// Leaves token after the '}', as handleBlock does
+	getToken();
+	body.endToken = nextIndex;
 }
 
 const Type* Parser::handleType() {
@@ -371,21 +690,22 @@ const Type* Parser::handleType() {
 	const Type* type = nullptr;
 
 	auto it1 = std::find_if(Types::all.begin(), Types::all.end(), [&](auto& elem) {
-		return elem->name == token_string;
+		return elem->name == tokenName();
 		});
 	if (it1 != Types::all.end()) {
 		type = *it1;
 	}
 
-	auto it2 = std::find_if(types.begin(), types.end(), [&](auto& elem) {
-		return elem->name == token_string;
+	const std::vector<std::unique_ptr<Type>>& declaredTypes = root().types;
+	auto it2 = std::find_if(declaredTypes.begin(), declaredTypes.end(), [&](auto& elem) {
+		return elem->name == tokenName();
 	});
-	if (it2 != types.end()) {
+	if (it2 != declaredTypes.end()) {
 		type = it2->get();
 	}
 
 	if (type == nullptr) {
-		err("Identifier " + token_string + " does not name a type");
+		err("Identifier " + std::string(tokenName()) + " does not name a type");
 	}
 	return type;
 	
@@ -393,7 +713,7 @@ const Type* Parser::handleType() {
 
 // Gets the next primary expression (num/var/call/brackets) stored in token
 // Advances token to the next one
-std::unique_ptr<Expression> Parser::parseSingleExpr() {
+Expression* Parser::parseSingleExpr() {
 	if (isUnaryOp(token)) {
 		Token op = token;
 		getToken();
@@ -402,18 +722,23 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 			err("Expected expression after unary operator (" + descibeToken(token) + ")");
 			return nullptr;
 		}
-		return std::make_unique<UnaryOpExpr>(std::move(expr), UnaryOpType(op));
+		// Unary plus leaves its operand as it is
+		if (op == Token::plus) {
+			return expr;
+		}
+		return makeUnaryOp(expr, UnaryOpType(op));
 	}
 
 	switch (token) {
 	case Token::openBracket: {
 		getToken();
-		std::unique_ptr<Expression> expr = expectExpression();
+		Expression* expr = expectExpression();
 		if (token == Token::closedBracket) {
 			if (expr == nullptr) {
 				err("Empty brackets in expression");
 				return nullptr;
 			}
+			getToken();
 			return expr;
 		}
 		err("Expected a closing brace after bracketed expression");
@@ -425,7 +750,7 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 	case Token::keyword_if: {
 		getToken();
 		// condition
-		std::unique_ptr<Expression> condition = expectExpression();
+		Expression* condition = expectExpression();
 		if (condition == nullptr) {
 			err("Expected an expression after if statement");
 			return nullptr;
@@ -434,9 +759,10 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 			err("Expected a block '{' after the condition of an if statement");
 			return nullptr;
 		}
-		IfExpr ifExpr { std::move(condition), handleBlock(), nullptr };
-		std::unique_ptr<Expression>* insertPoint = &ifExpr.ifFalse;
+		IfExpr* ifExpr = ast.make<IfExpr>(condition, handleBlock(), nullptr);
+		Expression** insertPoint = &ifExpr->ifFalse;
 		while (token == Token::keyword_elif) {
+			getToken();
 			condition = expectExpression();
 			if (condition == nullptr) {
 				err("Expected an expression after elif");
@@ -446,10 +772,9 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 				err("Expected a block '{' after the condition of an elif statement");
 				return nullptr;
 			}
-			std::unique_ptr<IfExpr> newIfExpr = std::make_unique<IfExpr>(std::move(condition), handleBlock(), nullptr);
-			std::unique_ptr<Expression>* newInsertPoint = &newIfExpr->ifFalse;
-			*insertPoint = std::move(newIfExpr);
-			insertPoint = newInsertPoint;
+			IfExpr* newIfExpr = ast.make<IfExpr>(condition, handleBlock(), nullptr);
+			*insertPoint = newIfExpr;
+			insertPoint = &newIfExpr->ifFalse;
 		}
 		if (token == Token::keyword_else) {
 			getToken();
@@ -459,39 +784,32 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 			}
 			*insertPoint = handleBlock();
 		}
-		return std::make_unique<IfExpr>(std::move(ifExpr));
+		return ifExpr;
 	}
 	case Token::number:
 		getToken();
-		return std::make_unique<NumLitExpr>(token_number);
+		return ast.make<NumLitExpr>(token_number);
 	case Token::identifier: {
-		std::string identifier = std::move(token_string);
+		Symbol identifier = token_symbol;
 		getToken();
 		if (token == Token::openBracket) {
-			return handleFuncCall(std::move(identifier));
+			return handleFuncCall(identifier);
 		}
 		else {
 			// variable name
-			Block* it = ast.currentBlock;
-			while (it != nullptr) {
-				auto result = std::find_if(
-					ast.currentBlock->variables.begin(), ast.currentBlock->variables.end(),
-					[&](DeclareVar decl) {
-						return decl.name == identifier;
-					}
-				);
-
-				if (result != ast.currentBlock->variables.end()) {
-					// There exists a variable called 'identifier' in the Block '*it'
-					return std::make_unique<GetVarExpr>(*result);
-				}
-				else {
-					// Variable not found, go to the parent block
-					it = it->parent;
+			DeclareVar* decl = variables.find(identifier);
+			if (decl == nullptr) {
+				err("Could not find variable name " + std::string(symbolName(identifier)));
+				return nullptr;
+			}
+			// 'decl' is the latest declaration of the name in its block, so the block's entry is its value
+			if (decl->block != nullptr) {
+				auto constant = decl->block->consts.find(identifier);
+				if (constant != decl->block->consts.end()) {
+					return ast.make<NumLitExpr>(constant->second);
 				}
-			};
-			err("Could not find variable name " + std::move(identifier));
-			return nullptr;
+			}
+			return ast.make<GetVarExpr>(*decl);
 		}
 		break;
 	}
@@ -501,16 +819,16 @@ std::unique_ptr<Expression> Parser::parseSingleExpr() {
 	}
 }
 
-std::unique_ptr<Expression> Parser::expectExpression(bool inBrackets /* = false */) {
-	std::unique_ptr<Expression> primary = parseSingleExpr();
+Expression* Parser::expectExpression(bool inBrackets /* = false */) {
+	Expression* primary = parseSingleExpr();
 	if (primary == nullptr) {
 		return nullptr;
 	}
-	return parseRhs(1, std::move(primary));
+	return parseRhs(1, primary);
 }
 
 // TODO:complete
-std::unique_ptr<Expression> Parser::parseRhs(int precedence, std::unique_ptr<Expression> lhs) {
+Expression* Parser::parseRhs(int precedence, Expression* lhs) {
 	while (true) {
 		Token op = token;
 		int tokenPrecedence = getTokenPrecedence(token);
@@ -520,7 +838,7 @@ std::unique_ptr<Expression> Parser::parseRhs(int precedence, std::unique_ptr<Exp
 		}
 
 		getToken();
-		std::unique_ptr<Expression> rhs = parseSingleExpr();
+		Expression* rhs = parseSingleExpr();
 		if (rhs == nullptr) {
 			err("Expected an expression after binary operator");
 			return lhs;
@@ -529,10 +847,41 @@ std::unique_ptr<Expression> Parser::parseRhs(int precedence, std::unique_ptr<Exp
 		Token nextOp = token;
 		int nextPrecedence = getTokenPrecedence(token);
 		if (nextPrecedence > tokenPrecedence) {
-			rhs = parseRhs(tokenPrecedence + 1, std::move(rhs));
+			rhs = parseRhs(tokenPrecedence + 1, rhs);
+		}
+		lhs = makeBinOp(lhs, rhs, BinOpType(op));
+	}
+}
+
+// Folds operations on two literals into one literal
+Expression* Parser::makeBinOp(Expression* lhs, Expression* rhs, BinOpType operation) {
+	auto* left = dynamic_cast<NumLitExpr*>(lhs);
+	auto* right = dynamic_cast<NumLitExpr*>(rhs);
+	if (left != nullptr && right != nullptr) {
+		switch (operation) {
+		case BinOpType::plus:
+			return ast.make<NumLitExpr>(left->value + right->value);
+		case BinOpType::minus:
+			return ast.make<NumLitExpr>(left->value - right->value);
+		case BinOpType::multiply:
+			return ast.make<NumLitExpr>(left->value * right->value);
+		case BinOpType::divide:
+			return ast.make<NumLitExpr>(left->value / right->value);
+		case BinOpType::power:
+			return ast.make<NumLitExpr>(std::pow(left->value, right->value));
+		default:
+			// Comparisons are left to the backend
+			break;
 		}
-		lhs = std::make_unique<BinOpExpr>(std::move(lhs), std::move(rhs), BinOpType(op));
 	}
+	return ast.make<BinOpExpr>(lhs, rhs, operation);
+}
+
+Expression* Parser::makeUnaryOp(Expression* expr, UnaryOpType operation) {
+	if (auto* literal = dynamic_cast<NumLitExpr*>(expr); literal != nullptr && operation == UnaryOpType::minus) {
+		return ast.make<NumLitExpr>(-literal->value);
+	}
+	return ast.make<UnaryOpExpr>(expr, operation);
 }
 
 DeclareVar* Parser::handleLet() {
@@ -541,24 +890,45 @@ DeclareVar* Parser::handleLet() {
 		err("Expected identifier after let statement");
 		return nullptr;
 	}
-	std::string name = token_string;
+	Symbol name = token_symbol;
 	const Type* type = nullptr;
 	getToken();
 	if (token == Token::colon) {
 		getToken();
 		type = handleType();
+		if (type == nullptr) {
+			return nullptr;
+		}
+		getToken();
 	}
 	if (token != Token::asign) {
 		err("Unexpected token after let");
 		return nullptr;
 	}
 	getToken();
-	std::unique_ptr<Expression> expr = expectExpression();
+	Expression* expr = expectExpression();
 	if (expr == nullptr) {
 		err("Expected expression after let");
 		return nullptr;
 	}
-	ast.currentBlock->variables.emplace_back(name, expr->type, false);
-	ast.currentBlock->expressions.emplace_back(std::make_unique<SetVarExpr>(ast.currentBlock->variables.back(), std::move(expr)));
-	return  &ast.currentBlock->variables.back();
+	if (type != nullptr && type != expr->type) {
+		err("Let " + std::string(symbolName(name)) + " is declared as " + std::string(type->name) + " but its value is "
+		    + std::string(expr->type->name));
+		return nullptr;
+	}
+	DeclareVar* decl = ast.make<DeclareVar>(name, expr->type, false);
+	decl->block = ast.currentBlock;
+	// Declared after the initializer, so 'let a = a' refers to an outer 'a'
+	variables.declare(name, decl);
+	// A let can't be changed, so one with a constant value is replaced by it wherever it's used
+	// and needs no code of its own
+	if (auto* literal = dynamic_cast<NumLitExpr*>(expr)) {
+		ast.currentBlock->consts[name] = literal->value;
+		return decl;
+	}
+	// This shadows any constant of the same name earlier in the block
+	ast.currentBlock->consts.erase(name);
+	ast.currentBlock->variables.push_back(decl);
+	ast.currentBlock->expressions.push_back(ast.make<SetVarExpr>(*decl, expr));
+	return decl;
 }
\ No newline at end of file
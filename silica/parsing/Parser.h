@@ -1,20 +1,29 @@
 #pragma once
 #include "include.h"
 #include "tokens.h"
+#include "parsing/Source.h"
+#include "parsing/Lexer.h"
+#include "parsing/items.h"
+#include "parsing/scopes.h"
 #include "ast/ast.h"
-#include <deque>
+#include "compiling/threadpool.h"
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <unordered_map>
 
 namespace Silica {
 	struct View {
 		enum class Type {
 			note, help, error
 		} type;
-		const std::string& sourceLine;
+		// Points into the Source the error was found in
+		std::string_view sourceLine;
 		std::string msg;
 		int line;
 		size_t byte;
 
-		View(const std::string& sourceLine, std::string msg, Type type, int line, size_t byte):
+		View(std::string_view sourceLine, std::string msg, Type type, int line, size_t byte):
 			sourceLine(sourceLine), msg(std::move(msg)), type(type), line(line), byte(byte) {
 		};
 
@@ -33,7 +42,17 @@ namespace Silica {
 			default:
 				throw "invalid enum??";
 			}
-			os << typeString << ": " << msg << "\n\n " << std::to_string(line) << " | " << sourceLine << "\n    ";
+			os << typeString << ": " << msg << "\n\n " << std::to_string(line) << " | ";
+			// 'byte' counts a tab as 4 columns
+			for (char c : sourceLine) {
+				if (c == '\t') {
+					os << "    ";
+				}
+				else {
+					os << c;
+				}
+			}
+			os << "\n    ";
 			for (int i = 0; i < byte - 1; i++) {
 				os << ' ';
 			}
@@ -41,17 +60,49 @@ namespace Silica {
 		}
 	};
 
+	// A top level item as it was last parsed
+	struct ParsedItem {
+		ItemRange range;
+		uint64_t hash;
+		// Of the Ast's arena taken by its nodes
+		size_t bytes = 0;
+		// The function it declared, nullptr for an extern, an item with errors or one that calls an extern,
+		// which are always parsed again: the externs are declared anew by each parse
+		Function* function = nullptr;
+		// The functions its calls went to. It's only reused while they're still what the names refer to
+		std::vector<const Function*> callees;
+	};
+
+	// Parses a source one top level item at a time, each lexed on its own. After an edit, reparse only
+	// lexes and parses the items whose text changed, so a small edit to a large module costs little.
+	// With a ThreadPool, the items are lexed and the function bodies parsed on its threads: the signatures are
+	// parsed first, in order, so every call can be checked against them. The diagnostics and the Ast are the same
+	// with and without one
 	class Parser {
 	public:
 		int errorCount = 0;
 		std::string errors;
 		Ast ast;
 		std::vector<std::unique_ptr<Type>> types;
-		Parser(std::istream& stream, std::string_view moduleName, std::string_view sourceName):
-			stream(stream) {
-			next();
-			parse();
+		// In source order
+		std::vector<ParsedItem> items;
+		// Of the items of the last parse
+		size_t reusedItems = 0;
+		size_t parsedItems = 0;
+
+		// 'pool' is kept for reparse
+		Parser(const Source& source, std::string_view moduleName, ThreadPool* pool = nullptr):
+			source(&source), pool(pool) {
+			parse({});
 		}
+		// Parses a new version of the source, which has to outlive the Parser like the first.
+		// Items with the same text as before, no errors and the same callees keep their Function as it was.
+		// A function that's parsed again keeps its node when its signature is the same, with a new body,
+		// so the calls to it stay valid. Nodes that are replaced stay in the arena until there are more of them
+		// than of the nodes in use and compactMinimum: then the arena is cleared and everything parsed again,
+		// which increments ast.generation
+		void reparse(const Source& newSource);
+		static constexpr size_t compactMinimum = 1 << 20;
 		void printErrors(std::ostream& os) {
 			for (auto& view : views) {
 				if (view.type == View::Type::error) {
@@ -61,75 +112,137 @@ namespace Silica {
 			}
 		}
 	private:
-		// TODO: optimize with buffers
-		std::istream& stream;
-		std::deque<std::string> referredLines {""};
-		bool sourceLineReferred = false;
+		// A function body, parsed once every signature is known
+		struct DeferredBody {
+			size_t item;
+			Function* function;
+			// Index in the item's tokens of the one after the body's '{'
+			size_t firstToken;
+			// Where parsing the signatures carried on, after the '}' that matches the '{'
+			size_t endToken = 0;
+			// Found while parsing the body, they're merged into the owner in item order
+			std::vector<View> views;
+			int errorCount = 0;
+			std::vector<const Function*> callees;
+			bool callsExterns = false;
+			// Of the worker's arena taken by the body's nodes
+			size_t bytes = 0;
+		};
+
+		const Source* source;
+		ThreadPool* pool = nullptr;
+		// The Parser a worker parses bodies for, into an arena of its own. nullptr for the one that owns the Ast
+		Parser* owner = nullptr;
+		// Lexes the item being parsed
+		const Lexer* lexer = nullptr;
+		// Where the calls being parsed are recorded
+		std::vector<const Function*>* callees = nullptr;
+		bool* callsExterns = nullptr;
+		// The function whose body is being parsed, it can call the ones declared before it and itself
+		const Function* currentFunction = nullptr;
+		// Where handleFuncDecl leaves the bodies
+		std::vector<DeferredBody>* deferredBodies = nullptr;
+		size_t currentItemIndex = 0;
+		// The position of each function in ast.functions
+		std::unordered_map<const Function*, size_t> declarationOrder;
+		// The functions of the previous parse that no item has taken yet, by name
+		std::unordered_map<Symbol, Function*> earlierFunctions;
+		// A copy of the text 'items' were parsed from, the Source it was in may be gone by the next reparse
+		std::string parsedText;
+		// Index in lexer.tokens of the token after 'token'
+		size_t nextIndex = 0;
 		// notes/help/errors etc.
 		std::vector<View> views;
 		Token token;
+		uint32_t tokenOffset = 0;
 
 		double token_number = -3.49;
-		std::string token_string;
+		// The last identifier, keywords leave it unchanged
+		Symbol token_symbol {};
 		bool allowTabs = true;
-		bool skipNextGetToken = false;
-
-		char current = 0;
-		int line = 1;
-		int byte = 0;
+		// The variables and arguments visible from the block being parsed
+		ScopeStack<DeclareVar> variables;
 
-		bool next();
-		void nextToken(bool inclNewline);
+		std::string_view tokenName() const {
+			return symbolName(token_symbol);
+		}
+		// The n-th token after 'token', peek(1) is the one getToken() moves to next.
+		// Past the end it is the final Token::eof
+		const Lexeme& peek(size_t n = 1) const {
+			return lexer->tokens[std::min(nextIndex + n - 1, lexer->tokens.size() - 1)];
+		}
 		void getToken(bool inclNewline = true);
 		// WS is Token::newline
 
 
-		void err(std::string msg, int fmtByte);
-		void note(std::string msg, int fmtByte);
+		void err(std::string msg, uint32_t offset);
+		void note(std::string msg, uint32_t offset);
 		void err(std::string msg) {
-			err(std::move(msg), byte);
+			err(std::move(msg), tokenOffset);
 		}
 		void note(std::string msg) {
-			note(std::move(msg), byte);
+			note(std::move(msg), tokenOffset);
 		}
 
 		const Type* handleType();
+		// 'argGetter' starts at the argument's first token and must leave token after its last one
 		template<typename ArgType, typename ArgGetter>
-		std::optional<std::vector<std::pair<std::string, ArgType>>> Parser::parseArgList(
+		std::optional<std::vector<std::pair<Symbol, ArgType>>> parseArgList(
 			std::string_view listDesc, std::string_view argDesc, ArgGetter argGetter);
-		std::unique_ptr<Expression> parseSingleExpr();
-		std::unique_ptr<Expression> handleFuncCall(std::string name);
-		std::optional<std::pair<std::string, Extern>> parseFuncSignature();
+		Expression* parseSingleExpr();
+		Expression* handleFuncCall(Symbol name);
+		std::optional<std::pair<Symbol, Extern>> parseFuncSignature();
 		void handleExtern();
 		DeclareVar* handleLet();
-		std::unique_ptr<Expression> handleIdentifier();
+		Expression* handleIdentifier();
 		void handleFuncDecl();
-		std::unique_ptr<Expression> parseRhs(int precedence, std::unique_ptr<Expression> lhs);
-		std::unique_ptr<Expression> expectExpression(bool inBrackets = false);
+		Expression* parseRhs(int precedence, Expression* lhs);
+		// Build operations, or a literal when the operands are literals
+		Expression* makeBinOp(Expression* lhs, Expression* rhs, BinOpType operation);
+		Expression* makeUnaryOp(Expression* expr, UnaryOpType operation);
+		Expression* expectExpression(bool inBrackets = false);
 
-		std::unique_ptr<Block> handleBlock();
-		void parse();
+		// 'params' are declared in the block's scope, for function bodies
+		Block* handleBlock(const std::vector<DeclareVar*>& params = {});
+		// Parses the items of 'source', reusing those of 'previous' that haven't changed
+		void parse(std::vector<ParsedItem> previous);
+		// Adds the function of 'old' to the Ast for 'item', returns false when it can't be reused
+		bool reuse(const ParsedItem& old, ParsedItem& item);
+		// Parses the top level statements of 'lexer' up to its Token::eof, leaving function bodies in 'deferredBodies'
+		void parseTopLevel();
+		// Parses each body on 'pool', with a worker Parser for each batch of them
+		void parseBodies(std::vector<DeferredBody>& bodies, const std::vector<std::optional<Lexer>>& lexers);
+		// For workers, made by parseBodies
+		explicit Parser(Parser& owner):
+			source(owner.source), owner(&owner) {}
+		void parseBody(DeferredBody& body, const Lexer& itemLexer);
+		// The Parser with the Ast, whose signatures calls are checked against
+		const Parser& root() const {
+			return owner != nullptr ? *owner : *this;
+		}
+		// Calls task(i) for every i below 'count', on 'pool' if there is one
+		void forEach(size_t count, const std::function<void(size_t)>& task);
 	};
 	#define expect(expectedToken, msg) getToken();if (token != expectedToken) {err(msg); return nullptr;}
 
 
 
 	template<typename ArgType, typename ArgGetter>
-	std::optional<std::vector<std::pair<std::string, ArgType>>> Parser::parseArgList(
+	std::optional<std::vector<std::pair<Symbol, ArgType>>> Parser::parseArgList(
 		std::string_view listDesc, std::string_view argDesc, ArgGetter argGetter)
 	{
-		std::vector<std::pair<std::string, ArgType>> result;
-		std::pair<std::string, ArgType> arg;
+		std::vector<std::pair<Symbol, ArgType>> result;
+		std::pair<Symbol, ArgType> arg;
 		getToken();
 		if (token == Token::closedBracket) {
 			goto end;
 		}
 	begin:
 		if (token != Token::identifier) {
-			err(std::string("Expected an argument name in ") + listDesc);
+			err("Expected an argument name in " + std::string(listDesc));
 			return std::nullopt;
 		}
-		arg.first = std::move(token_string);
+		arg.first = token_symbol;
 		getToken();
 		if (token != Token::colon) {
 			err("Expected a ':' after the argument name");
@@ -138,11 +251,10 @@ namespace Silica {
 		getToken();
 		arg.second = argGetter();
 		if (arg.second == nullptr) {
-			err(std::string("Expected ") + argDesc);
+			err("Expected " + std::string(argDesc));
 			return std::nullopt;
 		}
-		signature.args.emplace_back(std::move(arg));
-		getToken();
+		result.emplace_back(std::move(arg));
 
 		if (token == Token::comma) {
 			getToken();
@@ -153,11 +265,10 @@ namespace Silica {
 		}
 		else {
 			err(std::string("Expected a comma or a closed bracket after argument"));
-			failed();
 			return std::nullopt;
 		}
 	end:
-		return { result };
+		return { std::move(result) };
 	}
 }
 
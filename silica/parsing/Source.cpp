@@ -0,0 +1,131 @@
+#include "parsing/Source.h"
+#include "compiling/host.h"
+#include <fstream>
+#include <algorithm>
+
+#if HOST == HOST_POSIX
+	#include <fcntl.h>
+	#include <sys/stat.h>
+#endif
+
+using namespace Silica;
+
+// Streams are read this many bytes at a time
+constexpr size_t readBlockSize = 1 << 16;
+
+Source Source::fromString(std::string text, std::string name) {
+	Source source(std::move(name));
+	source.owned = std::move(text);
+	source.data = source.owned.data();
+	source.size = source.owned.size();
+	return source;
+}
+
+Source Source::fromStream(std::istream& stream, std::string name) {
+	std::string text;
+	size_t used = 0;
+	while (stream) {
+		text.resize(used + readBlockSize);
+		stream.read(text.data() + used, readBlockSize);
+		used += size_t(stream.gcount());
+	}
+	text.resize(used);
+	return fromString(std::move(text), std::move(name));
+}
+
+std::optional<Source> Source::fromFile(const std::filesystem::path& path) {
+	Source source(path.string());
+#if HOST == HOST_WIN
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return std::nullopt;
+	}
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+		HANDLE fileMapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (fileMapping != nullptr) {
+			source.mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(fileMapping);
+		}
+		source.size = size_t(fileSize.QuadPart);
+	}
+	CloseHandle(file);
+	if (source.mapping != nullptr) {
+		source.data = static_cast<const char*>(source.mapping);
+		return { std::move(source) };
+	}
+#elif HOST == HOST_POSIX
+	int file = open(path.c_str(), O_RDONLY);
+	if (file == -1) {
+		return std::nullopt;
+	}
+	struct stat fileStat;
+	if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0) {
+		void* result = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		if (result != MAP_FAILED) {
+			source.mapping = result;
+			source.size = size_t(fileStat.st_size);
+		}
+	}
+	close(file);
+	if (source.mapping != nullptr) {
+		source.data = static_cast<const char*>(source.mapping);
+		return { std::move(source) };
+	}
+#endif
+	// Empty files can't be mapped, and other hosts have no mapping at all
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream.is_open()) {
+		return std::nullopt;
+	}
+	return fromStream(stream, path.string());
+}
+
+std::string_view Source::lineAt(size_t lineStart) const {
+	std::string_view rest = text().substr(std::min(lineStart, size));
+	std::string_view line = rest.substr(0, rest.find('\n'));
+	if (!line.empty() && line.back() == '\r') {
+		line.remove_suffix(1);
+	}
+	return line;
+}
+
+Source::Source(Source&& other) noexcept:
+	sourceName(std::move(other.sourceName)), owned(std::move(other.owned)), mapping(other.mapping) {
+	size = other.size;
+	data = mapping != nullptr ? other.data : owned.data();
+	other.mapping = nullptr;
+	other.data = nullptr;
+	other.size = 0;
+}
+
+Source& Source::operator=(Source&& other) noexcept {
+	if (this != &other) {
+		release();
+		sourceName = std::move(other.sourceName);
+		owned = std::move(other.owned);
+		mapping = other.mapping;
+		size = other.size;
+		data = mapping != nullptr ? other.data : owned.data();
+		other.mapping = nullptr;
+		other.data = nullptr;
+		other.size = 0;
+	}
+	return *this;
+}
+
+Source::~Source() {
+	release();
+}
+
+void Source::release() {
+	if (mapping == nullptr) {
+		return;
+	}
+#if HOST == HOST_WIN
+	UnmapViewOfFile(mapping);
+#elif HOST == HOST_POSIX
+	munmap(mapping, size);
+#endif
+	mapping = nullptr;
+}
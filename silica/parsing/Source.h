@@ -0,0 +1,51 @@
+#pragma once
+#include "include.h"
+#include <string>
+#include <string_view>
+#include <optional>
+#include <istream>
+#include <filesystem>
+
+namespace Silica {
+
+// The text of a source file, held in one contiguous buffer.
+// Files are memory mapped where the host allows it, streams are read in large blocks.
+// The lexer walks 'text()' directly and diagnostics keep views into it, so a Source must
+// outlive every Parser and View made from it.
+class Source {
+public:
+	// Returns std::nullopt if the file couldn't be opened
+	static std::optional<Source> fromFile(const std::filesystem::path& path);
+	static Source fromStream(std::istream& stream, std::string name);
+	static Source fromString(std::string text, std::string name);
+
+	Source(Source&& other) noexcept;
+	Source& operator=(Source&& other) noexcept;
+	Source(const Source&) = delete;
+	Source& operator=(const Source&) = delete;
+	~Source();
+
+	std::string_view text() const {
+		return { data, size };
+	}
+	const std::string& name() const {
+		return sourceName;
+	}
+
+	// The line beginning at byte 'lineStart', without the newline
+	std::string_view lineAt(size_t lineStart) const;
+
+private:
+	Source(std::string name): sourceName(std::move(name)) {};
+	void release();
+
+	std::string sourceName;
+	const char* data = nullptr;
+	size_t size = 0;
+	// Used when the text was read instead of mapped
+	std::string owned;
+	// The mapped view, nullptr when the text is in 'owned'
+	void* mapping = nullptr;
+};
+
+}
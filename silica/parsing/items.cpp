@@ -0,0 +1,63 @@
+#include "parsing/items.h"
+#include "parsing/scan.h"
+
+using namespace Silica;
+
+std::vector<ItemRange> Silica::splitItems(std::string_view text) {
+	std::vector<ItemRange> items;
+	const char* begin = text.data();
+	const char* end = begin + text.size();
+	int depth = 0;
+	int line = 1;
+	uint32_t lineStart = 0;
+	// The item being split off, when 'inItem'
+	bool inItem = false;
+	ItemRange item {};
+	for (const char* it = begin; it != end; it++) {
+		switch (*it) {
+		case ' ':
+		case '\t':
+			break;
+		case '#':
+			// The newline after the comment is seen next
+			it = Scan::newline(it + 1, end) - 1;
+			break;
+		case '\n':
+			if (inItem && depth == 0) {
+				item.end = uint32_t(it + 1 - begin);
+				items.push_back(item);
+				inItem = false;
+			}
+			line++;
+			lineStart = uint32_t(it + 1 - begin);
+			break;
+		default:
+			if (!inItem) {
+				item = { lineStart, 0, line };
+				inItem = true;
+			}
+			if (*it == '{') {
+				depth++;
+			}
+			// A stray '}' is left for the parser to complain about
+			else if (*it == '}' && depth > 0) {
+				depth--;
+			}
+			break;
+		}
+	}
+	// An item without a newline at the end, or with braces that are never closed
+	if (inItem) {
+		item.end = uint32_t(text.size());
+		items.push_back(item);
+	}
+	return items;
+}
+
+uint64_t Silica::hashItem(std::string_view text) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (char c : text) {
+		hash = (hash ^ uint8_t(c)) * 0x100000001b3;
+	}
+	return hash;
+}
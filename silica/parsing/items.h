@@ -0,0 +1,26 @@
+#pragma once
+#include "include.h"
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace Silica {
+
+// A top level item of a source: a func with its body, or an extern.
+// It starts at the start of a line and ends after the newline of its last line, or at the end of the source
+struct ItemRange {
+	uint32_t begin;
+	uint32_t end;
+	// The line 'begin' is on, 1 based
+	int line;
+};
+
+// Splits 'text' into its top level items without lexing it. An item starts on the first line with more than
+// spaces, tabs and a comment while the brace depth is 0, and ends with the first line after which it's 0 again.
+// Braces in comments don't count. Between items there are only blank lines and comments, which have no tokens
+std::vector<ItemRange> splitItems(std::string_view text);
+
+// FNV-1a of an item's text, for telling whether it changed
+uint64_t hashItem(std::string_view text);
+
+}
@@ -0,0 +1,248 @@
+#include "parsing/scan.h"
+#include <cstdint>
+#include <optional>
+
+#if defined(__x86_64__) || defined(_M_X64)
+	#define SCAN_X64 1
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define TARGET_AVX2
+	#else
+		#define TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#else
+	#define SCAN_X64 0
+#endif
+
+using namespace Silica;
+
+namespace {
+	bool isIdentifierChar(char c) {
+		return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+	}
+
+	unsigned countTrailingZeros(uint32_t mask) {
+	#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+	#else
+		return __builtin_ctz(mask);
+	#endif
+	}
+
+	// Scalar, used for the tails of the vector scanners too
+	namespace Scalar {
+		const char* newline(const char* it, const char* end) {
+			while (it != end && *it != '\n') {
+				it++;
+			}
+			return it;
+		}
+		const char* spaces(const char* it, const char* end) {
+			while (it != end && (*it == ' ' || *it == '\t')) {
+				it++;
+			}
+			return it;
+		}
+		const char* identifier(const char* it, const char* end) {
+			while (it != end && isIdentifierChar(*it)) {
+				it++;
+			}
+			return it;
+		}
+		const char* digits(const char* it, const char* end) {
+			while (it != end && *it >= '0' && *it <= '9') {
+				it++;
+			}
+			return it;
+		}
+	}
+
+#if SCAN_X64
+	// The masks have a bit set for each byte that is part of the run.
+	// Bytes >= 0x80 compare as negative, so they never fall in an ASCII range
+	namespace Sse2 {
+		inline __m128i inRange(__m128i bytes, char low, char high) {
+			return _mm_and_si128(
+				_mm_cmpgt_epi8(bytes, _mm_set1_epi8(char(low - 1))),
+				_mm_cmplt_epi8(bytes, _mm_set1_epi8(char(high + 1))));
+		}
+
+		template<typename InRun, typename Tail>
+		const char* scan(const char* it, const char* end, InRun inRun, Tail tail) {
+			while (end - it >= 16) {
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				uint32_t stop = ~uint32_t(_mm_movemask_epi8(inRun(bytes))) & 0xFFFF;
+				if (stop != 0) {
+					return it + countTrailingZeros(stop);
+				}
+				it += 16;
+			}
+			return tail(it, end);
+		}
+
+		const char* newline(const char* it, const char* end) {
+			return scan(it, end, [](__m128i bytes) {
+				return _mm_xor_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')), _mm_set1_epi8(-1));
+			}, Scalar::newline);
+		}
+		const char* spaces(const char* it, const char* end) {
+			return scan(it, end, [](__m128i bytes) {
+				return _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')));
+			}, Scalar::spaces);
+		}
+		const char* identifier(const char* it, const char* end) {
+			return scan(it, end, [](__m128i bytes) {
+				// Setting bit 5 folds 'A'..'Z' onto 'a'..'z' without moving any other byte into that range
+				__m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+				return _mm_or_si128(
+					_mm_or_si128(inRange(bytes, '0', '9'), inRange(lower, 'a', 'z')),
+					_mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+			}, Scalar::identifier);
+		}
+		const char* digits(const char* it, const char* end) {
+			return scan(it, end, [](__m128i bytes) {
+				return inRange(bytes, '0', '9');
+			}, Scalar::digits);
+		}
+	}
+
+	// The same as Sse2 but 32 bytes wide
+	namespace Avx2 {
+		TARGET_AVX2 inline __m256i inRange(__m256i bytes, char low, char high) {
+			return _mm256_and_si256(
+				_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(char(low - 1))),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8(char(high + 1)), bytes));
+		}
+
+		// A macro rather than a template taking a lambda, lambdas don't inherit the target attribute
+		#define AVX2_SCAN(inRunExpr, tail) \
+			while (end - it >= 32) { \
+				__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it)); \
+				uint32_t stop = ~uint32_t(_mm256_movemask_epi8(inRunExpr)); \
+				if (stop != 0) { \
+					return it + countTrailingZeros(stop); \
+				} \
+				it += 32; \
+			} \
+			return Sse2::tail(it, end);
+
+		TARGET_AVX2 const char* newline(const char* it, const char* end) {
+			AVX2_SCAN(_mm256_xor_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')), _mm256_set1_epi8(-1)), newline)
+		}
+		TARGET_AVX2 const char* spaces(const char* it, const char* end) {
+			AVX2_SCAN(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'))), spaces)
+		}
+		TARGET_AVX2 const char* identifier(const char* it, const char* end) {
+			AVX2_SCAN(_mm256_or_si256(
+				_mm256_or_si256(inRange(bytes, '0', '9'), inRange(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), 'a', 'z')),
+				_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_'))), identifier)
+		}
+		TARGET_AVX2 const char* digits(const char* it, const char* end) {
+			AVX2_SCAN(inRange(bytes, '0', '9'), digits)
+		}
+		#undef AVX2_SCAN
+	}
+
+	bool hasAvx2() {
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		__cpuid(info, 1);
+		// The OS has to save the YMM registers too
+		bool osxsave = info[2] & (1 << 27);
+		bool avx = info[2] & (1 << 28);
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return info[1] & (1 << 5);
+	#else
+		return __builtin_cpu_supports("avx2");
+	#endif
+	}
+#endif
+
+	using Scanner = const char* (*)(const char*, const char*);
+	struct Scanners {
+		Scan::Mode mode;
+		Scanner newline;
+		Scanner spaces;
+		Scanner identifier;
+		Scanner digits;
+	};
+
+	std::optional<Scanners> scannersFor(Scan::Mode mode) {
+		switch (mode) {
+		case Scan::Mode::scalar:
+			return Scanners { mode, Scalar::newline, Scalar::spaces, Scalar::identifier, Scalar::digits };
+	#if SCAN_X64
+		case Scan::Mode::sse2:
+			// Part of x86_64 itself
+			return Scanners { mode, Sse2::newline, Sse2::spaces, Sse2::identifier, Sse2::digits };
+		case Scan::Mode::avx2:
+			if (hasAvx2()) {
+				return Scanners { mode, Avx2::newline, Avx2::spaces, Avx2::identifier, Avx2::digits };
+			}
+			return std::nullopt;
+	#endif
+		default:
+			return std::nullopt;
+		}
+	}
+
+	Scanners& scanners() {
+		static Scanners best = *scannersFor(
+			scannersFor(Scan::Mode::avx2) ? Scan::Mode::avx2 :
+			scannersFor(Scan::Mode::sse2) ? Scan::Mode::sse2 : Scan::Mode::scalar);
+		return best;
+	}
+}
+
+const char* Scan::newline(const char* begin, const char* end) {
+	return scanners().newline(begin, end);
+}
+
+const char* Scan::spaces(const char* begin, const char* end) {
+	return scanners().spaces(begin, end);
+}
+
+const char* Scan::identifier(const char* begin, const char* end) {
+	return scanners().identifier(begin, end);
+}
+
+const char* Scan::digits(const char* begin, const char* end) {
+	return scanners().digits(begin, end);
+}
+
+Scan::Mode Scan::mode() {
+	return scanners().mode;
+}
+
+bool Scan::supported(Mode mode) {
+	return scannersFor(mode).has_value();
+}
+
+bool Scan::setMode(Mode newMode) {
+	std::optional<Scanners> result = scannersFor(newMode);
+	if (!result.has_value()) {
+		return false;
+	}
+	scanners() = *result;
+	return true;
+}
+
+const char* Scan::describe(Mode mode) {
+	switch (mode) {
+	case Mode::scalar: return "scalar";
+	case Mode::sse2: return "SSE2";
+	case Mode::avx2: return "AVX2";
+	default: unreachable();
+	}
+	return "";
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "include.h"
+
+namespace Silica {
+
+// Scanners for the runs the lexer skips over, checking 16 (SSE2) or 32 (AVX2) bytes at a time.
+// The widest one the CPU supports is picked on first use, with a scalar fallback.
+// Each returns a pointer to the first byte in [begin, end) that ends the run, or 'end'.
+namespace Scan {
+	enum class Mode {
+		scalar, sse2, avx2
+	};
+
+	// The first '\n'
+	const char* newline(const char* begin, const char* end);
+	// The first byte that isn't ' ' or '\t'
+	const char* spaces(const char* begin, const char* end);
+	// The first byte that isn't [A-Za-z0-9_]
+	const char* identifier(const char* begin, const char* end);
+	// The first byte that isn't [0-9]
+	const char* digits(const char* begin, const char* end);
+
+	Mode mode();
+	// Whether the CPU can run 'mode'
+	bool supported(Mode mode);
+	// Returns false if the CPU can't run 'newMode', for benchmarking the fallbacks
+	bool setMode(Mode newMode);
+	const char* describe(Mode mode);
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "include.h"
+#include "parsing/symbols.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace Silica {
+
+// A stack of nested scopes that maps names to their innermost declaration in O(1).
+// Since symbols are dense, the visible declarations are kept in one table indexed by Symbol.
+// Every declaration logs what it shadowed, and leaving a scope undoes its part of the log.
+template<typename Decl>
+class ScopeStack {
+public:
+	void enter() {
+		scopeStarts.push_back(shadowed.size());
+	}
+
+	void leave() {
+		myAssert(!scopeStarts.empty(), "Left more scopes than were entered");
+		size_t start = scopeStarts.back();
+		scopeStarts.pop_back();
+		while (shadowed.size() > start) {
+			bindings[uint32_t(shadowed.back().name)] = shadowed.back().previous;
+			shadowed.pop_back();
+		}
+	}
+
+	// Makes 'name' refer to 'decl' until the current scope is left
+	void declare(Symbol name, Decl* decl) {
+		myAssert(!scopeStarts.empty(), "Declared a name outside of any scope");
+		uint32_t index = uint32_t(name);
+		if (index >= bindings.size()) {
+			bindings.resize(std::max<size_t>(symbolCount(), index + 1), nullptr);
+		}
+		shadowed.push_back({ name, bindings[index] });
+		bindings[index] = decl;
+	}
+
+	// The innermost declaration of 'name', or nullptr
+	Decl* find(Symbol name) const {
+		uint32_t index = uint32_t(name);
+		return index < bindings.size() ? bindings[index] : nullptr;
+	}
+
+private:
+	struct Shadowed {
+		Symbol name;
+		Decl* previous;
+	};
+	// Indexed by Symbol
+	std::vector<Decl*> bindings;
+	std::vector<Shadowed> shadowed;
+	// The size of 'shadowed' when each scope was entered
+	std::vector<size_t> scopeStarts;
+};
+
+}
@@ -0,0 +1,142 @@
+#include "parsing/symbols.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace Silica;
+
+namespace {
+	// Interned strings are copied into chunks of this size, so that most
+	// symbols don't need an allocation of their own
+	constexpr size_t chunkSize = 1 << 16;
+
+	struct SymbolTable {
+		std::shared_mutex mutex;
+		std::unordered_map<std::string_view, Symbol> symbols;
+		std::vector<std::string_view> names;
+		std::vector<std::unique_ptr<char[]>> chunks;
+		char* chunk = nullptr;
+		size_t chunkUsed = 0;
+
+		// Copies 'name' into storage that is never freed or moved
+		std::string_view store(std::string_view name) {
+			char* storage;
+			if (name.size() > chunkSize / 4) {
+				// Too big to share a chunk
+				chunks.emplace_back(new char[name.size()]);
+				storage = chunks.back().get();
+			}
+			else {
+				if (chunk == nullptr || chunkUsed + name.size() > chunkSize) {
+					chunks.emplace_back(new char[chunkSize]);
+					chunk = chunks.back().get();
+					chunkUsed = 0;
+				}
+				storage = chunk + chunkUsed;
+				chunkUsed += name.size();
+			}
+			std::copy(name.begin(), name.end(), storage);
+			return { storage, name.size() };
+		}
+	};
+
+	SymbolTable& table() {
+		static SymbolTable instance;
+		return instance;
+	}
+
+	// FNV-1a, identifiers are short so this beats the fancier hashes
+	uint64_t hashName(std::string_view name) {
+		uint64_t hash = 0xcbf29ce484222325;
+		for (char c : name) {
+			hash = (hash ^ uint8_t(c)) * 0x100000001b3;
+		}
+		return hash;
+	}
+
+	// Symbols this thread has already seen, so repeated names don't take the global lock.
+	// Open addressing, the names point into the global table's storage.
+	struct LocalCache {
+		struct Slot {
+			const char* data = nullptr;
+			uint32_t size = 0;
+			Symbol symbol {};
+		};
+		std::vector<Slot> slots = std::vector<Slot>(1024);
+		size_t used = 0;
+
+		Slot& find(std::string_view name, uint64_t hash) {
+			size_t mask = slots.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask) {
+				Slot& slot = slots[i];
+				if (slot.data == nullptr || std::string_view(slot.data, slot.size) == name) {
+					return slot;
+				}
+			}
+		}
+
+		void insert(std::string_view stored, uint64_t hash, Symbol symbol) {
+			if ((used + 1) * 2 > slots.size()) {
+				std::vector<Slot> old(slots.size() * 2);
+				std::swap(old, slots);
+				for (Slot& slot : old) {
+					if (slot.data != nullptr) {
+						std::string_view name(slot.data, slot.size);
+						find(name, hashName(name)) = slot;
+					}
+				}
+			}
+			find(stored, hash) = { stored.data(), uint32_t(stored.size()), symbol };
+			used++;
+		}
+	};
+	thread_local LocalCache localCache;
+
+	Symbol internGlobal(std::string_view name) {
+		SymbolTable& symbols = table();
+		{
+			std::shared_lock lock(symbols.mutex);
+			auto it = symbols.symbols.find(name);
+			if (it != symbols.symbols.end()) {
+				return it->second;
+			}
+		}
+		std::unique_lock lock(symbols.mutex);
+		// Another thread may have added it between the locks
+		auto it = symbols.symbols.find(name);
+		if (it != symbols.symbols.end()) {
+			return it->second;
+		}
+		std::string_view stored = symbols.store(name);
+		Symbol symbol = Symbol(symbols.names.size());
+		symbols.names.push_back(stored);
+		symbols.symbols.emplace(stored, symbol);
+		return symbol;
+	}
+}
+
+Symbol Silica::intern(std::string_view name) {
+	uint64_t hash = hashName(name);
+	LocalCache::Slot& slot = localCache.find(name, hash);
+	if (slot.data != nullptr) {
+		return slot.symbol;
+	}
+	Symbol symbol = internGlobal(name);
+	localCache.insert(symbolName(symbol), hash, symbol);
+	return symbol;
+}
+
+std::string_view Silica::symbolName(Symbol symbol) {
+	SymbolTable& symbols = table();
+	std::shared_lock lock(symbols.mutex);
+	return symbols.names[size_t(symbol)];
+}
+
+uint32_t Silica::symbolCount() {
+	SymbolTable& symbols = table();
+	std::shared_lock lock(symbols.mutex);
+	return uint32_t(symbols.names.size());
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "include.h"
+#include <cstdint>
+#include <string_view>
+
+namespace Silica {
+
+// An interned string. Two symbols are equal exactly when their strings are,
+// so names can be compared and hashed as integers.
+// Symbols are numbered densely from 0 in the order they were first interned.
+enum class Symbol: uint32_t {};
+
+// Returns the symbol for 'name', adding it to the global table if it's new.
+// Safe to call from several threads at once.
+Symbol intern(std::string_view name);
+
+// The string of an interned symbol, it stays valid for the rest of the program
+std::string_view symbolName(Symbol symbol);
+
+// The number of symbols interned so far, every Symbol is smaller than it
+uint32_t symbolCount();
+
+}
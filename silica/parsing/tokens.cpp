@@ -1,152 +1,9 @@
-﻿#include "parsing/Parser.h"
-#include <optional>
+﻿#include "parsing/tokens.h"
 #include <string>
 
 using namespace Silica;
 using namespace std::literals;
 
-bool Parser::next() {
-	if (stream.get(current)) {
-		// not eof
-		if (current == '\n') {
-			byte = 1;
-			line++;
-			referredLines.emplace_back("");
-			sourceLineReferred = false;
-		}
-		else if (current == '\t') {
-			referredLines.back() += "    ";
-			byte += 4;
-		}
-		else {
-			referredLines.back() += current;
-			byte++;
-		}
-		return true;
-	}
-	else {
-		return false;
-	}
-}
-
-void Parser::getToken(bool inclNewline) {
-	nextToken(inclNewline);
-	std::cout << '(' << descibeToken(token) << '-' << token_number << '-' << token_string << ")\n";
-}
-
-
-
-void Parser::nextToken(bool inclNewline) {
-	while (true) {
-		if (stream.eof()) {
-			token = Token::eof;
-			return;
-		}
-
-		// Skip white space
-		if (current == ' ' || current == '\t') {
-			next();
-			continue;
-		}
-
-		if (current == '\n') {
-			if (inclNewline) {
-				std::cout << "(token newline)\n";
-				token = Token::newline;
-				next();
-				return;
-			}
-			else {
-				std::cout << "ignored (token newline)\n";
-				next();
-			}
-			continue;
-		}
-
-		// Skip comments
-		if (current == '#') {
-			do {
-				if (!next()) {
-					token = Token::eof;
-					return;
-				}
-			} while (current != '\n');
-			continue;
-		}
-
-		// Parse number literals
-		if (isdigit(current)) {
-			token = Token::number;
-			token_number = current - '0';
-			while (next() && isdigit(current)) {
-				token_number = (token_number * 10) + current - '0';
-			}
-			return;
-		}
-
-		// Parse identifiers and keywords
-		if (isalpha(current)) {
-			token_string = std::string(1, current);
-			while (next() && (isalnum(current) || current == '_')) {
-				token_string.push_back(current);
-			}
-			auto result = keywords.find(token_string);
-			if (result != keywords.end()) {
-				token = result->second;
-			}
-			else {
-				token = Token::identifier;
-			}
-			return;
-		}
-
-		// Parse operators
-		std::string fetched(1, current);
-		bool found = false;
-		for (auto& pair : tokens) {
-			// Does pair.first start with fetched?
-			while (!pair.first.compare(0, fetched.size(), fetched)) {
-				// Direct match
-				if (pair.first.size() == fetched.size()) {
-					token = pair.second;
-					found = true;
-					if (!next()) {
-						return;
-					}
-					fetched.push_back(current);
-				}
-				else {
-					if (next()) {
-						fetched.push_back(current);
-					}
-				}
-
-			}
-		}
-		if (found) {
-			return;
-		}
-
-		err("Invalid char '"s + current + "' (" + std::to_string(current) + ")", current);
-		next();
-		continue;
-
-	}
-}
-
-void Parser::err(std::string msg, int fmtByte) {
-	errorCount++;
-	views.emplace_back(referredLines.back(), std::move(msg), View::Type::error, line, fmtByte);
-	sourceLineReferred = true;
-}
-
-void Parser::note(std::string msg, int fmtByte) {
-	views.emplace_back(referredLines.back(), std::move(msg), View::Type::note, line, fmtByte);
-	sourceLineReferred = true;
-}
-
-
-
 std::string Silica::descibeToken(Token tok) {
 	switch (tok) {
 	case Token::number: return "token number";
@@ -1,6 +1,7 @@
 #pragma once
 #include "include.h"
-#include <unordered_map>
+#include <array>
+#include <string_view>
 
 namespace Silica {
 
@@ -70,8 +71,8 @@ constexpr unsigned precedenceMultiplier = 8;
 
 
 constexpr bool isUnaryOp(Token tok) {
-	auto category = uint_least32_t(tok) & 0x00'FF'00;
-	return category == 0x02'00 || category == 0x03'00;
+	auto category = uint_least32_t(tok) & 0xFF'00'00;
+	return category == 0x02'00'00 || category == 0x03'00'00;
 }
 
 // Returns 0 if it isnt an operator
@@ -81,7 +82,12 @@ constexpr inline unsigned getTokenPrecedence(Token tok) {
 
 std::string descibeToken(Token tok);
 
-const std::unordered_map<std::string_view, Token> tokens = {
+struct OperatorSpelling {
+	std::string_view text;
+	Token token;
+};
+
+constexpr std::array<OperatorSpelling, 27> operatorSpellings = {{
 	{"->", Token::arrow},
 	{":",  Token::colon},
 	{"=",  Token::asign},
@@ -110,20 +116,100 @@ const std::unordered_map<std::string_view, Token> tokens = {
 	{">=", Token::greaterEquals},
 	{"<=", Token::smallerEquals}
 	//{"\n", Token::newline}
+}};
+
+// The operators grouped by their first byte, longest first within a group, so the
+// first spelling that matches is the maximal munch.
+// Multi-byte UTF-8 operators ('×', '÷') share a lead byte and are told apart by the full compare.
+struct OperatorTable {
+	std::array<OperatorSpelling, operatorSpellings.size()> sorted {};
+	// Index into 'sorted' and number of spellings for each first byte
+	std::array<uint8_t, 256> first {};
+	std::array<uint8_t, 256> count {};
 };
 
+constexpr OperatorTable makeOperatorTable() {
+	OperatorTable table;
+	for (size_t i = 0; i < operatorSpellings.size(); i++) {
+		table.sorted[i] = operatorSpellings[i];
+	}
+	auto before = [](const OperatorSpelling& a, const OperatorSpelling& b) {
+		uint8_t aFirst = uint8_t(a.text[0]);
+		uint8_t bFirst = uint8_t(b.text[0]);
+		return aFirst != bFirst ? aFirst < bFirst : a.text.size() > b.text.size();
+	};
+	// Insertion sort, std::sort isn't constexpr
+	for (size_t i = 1; i < table.sorted.size(); i++) {
+		OperatorSpelling spelling = table.sorted[i];
+		size_t j = i;
+		while (j > 0 && before(spelling, table.sorted[j - 1])) {
+			table.sorted[j] = table.sorted[j - 1];
+			j--;
+		}
+		table.sorted[j] = spelling;
+	}
+	for (size_t i = table.sorted.size(); i-- > 0;) {
+		uint8_t firstByte = uint8_t(table.sorted[i].text[0]);
+		table.first[firstByte] = uint8_t(i);
+		table.count[firstByte]++;
+	}
+	return table;
+}
+
+inline constexpr OperatorTable operatorTable = makeOperatorTable();
+
+// Matches the longest operator at the start of 'text'.
+// Returns its length in bytes and sets 'token', or returns 0 if no operator starts there
+constexpr size_t matchOperator(std::string_view text, Token& token) {
+	if (text.empty()) {
+		return 0;
+	}
+	uint8_t firstByte = uint8_t(text[0]);
+	size_t end = size_t(operatorTable.first[firstByte]) + operatorTable.count[firstByte];
+	for (size_t i = operatorTable.first[firstByte]; i < end; i++) {
+		const OperatorSpelling& spelling = operatorTable.sorted[i];
+		if (text.substr(0, spelling.text.size()) == spelling.text) {
+			token = spelling.token;
+			return spelling.text.size();
+		}
+	}
+	return 0;
+}
+
 const std::string_view operator_chars = ":=,*+-/×÷<>()";
 
-const std::unordered_map<std::string_view, Token> keywords = {
-	{"func",    Token::keyword_func},
-	{"use",     Token::keyword_extern},
-	{"return",  Token::keyword_return},
-	{"let",     Token::keyword_let},
-	{"if",      Token::keyword_if},
-	{"else",    Token::keyword_else},
-	{"elif",    Token::keyword_elif},
-	{"__NL",    Token::newline},
-	{"__EOF",   Token::eof}
-};
+// Returns the keyword spelled by 'word', or Token::identifier if it isn't one.
+// Dispatches on the length and first char, so at most one string compare is done
+constexpr Token keywordToken(std::string_view word) {
+	auto is = [&](std::string_view keyword, Token keywordToken) {
+		return word == keyword ? keywordToken : Token::identifier;
+	};
+	switch (word.size()) {
+	case 2:
+		return is("if", Token::keyword_if);
+	case 3:
+		switch (word[0]) {
+		case 'u': return is("use", Token::keyword_extern);
+		case 'l': return is("let", Token::keyword_let);
+		}
+		break;
+	case 4:
+		switch (word[0]) {
+		case 'f': return is("func", Token::keyword_func);
+		case '_': return is("__NL", Token::newline);
+		case 'e':
+			if (word[2] == 's') {
+				return is("else", Token::keyword_else);
+			}
+			return is("elif", Token::keyword_elif);
+		}
+		break;
+	case 5:
+		return is("__EOF", Token::eof);
+	case 6:
+		return is("return", Token::keyword_return);
+	}
+	return Token::identifier;
+}
 
 }; // End namespace Silica
\ No newline at end of file
@@ -0,0 +1,351 @@
+#pragma once
+#include "include.h"
+#include "parsing/Lexer.h"
+#include "parsing/Parser.h"
+#include "ast/flat.h"
+#include "compiling/backend.h"
+#include "compiling/bytecode.h"
+#include "compiling/ir.h"
+#include "compiling/passes.h"
+#include "compiling/threadpool.h"
+#include "parsing/Source.h"
+#include "parsing/scan.h"
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <sstream>
+
+namespace Silica {
+constexpr size_t benchSourceBytes = 8 << 20;
+constexpr int benchRepeats = 5;
+// Results are written here so the timed work can't be optimised out
+inline volatile double benchSink = 0;
+// Set when one of the checks below fails
+inline bool benchFailed = false;
+
+// Checks what a benchmark worked out, in every build unlike myAssert
+inline void benchCheck(bool ok, std::string_view what) {
+	if (!ok) {
+		std::cout << "Check failed: " << what << '\n';
+		benchFailed = true;
+	}
+}
+
+// A generated source of roughly 'bytes' bytes that uses every kind of token
+inline std::string benchSource(size_t bytes) {
+	std::string text;
+	text.reserve(bytes + 256);
+	for (size_t i = 0; text.size() < bytes; i++) {
+		std::string n = std::to_string(i);
+		text += "# kernel number " + n + ", generated for the lexer benchmark. Scales the product of both inputs,\n";
+		text += "# then folds in a constant offset so that the result stays within the range the caller expects\n";
+		text += "func kernel_" + n + "(first: Float64, second_value: Float64) -> Float64 {\n";
+		text += "\tlet a" + n + " = first * second_value + 2 ** 3 * 1000 - (first / 4)\n";
+		text += "\tlet b" + n + " = a" + n + " × 2 ÷ first\n";
+		text += "\tif b" + n + " >= 10 {\n\t\treturn b" + n + " -= 1\n\t} elif first <= 2 {\n\t\treturn [a" + n + "]\n\t}\n";
+		text += "\treturn -a" + n + ", b" + n + "\n}\n\n";
+	}
+	return text;
+}
+
+// A generated source of roughly 'bytes' bytes that the parser accepts without errors
+inline std::string benchParserSource(size_t bytes) {
+	std::string text = "func kernel_0(first: Float64, second: Float64) -> Float64 {\n\treturn first * second\n}\n";
+	for (size_t i = 1; text.size() < bytes; i++) {
+		std::string n = std::to_string(i);
+		text += "func kernel_" + n + "(first: Float64, second: Float64) -> Float64 {\n";
+		text += "\tlet a = first * second + 2 ** 3 * 1000 - (first / 4)\n";
+		text += "\tlet b = a * 2 / first - -second\n";
+		text += "\treturn kernel_" + std::to_string(i - 1) + "(first: a, second: b) + b\n}\n";
+	}
+	return text;
+}
+
+template<typename Fn>
+double benchMilliseconds(Fn fn) {
+	auto start = std::chrono::high_resolution_clock::now();
+	fn();
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(end - start).count();
+}
+
+// Reports the lexer's throughput with each scanner the CPU supports, best of 'benchRepeats' runs
+inline void benchLexer() {
+	Source source = Source::fromString(benchSource(benchSourceBytes), "lexer benchmark");
+	Scan::Mode defaultMode = Scan::mode();
+	for (Scan::Mode mode : { Scan::Mode::scalar, Scan::Mode::sse2, Scan::Mode::avx2 }) {
+		if (!Scan::setMode(mode)) {
+			continue;
+		}
+		size_t tokenCount = 0;
+		double best = 0;
+		for (int i = 0; i < benchRepeats; i++) {
+			double ms = benchMilliseconds([&] {
+				tokenCount = Lexer(source.text()).tokens.size();
+			});
+			if (i == 0 || ms < best) {
+				best = ms;
+			}
+		}
+		double seconds = best / 1000;
+		std::cout << "Lexer (" << Scan::describe(mode) << "): " << tokenCount << " tokens, "
+		          << source.text().size() << " bytes in " << best << "ms\n"
+		          << "  " << tokenCount / seconds / 1e6 << "M tokens/s, "
+		          << source.text().size() / seconds / (1 << 20) << " MiB/s\n";
+	}
+	Scan::setMode(defaultMode);
+}
+
+// Walks the linked tree the way a pass over it has to: a switch on each node's kind, then a pointer to follow per child
+inline size_t benchTreeWalk(const Expression* expr, double& literalSum) {
+	if (expr == nullptr) {
+		return 0;
+	}
+	auto walkAll = [&](const std::vector<Expression*>& exprs) {
+		size_t count = 1;
+		for (const Expression* child : exprs) {
+			count += benchTreeWalk(child, literalSum);
+		}
+		return count;
+	};
+	switch (expr->kind) {
+	case ExprKind::numLit:
+		literalSum += static_cast<const NumLitExpr*>(expr)->value;
+		return 1;
+	case ExprKind::binOp: {
+		auto* binOp = static_cast<const BinOpExpr*>(expr);
+		return 1 + benchTreeWalk(binOp->left, literalSum) + benchTreeWalk(binOp->right, literalSum);
+	}
+	case ExprKind::unaryOp:
+		return 1 + benchTreeWalk(static_cast<const UnaryOpExpr*>(expr)->expr, literalSum);
+	case ExprKind::getVar:
+		return 1;
+	case ExprKind::setVar:
+		return 1 + benchTreeWalk(static_cast<const SetVarExpr*>(expr)->value, literalSum);
+	case ExprKind::callFunc:
+		return walkAll(static_cast<const CallFuncExpr*>(expr)->args);
+	case ExprKind::callExtern:
+		return walkAll(static_cast<const CallExternExpr*>(expr)->args);
+	case ExprKind::ret:
+		return 1 + benchTreeWalk(static_cast<const Return*>(expr)->value, literalSum);
+	case ExprKind::let:
+		return 1 + benchTreeWalk(static_cast<const Let*>(expr)->value, literalSum);
+	case ExprKind::ifExpr: {
+		auto* ifExpr = static_cast<const IfExpr*>(expr);
+		return 1 + benchTreeWalk(ifExpr->condition, literalSum) + benchTreeWalk(ifExpr->ifTrue, literalSum)
+		       + benchTreeWalk(ifExpr->ifFalse, literalSum);
+	}
+	case ExprKind::block:
+		return walkAll(static_cast<const Block*>(expr)->expressions);
+	}
+	unreachable();
+	return 0;
+}
+
+// Compares a pass over the linked Ast with the same pass over its FlatAst
+inline void benchAst() {
+	Source source = Source::fromString(benchParserSource(benchSourceBytes / 4), "ast benchmark");
+	Parser parser(source, "ast benchmark");
+	if (parser.errorCount != 0) {
+		parser.printErrors(std::cout);
+		return;
+	}
+	FlatAst flat;
+	double convertMs = benchMilliseconds([&] {
+		flat = FlatAst::from(parser.ast);
+	});
+
+	std::vector<uint32_t> subtreeSizes(flat.size());
+	size_t treeCount = 0, flatCount = 0;
+	double treeSum = 0, flatSum = 0;
+	double treeBest = 0, flatBest = 0;
+	for (int i = 0; i < benchRepeats; i++) {
+		double treeMs = benchMilliseconds([&] {
+			treeCount = 0;
+			treeSum = 0;
+			for (const Function* function : parser.ast.functions) {
+				treeCount += benchTreeWalk(function->result, treeSum);
+			}
+			benchSink = treeSum + treeCount;
+		});
+		double flatMs = benchMilliseconds([&] {
+			// Children come first, so one forward sweep sees every subtree before its root
+			flatSum = 0;
+			for (NodeIndex node = 0; node < flat.size(); node++) {
+				uint32_t count = 1;
+				for (const NodeIndex* child = flat.childrenBegin(node); child != flat.childrenEnd(node); child++) {
+					count += subtreeSizes[*child];
+				}
+				subtreeSizes[node] = count;
+				if (flat.kinds[node] == FlatKind::numLit) {
+					flatSum += flat.numbers[flat.data[node]];
+				}
+			}
+			flatCount = 0;
+			for (const FlatAst::Function& function : flat.functions) {
+				flatCount += subtreeSizes[function.body];
+			}
+			benchSink = flatSum + flatCount;
+		});
+		if (i == 0 || treeMs < treeBest) {
+			treeBest = treeMs;
+		}
+		if (i == 0 || flatMs < flatBest) {
+			flatBest = flatMs;
+		}
+	}
+	benchCheck(treeCount == flatCount && treeSum == flatSum, "The tree and flat walks disagree");
+	std::cout << "Ast walk: " << treeCount << " nodes, linked tree " << treeBest << "ms, flat "
+	          << flatBest << "ms (converted in " << convertMs << "ms, arena " << parser.ast.arena.bytesAllocated()
+	          << " bytes, flat " << flat.size() * (sizeof(FlatKind) + sizeof(const Type*) + 3 * sizeof(uint32_t)) + flat.children.size() * sizeof(NodeIndex)
+	          << " bytes)\n";
+}
+
+// 'functions' functions that call each other, and a main that calls the last of them
+inline std::string benchProgramSource(size_t functions) {
+	std::string text = "func kernel_0(first: Float64, second: Float64) -> Float64 {\n\treturn first * second\n}\n";
+	for (size_t i = 1; i < functions; i++) {
+		std::string n = std::to_string(i);
+		text += "func kernel_" + n + "(first: Float64, second: Float64) -> Float64 {\n";
+		text += "\tlet a = first * second / 3 - (first / 4)\n";
+		text += "\tif a > 100 {\n\t\treturn kernel_" + std::to_string(i - 1) + "(first: first / 2, second: second)\n\t}\n";
+		text += "\treturn kernel_" + std::to_string(i - 1) + "(first: a, second: -second) + 1\n}\n";
+	}
+	text += "func main() -> Float64 {\n\treturn kernel_" + std::to_string(functions - 1) + "(first: 3 / 2, second: 2)\n}\n";
+	return text;
+}
+
+// Time from the source to the result of main, interpreting bytecode against compiling with the passes.
+// Programs that run once and briefly spend most of their time being compiled, which the interpreter skips
+inline void benchTimeToFirstResult() {
+	Source source = Source::fromString(benchProgramSource(2000), "time to first result benchmark");
+	double interpreted = 0, compiled = 0;
+	double interpretBest = 0, compileBest = 0;
+	for (int i = 0; i < benchRepeats; i++) {
+		double interpretMs = benchMilliseconds([&] {
+			Parser parser(source, "time to first result benchmark");
+			const Function* main = parser.ast.functionsByName.at(intern("main"));
+			BytecodeModule module = BytecodeModule::from(parser.ast);
+			Compiler compiler = Compiler::compilerX64();
+			Backend::addExterns(compiler);
+			interpreted = interpret(module, uint32_t(std::find(parser.ast.functions.begin(), parser.ast.functions.end(), main)
+			                                         - parser.ast.functions.begin()), compiler);
+		});
+		double compileMs = benchMilliseconds([&] {
+			Parser parser(source, "time to first result benchmark");
+			const Function* main = parser.ast.functionsByName.at(intern("main"));
+			IrModule module = IrModule::from(parser.ast);
+			PassManager(Options::passPipeline).run(module, nullptr);
+			Compiler compiler = Compiler::compilerX64();
+			Backend backend(compiler, module);
+			backend.compile();
+			uint32_t entry = uint32_t(std::find_if(module.functions.begin(), module.functions.end(), [&](const IrFunction& function) {
+				return function.source == main;
+			}) - module.functions.begin());
+			compiled = compiler.run(backend.codeSections[entry], backend.entryPoints[entry]);
+		});
+		if (i == 0 || interpretMs < interpretBest) {
+			interpretBest = interpretMs;
+		}
+		if (i == 0 || compileMs < compileBest) {
+			compileBest = compileMs;
+		}
+	}
+	benchSink = interpreted + compiled;
+	benchCheck(interpreted == compiled || (std::isnan(interpreted) && std::isnan(compiled)), "The interpreter and the compiled code disagree");
+	std::cout << "Time to first result: " << source.text().size() << " bytes, interpreted " << interpretBest
+	          << "ms, compiled " << compileBest << "ms\n";
+}
+
+// Parsing a module of about 50k lines against parsing it again after a one line edit, which only parses that item.
+// The edited module's bytecode reuses every function but the edited one, and gives what compiling it afresh does
+inline void benchReparse() {
+	constexpr size_t functions = 7200;
+	std::string text = benchProgramSource(functions);
+	Source source = Source::fromString(text, "reparse benchmark");
+	std::string edited = text;
+	size_t line = edited.find("\tlet a = first * second / 3", edited.find("func kernel_" + std::to_string(functions / 2) + "("));
+	edited.replace(line, 27, "\tlet a = first * second / 5");
+	Source editedSource = Source::fromString(edited, "reparse benchmark");
+
+	std::optional<Parser> parser;
+	double parseMs = benchMilliseconds([&] {
+		parser.emplace(source, "reparse benchmark");
+	});
+	BytecodeModule module = BytecodeModule::from(parser->ast);
+	double reparseMs = benchMilliseconds([&] {
+		parser->reparse(editedSource);
+	});
+	BytecodeModule reused;
+	double rebuildMs = benchMilliseconds([&] {
+		reused = BytecodeModule::from(parser->ast, &module);
+	});
+	benchCheck(parser->errorCount == 0 && parser->parsedItems == 1, "Only the edited item should be parsed again");
+
+	Parser fresh(editedSource, "reparse benchmark");
+	auto entry = [](const Parser& parser) {
+		const Function* main = parser.ast.functionsByName.at(intern("main"));
+		return uint32_t(std::find(parser.ast.functions.begin(), parser.ast.functions.end(), main) - parser.ast.functions.begin());
+	};
+	Compiler compiler = Compiler::compilerX64();
+	Backend::addExterns(compiler);
+	double result = interpret(reused, entry(*parser), compiler);
+	double expected = interpret(BytecodeModule::from(fresh.ast), entry(fresh), compiler);
+	benchSink = result;
+	benchCheck(result == expected || (std::isnan(result) && std::isnan(expected)), "Reused bytecode disagrees with a fresh parse");
+	std::cout << "Reparse: " << parser->items.size() << " items, " << std::count(text.begin(), text.end(), '\n')
+	          << " lines, parsed in " << parseMs << "ms, one line edit reparsed in " << reparseMs << "ms ("
+	          << parser->reusedItems << " items reused), bytecode rebuilt in " << rebuildMs << "ms\n";
+}
+
+// Parsing a module of thousands of functions on one thread and on a pool. The bodies are parsed on the pool,
+// after the signatures, and the printed Asts and diagnostics have to be the same
+inline void benchParallelParse() {
+	Source source = Source::fromString(benchProgramSource(20000), "parallel parse benchmark");
+	ThreadPool pool;
+	size_t functionCount = 0;
+	double serialBest = 0, parallelBest = 0;
+	for (int i = 0; i < benchRepeats; i++) {
+		double serialMs = benchMilliseconds([&] {
+			Parser parser(source, "parallel parse benchmark");
+			functionCount = parser.ast.functions.size();
+		});
+		double parallelMs = benchMilliseconds([&] {
+			Parser parser(source, "parallel parse benchmark", &pool);
+			benchSink = double(parser.ast.functions.size());
+		});
+		if (i == 0 || serialMs < serialBest) {
+			serialBest = serialMs;
+		}
+		if (i == 0 || parallelMs < parallelBest) {
+			parallelBest = parallelMs;
+		}
+	}
+
+	auto printed = [&](ThreadPool* pool) {
+		Parser parser(source, "parallel parse benchmark", pool);
+		std::ostringstream out;
+		parser.printErrors(out);
+		parser.ast.print(out);
+		return out.str();
+	};
+	benchCheck(printed(nullptr) == printed(&pool), "Parsing on a pool gave a different Ast or diagnostics");
+	std::cout << "Parallel parse: " << functionCount << " functions, " << source.text().size() << " bytes, one thread "
+	          << serialBest << "ms, " << pool.size() << " threads " << parallelBest << "ms\n";
+}
+
+// Returns false when a check failed
+inline bool bench() {
+	benchLexer();
+	benchAst();
+	benchTimeToFirstResult();
+	benchReparse();
+	benchParallelParse();
+	return !benchFailed;
+}
+
+}
@@ -1,11 +1,20 @@
 #pragma once
 #include "include.h"
+#include "parsing/Source.h"
+#include "parsing/Parser.h"
+#include "compiling/bytecode.h"
+#include "compiling/backend.h"
+#include "compiling/ir.h"
+#include "compiling/host.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <chrono>
 #include <csignal>
 #include <cstdint>
-#include <numbers>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
 
 
 #ifndef PROJECT_DIR
@@ -16,7 +25,7 @@
 
 namespace Silica {
 constexpr int startTest = 6;
-constexpr int endTest = 6;
+constexpr int endTest = 12;
 
 
 template <typename T>
@@ -29,11 +38,98 @@ std::ostream& operator<<(std::ostream& os, std::vector<T> vec) {
 
 
 
+// Enough to leave more than Parser::compactMinimum replaced bytes behind a few times, ending on the edited source
+constexpr int reparseEdits = 2000;
+
+// Reparses test9 after changing one line of g. Only g should be parsed again, and bytecode that reuses
+// the other functions has to give what a fresh parse of the edited source gives
+inline bool testReparse() {
+	std::string file = std::string(TESTS_DIR_PREFIX) + "test9.silica";
+	std::optional<Source> source = Source::fromFile(file);
+	if (!source.has_value()) {
+		std::cerr << "Couldn't open file " << file;
+		return false;
+	}
+	std::string text(source->text());
+	size_t line = text.find("let b = n * 7 - 20");
+	if (line == std::string::npos) {
+		std::cout << "Reparse test: test9 doesn't have the line it edits\n";
+		return false;
+	}
+	text.replace(line, 18, "let b = n * 6 - 20");
+	Source edited = Source::fromString(text, file);
+
+	Parser parser(*source, "reparse test");
+	BytecodeModule module = BytecodeModule::from(parser.ast);
+	parser.reparse(edited);
+	Parser fresh(edited, "reparse test");
+	auto entry = [](const Parser& parser) {
+		const Function* main = parser.ast.functionsByName.at(intern("main"));
+		return uint32_t(std::find(parser.ast.functions.begin(), parser.ast.functions.end(), main) - parser.ast.functions.begin());
+	};
+	Compiler compiler = Compiler::compilerX64();
+	Backend::addExterns(compiler);
+	double result = interpret(BytecodeModule::from(parser.ast, &module), entry(parser), compiler);
+	double expected = interpret(BytecodeModule::from(fresh.ast), entry(fresh), compiler);
+	bool passed = parser.errorCount == 0 && parser.parsedItems == 1 && result == expected;
+	std::cout << "Reparse test: " << parser.parsedItems << " of " << parser.items.size() << " items parsed again, returned "
+	          << result << ", a fresh parse returned " << expected << (passed ? "\n" : "\nFAILED\n");
+
+	// Editing back and forth leaves the replaced nodes behind, until there are enough of them to clear the arena.
+	// The bytecode carried along mustn't reuse functions from before it was cleared
+	BytecodeModule carried = BytecodeModule::from(parser.ast, &module);
+	for (int i = 0; i < reparseEdits; i++) {
+		parser.reparse(i % 2 == 0 ? *source : edited);
+		carried = BytecodeModule::from(parser.ast, &carried);
+	}
+	double carriedResult = interpret(carried, entry(parser), compiler);
+	size_t freshBytes = fresh.ast.arena.bytesAllocated();
+	size_t limit = freshBytes + std::max(freshBytes, Parser::compactMinimum) + Arena::blockSize;
+	bool bounded = parser.ast.generation > 0 && parser.ast.arena.bytesAllocated() <= limit && carriedResult == expected;
+	std::cout << "Reparse test: after " << reparseEdits << " more edits the arena has " << parser.ast.arena.bytesAllocated()
+	          << " bytes, it was cleared " << parser.ast.generation << " times, returned " << carriedResult
+	          << (bounded ? "\n" : "\nFAILED\n");
+	return passed && bounded;
+}
+
+// Calls pow through its thunk directly, the compiled code only uses it when pow is out of its reach.
+// The thunk reads the address stored after its jump, so this fails where code can't be read
+inline bool testThunk() {
+	Source source = Source::fromString("func power(p: Float64) -> Float64 {\n\treturn 2 ** p\n}\n", "thunk test");
+	Parser parser(source, "thunk test");
+	IrModule module = IrModule::from(parser.ast);
+	Compiler compiler = Compiler::compilerX64();
+	Backend backend(compiler, module);
+	backend.compile();
+	compiler.link();
+	auto thunk = reinterpret_cast<double(*)(double, double)>(compiler.thunk(compiler.addExtern("pow")));
+	bool passed = thunk != nullptr && thunk(2, 3) == 8;
+	std::cout << "Thunk test: " << (thunk == nullptr ? "pow has no thunk" : "pow(2, 3) returned " + std::to_string(thunk(2, 3)))
+	          << (passed ? "\n" : "\nFAILED\n");
+	return passed;
+}
+
+// The value after "# Should return" on a test's first line, if it has one
+inline std::optional<double> expectedResult(std::string_view text) {
+	constexpr std::string_view marker = "# Should return ";
+	if (text.substr(0, marker.size()) != marker) {
+		return std::nullopt;
+	}
+	return std::strtod(std::string(text.substr(marker.size(), 32)).c_str(), nullptr);
+}
+
+// The comments round to 6 decimals
+inline bool matchesExpected(std::optional<double> result, double expected) {
+	return result.has_value() && std::abs(*result - expected) <= 1e-6 * std::max(1.0, std::abs(expected));
+}
+
+// Returns false when a check failed
 inline bool test() {
+	bool passed = true;
 	for (size_t i = startTest; i <= endTest; i++) {
 		std::string file = std::string(TESTS_DIR_PREFIX) + "test" + std::to_string(i) + ".silica";
-		std::ifstream stream {file};
-		if (!stream.is_open()) {
+		std::optional<Source> source = Source::fromFile(file);
+		if (!source.has_value()) {
 			std::cerr << "Couldn't open file " << file;
 			continue;
 		}
@@ -42,15 +138,46 @@ inline bool test() {
 		// Run test
 		std::cout << "Test " << i << "\n";
 		auto start = std::chrono::high_resolution_clock::now();
-		std::optional<double> returnVal = run(stream, file, std::cout);
+		std::optional<double> returnVal = run(*source, std::cout);
 		auto end = std::chrono::high_resolution_clock::now();
 		std::cout << "\nReturn value = " << (returnVal.has_value() ? std::to_string(returnVal.value()) : "nil") 
 		          << ",\nCompleted in "
 		          << std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(end - start).count()
 				  << "ms\n";
-		stream.close();		
+		CodeHeap::Stats heap = CodeHeap::global().stats();
+		std::cout << "Code heap: " << heap.usedBytes << " bytes in " << heap.usedBlocks << " blocks used, "
+		          << heap.freeRanges << " free ranges, fragmentation " << heap.fragmentation()
+		          << ", " << heap.protectCalls << " protection changes, " << heap.lostBytes << " bytes lost\n";
+
+		// Tests that say what they return are run by the interpreter too, and compiled in the tier mode that
+		// wasn't used above: optimised up front when functions tier up, and tiering up otherwise. All have to agree
+		std::optional<double> expected = expectedResult(source->text());
+		if (expected.has_value()) {
+			auto runWith = [&](bool interpret, uint64_t tierUpCalls) {
+				bool savedInterpret = Options::interpret;
+				uint64_t savedTierUpCalls = Options::tierUpCalls;
+				Options::interpret = interpret;
+				Options::tierUpCalls = tierUpCalls;
+				std::ostringstream output;
+				std::optional<double> result = run(*source, output);
+				Options::interpret = savedInterpret;
+				Options::tierUpCalls = savedTierUpCalls;
+				return result;
+			};
+			std::optional<double> interpreted = runWith(true, Options::tierUpCalls);
+			std::optional<double> otherTier = runWith(false, Options::tierUpCalls == 0 ? 1000 : 0);
+			bool matches = matchesExpected(returnVal, *expected) && matchesExpected(interpreted, *expected)
+			               && matchesExpected(otherTier, *expected);
+			std::cout << "Expected " << std::to_string(*expected) << ", interpreted "
+			          << (interpreted.has_value() ? std::to_string(interpreted.value()) : "nil") << ", "
+			          << (Options::tierUpCalls == 0 ? "tiered " : "optimised up front ")
+			          << (otherTier.has_value() ? std::to_string(otherTier.value()) : "nil")
+			          << (matches ? "\n" : "\nFAILED\n");
+			passed = passed && matches;
+		}
 	}
-	return false;
+	passed = testThunk() && passed;
+	return testReparse() && passed;
 }
 
 }
\ No newline at end of file